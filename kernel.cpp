@@ -5,23 +5,92 @@
 
 #include "kernel.h"
 
+#ifdef KERNEL_PORT_HOST
+  #include <signal.h>
+  #include <sys/time.h>
+  #include <ucontext.h>
+  #if KERNEL_MAX_CORES > 1
+    #include <atomic>
+    #include <chrono>
+    #include <condition_variable>
+    #include <mutex>
+    #include <thread>
+  #endif
+  #define PORT_STACK_EXTRA (sizeof(ucontext_t) + 32)  // Context + alignment
+  static volatile sig_atomic_t portPreemptDue = false;  // Tick seen, switch not yet taken
+#else
+  #define PORT_STACK_EXTRA 8                           // 8-byte SP alignment
+#endif
+
+#if defined(__AVR__)
+  #include <avr/sleep.h>
+#elif defined(ARDUINO_ARCH_MBED) && !defined(KERNEL_STACKFUL_TASKS)
+  #include <mbed.h>
+#endif
+
+#ifdef KERNEL_SDRAM_HEAP_ADDR
+  #include <SDRAM.h>
+#endif
+
 // ============================================================================
 // STATIC MEMBER INITIALIZATION
 // ============================================================================
 
-Task Kernel::tasks[MAX_TASKS];
-int Kernel::currentTaskId = 0;
-int Kernel::nextTaskId = 1;
+TaskTable Kernel::tasks;
+Task Kernel::firstTaskChunk[TASK_POOL_CHUNK];
+TaskCold Kernel::firstColdChunk[TASK_POOL_CHUNK];
+TaskHotTable Kernel::taskHot;
+int Kernel::taskSlots = 0;
+int Kernel::taskFreeHead = -1;
+int Kernel::currentTaskIds[KERNEL_MAX_CORES];
+RunQueue Kernel::runQueues[KERNEL_MAX_CORES];
+Task Kernel::coreIdle[KERNEL_MAX_CORES];
+SchedulerStats Kernel::schedStats;
+
+int Kernel::sleepHeap[MAX_TASKS];
+int Kernel::sleepHeapSize = 0;
+uint32_t Kernel::tickLastMillis = 0;
+uint32_t Kernel::tickEpoch = 0;
 
-uint8_t Kernel::kernelHeap[KERNEL_HEAP_SIZE];
-size_t Kernel::heapUsed = 0;
+uint32_t Kernel::switchStartCycles = 0;
+int Kernel::zombieCount = 0;
+IdleStats Kernel::idleStats;
+uint32_t Kernel::loadSampleMillis = 0;
+uint32_t Kernel::loadSampleCycles = 0;
+uint16_t Kernel::systemLoad = 0;
+
+uint8_t Kernel::kernelHeap[KERNEL_HEAP_SIZE] __attribute__((aligned(16)));
+HeapControl Kernel::heaps[MEM_REGION_COUNT];
+MemoryBlock* Kernel::compactCursor = nullptr;
+int Kernel::compactRegion = MEM_REGION_SRAM;
+CompactStats Kernel::compactStats;
+ReallocStats Kernel::reallocStats;
+#if KERNEL_MEM_TRACE
+MemTraceEntry Kernel::memTrace[KERNEL_MEM_TRACE];
+uint32_t Kernel::memTraceTotal = 0;
+  #define MEM_TRACE(op, ptr, size, aux, hint) \
+    memTraceRecord(op, ptr, size, aux, hint, __builtin_return_address(0))
+#else
+  #define MEM_TRACE(op, ptr, size, aux, hint)
+#endif
 
 FileHandle Kernel::fileHandles[MAX_FILE_HANDLES];
 DirHandle Kernel::dirHandles[MAX_DIR_HANDLES];
 bool Kernel::sdInitialized = false;
+uint8_t* Kernel::spiBounce = nullptr;
+bool Kernel::spiBounceBusy = false;
 
-MessageQueue Kernel::messageQueues[MAX_TASKS];
 Semaphore Kernel::semaphores[MAX_SEMAPHORES];
+Mutex Kernel::mutexes[MAX_MUTEXES];
+MemHandle Kernel::memHandles[MAX_MEM_HANDLES];
+MemPool Kernel::memPools[MAX_MEM_POOLS];
+int Kernel::mailboxPool = -1;
+MemShrinker Kernel::memShrinkers[MAX_MEM_SHRINKERS];
+MemPressureStats Kernel::pressureStats;
+uint8_t Kernel::lowWatermark = KERNEL_MEM_LOW_WATERMARK;
+uint8_t Kernel::minWatermark = KERNEL_MEM_MIN_WATERMARK;
+bool Kernel::shrinking = false;
+bool Kernel::pressureSending = false;
 
 bool Kernel::watchdogEnabled = true;
 uint32_t Kernel::watchdogLastCheck = 0;
@@ -43,12 +112,41 @@ bool Kernel::init() {
   Serial.println(F("Features: Watchdog, IPC, DDI, Stack Traces"));
   Serial.println(F("Initializing..."));
   
-  // Initialize all tasks as empty
-  for (int i = 0; i < MAX_TASKS; i++) {
-    tasks[i].state = TASK_EMPTY;
-    tasks[i].id = -1;
-    tasks[i].stackTraceDepth = 0;
+  // The first chunk of task slots is static: slot 0 is idle, the rest
+  // start the free list. Further chunks come from the heap on demand.
+  tasks.chunks[0] = firstTaskChunk;
+  tasks.coldChunks[0] = firstColdChunk;
+  taskSlots = TASK_POOL_CHUNK;
+  taskFreeHead = -1;
+  for (int i = TASK_POOL_CHUNK - 1; i >= 0; i--) {
+    firstTaskChunk[i].id = i;
+    firstTaskChunk[i].generation = 0;
+    initTaskSlot(&firstTaskChunk[i]);
+    if (i > 0) {
+      firstTaskChunk[i].readyNext = taskFreeHead;
+      taskFreeHead = i;
+    }
+  }
+  
+  // Initialize run queues, one per core
+  for (int core = 0; core < KERNEL_MAX_CORES; core++) {
+    RunQueue* queue = &runQueues[core];
+    queue->readyBitmap = 0;
+    queue->count = 0;
+    for (int i = 0; i < MAX_PRIORITIES; i++) {
+      queue->head[i] = -1;
+      queue->tail[i] = -1;
+    }
+    currentTaskIds[core] = 0;
+    coreIdle[core].onCore = -1;
   }
+  memset(&schedStats, 0, sizeof(schedStats));
+  memset(&idleStats, 0, sizeof(idleStats));
+  loadSampleMillis = millis();
+  loadSampleCycles = readCycleCounter();
+  systemLoad = 0;
+  sleepHeapSize = 0;
+  initCycleCounter();
   
   // Initialize file handles
   for (int i = 0; i < MAX_FILE_HANDLES; i++) {
@@ -60,23 +158,32 @@ bool Kernel::init() {
     dirHandles[i].inUse = false;
   }
   
-  // Initialize message queues
-  for (int i = 0; i < MAX_TASKS; i++) {
-    messageQueues[i].head = 0;
-    messageQueues[i].tail = 0;
-    messageQueues[i].count = 0;
-    for (int j = 0; j < MAX_MESSAGE_QUEUE_SIZE; j++) {
-      messageQueues[i].messages[j].valid = false;
-    }
-  }
-  
   // Initialize semaphores
   for (int i = 0; i < MAX_SEMAPHORES; i++) {
     semaphores[i].inUse = false;
+    semaphores[i].waitHead = -1;
+  }
+  
+  // Initialize mutexes
+  for (int i = 0; i < MAX_MUTEXES; i++) {
+    mutexes[i].inUse = false;
+    mutexes[i].holderTaskId = -1;
+    mutexes[i].waitHead = -1;
   }
   
   // Initialize memory
-  heapUsed = 0;
+  heapInit();
+  for (int i = 0; i < MAX_MEM_HANDLES; i++) {
+    memHandles[i].ptr = nullptr;
+  }
+  for (int i = 0; i < MAX_MEM_POOLS; i++) {
+    memPools[i].inUse = false;
+  }
+  mailboxPool = poolCreateInternal(sizeof(MessageQueue), MAILBOX_POOL_SLAB, -1, "mailbox");
+  memset(memShrinkers, 0, sizeof(memShrinkers));
+  memset(&pressureStats, 0, sizeof(pressureStats));
+  shrinkerAddInternal("pools", poolShrinker, -1);
+  spiBounce = (uint8_t*)allocateMemoryInternal(KERNEL_SPI_BOUNCE_SIZE, -1, MEM_DMA, DMA_ALIGN);
   
   // Initialize SD card
   Serial.print(F("Mounting SD card... "));
@@ -89,23 +196,22 @@ bool Kernel::init() {
   }
   
   // Create idle task (task 0)
-  tasks[0].id = 0;
   tasks[0].name = "idle";
-  tasks[0].state = TASK_READY;
-  tasks[0].priority = 0;
-  tasks[0].lastYield = millis();
-  tasks[0].canAccessSD = false;
-  tasks[0].canAccessDisplay = false;
-  tasks[0].canCreateTasks = false;
-  tasks[0].canAccessGPIO = false;
-  tasks[0].canAccessI2C = false;
-  tasks[0].canAccessSPI = false;
+  taskHot.state[0] = TASK_READY;
+  taskHot.priority[0] = 0;
+  tasks[0].basePriority = 0;
+  taskHot.lastYield[0] = millis();
+  tasks.cold(0).permissions = 0;
   tasks[0].memoryUsed = 0;
+  tasks[0].memoryPeak = 0;
   
-  currentTaskId = 0;
   bootTime = millis();
   watchdogLastCheck = millis();
-  initialized = true;
+  zombieCount = 0;
+  
+  // Idle task runs on the Arduino loop() stack; start the port's tick
+  portInit();
+  __atomic_store_n(&initialized, true, __ATOMIC_RELEASE);
   
   Serial.println(F("Kernel initialized successfully\n"));
   return true;
@@ -150,34 +256,36 @@ void Kernel::captureStackTrace(Task* task) {
   
   // Simple stack capture - on Arduino, this is limited
   // We can at least record the entry point
-  task->stackTraceDepth = 1;
-  task->stackTrace[0].returnAddress = (void*)task->entryPoint;
-  task->stackTrace[0].functionName = task->name;
+  TaskCold* cold = coldOf(task);
+  cold->stackTraceDepth = 1;
+  cold->stackTrace[0].returnAddress = (void*)task->entryPoint;
+  cold->stackTrace[0].functionName = task->name;
   
   // Note: Full stack unwinding requires DWARF debug info
   // which is not easily accessible on Arduino
 }
 
 void Kernel::printStackTrace(Task* task) {
-  if (!task || task->stackTraceDepth == 0) {
+  TaskCold* cold = task ? coldOf(task) : nullptr;
+  if (!cold || cold->stackTraceDepth == 0) {
     Serial.println(F("No stack trace available"));
     return;
   }
   
   Serial.println(F("\n=== Stack Trace ==="));
-  for (int i = 0; i < task->stackTraceDepth; i++) {
+  for (int i = 0; i < cold->stackTraceDepth; i++) {
     Serial.print(F("  ["));
     Serial.print(i);
     Serial.print(F("] "));
     
-    if (task->stackTrace[i].functionName) {
-      Serial.print(task->stackTrace[i].functionName);
+    if (cold->stackTrace[i].functionName) {
+      Serial.print(cold->stackTrace[i].functionName);
     } else {
       Serial.print(F("<unknown>"));
     }
     
     Serial.print(F(" @ 0x"));
-    Serial.println((uintptr_t)task->stackTrace[i].returnAddress, HEX);
+    Serial.println((uintptr_t)cold->stackTrace[i].returnAddress, HEX);
   }
 }
 
@@ -185,96 +293,400 @@ void Kernel::printStackTrace(Task* task) {
 // TASK MANAGEMENT
 // ============================================================================
 
+// Reset a slot to free. Its ID and generation are left alone: the
+// generation is what tells old IDs for the slot apart from new ones.
+void Kernel::initTaskSlot(Task* task) {
+  taskHot.state[task->id] = TASK_EMPTY;
+  coldOf(task)->stackTraceDepth = 0;
+  task->readyNext = -1;
+  task->readyPrev = -1;
+  task->sleepIndex = -1;
+  task->coroutine = nullptr;
+  task->waitKind = WAIT_NONE;
+  task->waitNext = -1;
+  task->heldMutexes = -1;
+  task->core = 0;
+  task->affinity = TASK_AFFINITY_ANY;
+  task->onCore = -1;
+  task->period = 0;
+  task->mailbox = nullptr;
+  task->arena = nullptr;
+  task->arenaFree = nullptr;
+  task->arenaBytes = 0;
+#ifdef KERNEL_STACKFUL_TASKS
+  task->stackBase = nullptr;
+  task->context = nullptr;
+#endif
+}
+
+// Pop a free slot. Caller holds the critical section.
 int Kernel::allocateTaskId() {
-  for (int i = 1; i < MAX_TASKS; i++) {
-    if (tasks[i].state == TASK_EMPTY) {
-      return i;
-    }
+  int taskId = taskFreeHead;
+  if (taskId >= 0) {
+    taskFreeHead = tasks[taskId].readyNext;
+    tasks[taskId].readyNext = -1;
   }
-  return -1;
+  return taskId;
+}
+
+// Add a chunk of slots from the kernel heap, with their cold data in the
+// same block after the Tasks. Chunks are pinned and never given back, so a
+// Task* stays valid for the life of the system.
+bool Kernel::growTaskPool() {
+  if (taskSlots >= MAX_TASKS) return false;
+  
+  Task* chunk = (Task*)allocateMemoryInternal(
+      (sizeof(Task) + sizeof(TaskCold)) * TASK_POOL_CHUNK, -1, MEM_FAST);
+  if (!chunk) return false;
+  getBlockHeader(chunk)->kind = BLOCK_PINNED;
+  
+  uint32_t irq = portEnterCritical();
+  if (taskSlots >= MAX_TASKS) {
+    portExitCritical(irq);  // Another core got there first
+    freeMemoryInternal(chunk);
+    return true;
+  }
+  int base = taskSlots;
+  tasks.chunks[base / TASK_POOL_CHUNK] = chunk;
+  tasks.coldChunks[base / TASK_POOL_CHUNK] = (TaskCold*)(chunk + TASK_POOL_CHUNK);
+  for (int i = TASK_POOL_CHUNK - 1; i >= 0; i--) {
+    chunk[i].id = base + i;
+    chunk[i].generation = 0;
+    initTaskSlot(&chunk[i]);
+    chunk[i].readyNext = taskFreeHead;
+    taskFreeHead = base + i;
+  }
+  taskSlots = base + TASK_POOL_CHUNK;
+  portExitCritical(irq);
+  return true;
+}
+
+// Return a dead task's slot to the free list. Caller holds the critical
+// section.
+void Kernel::releaseTaskSlot(Task* task) {
+  int index = task->id;
+  task->generation = (task->generation + 1) & TASK_ID_GEN_MASK;
+  initTaskSlot(task);
+  task->readyNext = taskFreeHead;
+  taskFreeHead = index;
+}
+
+// The ID the API hands out for a task: slot plus generation
+int Kernel::taskIdOf(Task* task) {
+  return task->id | (int)(task->generation << TASK_ID_INDEX_BITS);
 }
 
 Task* Kernel::getCurrentTask() {
-  return &tasks[currentTaskId];
+  return &tasks[runningTaskId()];
 }
 
+int Kernel::runningTaskId() {
+#if KERNEL_MAX_CORES > 1
+  // Hold still so we can't migrate between reading the core and the slot
+  uint32_t irq = portEnterCritical();
+  int taskId = currentTaskIds[currentCore()];
+  portExitCritical(irq);
+  return taskId;
+#else
+  return currentTaskIds[0];
+#endif
+}
+
+// Look up a task by API ID; stale IDs (slot since reused) find nothing
 Task* Kernel::getTask(int taskId) {
-  if (taskId < 0 || taskId >= MAX_TASKS) return nullptr;
-  if (tasks[taskId].state == TASK_EMPTY) return nullptr;
-  return &tasks[taskId];
+  if (taskId < 0) return nullptr;
+  int index = taskId & TASK_ID_INDEX_MASK;
+  if (index >= taskSlots) return nullptr;
+  
+  Task* task = &tasks[index];
+  if (taskHot.state[task->id] == TASK_EMPTY || taskIdOf(task) != taskId) return nullptr;
+  return task;
+}
+
+// Walk the live tasks: start with -1, pass back the previous ID, stop at -1
+int Kernel::nextTask(int taskId) {
+  int index = (taskId < 0) ? 1 : (taskId & TASK_ID_INDEX_MASK) + 1;
+  for (; index < taskSlots; index++) {
+    if (taskHot.state[index] != TASK_EMPTY) {
+      return taskIdOf(&tasks[index]);
+    }
+  }
+  return -1;
 }
 
 int Kernel::createTask(const char* name, void (*entryPoint)()) {
-  int taskId = allocateTaskId();
+  return setupTask(name, entryPoint, nullptr);
+}
+
+int Kernel::createPeriodicTask(const char* name, void (*job)(), uint32_t periodMs,
+                               uint32_t deadlineMs, uint32_t wcetMs) {
+  if (!job || wcetMs == 0 || wcetMs > deadlineMs || deadlineMs > periodMs) {
+    return SYS_ERR_INVALID_PARAM;
+  }
+  if (!admitPeriodicTask(periodMs, deadlineMs, wcetMs)) {
+    Serial.print(F("Task rejected: "));
+    Serial.print(name);
+    Serial.println(F(" (utilization too high)"));
+    return SYS_ERR_UNSCHEDULABLE;
+  }
+  return setupTask(name, job, nullptr, periodMs, deadlineMs, wcetMs);
+}
+
+#ifdef KERNEL_COROUTINES
+int Kernel::createTask(const char* name, CoroutineTask task) {
+  void* frame = task.release();
+  if (!frame) {
+    return SYS_ERR_NO_MEMORY;  // Frame allocation failed
+  }
+  
+  int taskId = setupTask(name, nullptr, frame);
+  if (taskId < 0) {
+    std::coroutine_handle<>::from_address(frame).destroy();
+  }
+  return taskId;
+}
+#endif
+
+int Kernel::setupTask(const char* name, void (*entryPoint)(), void* coroutine,
+                      uint32_t period, uint32_t deadline, uint32_t wcet) {
+  // Claim the slot under the lock; BLOCKED keeps it off every queue until
+  // it is fully set up. Out of slots: grow the pool and try again.
+  uint32_t irq;
+  int taskId;
+  do {
+    irq = portEnterCritical();
+    taskId = allocateTaskId();
+    if (taskId >= 0) {
+      taskHot.state[taskId] = TASK_BLOCKED;
+    }
+    portExitCritical(irq);
+  } while (taskId < 0 && growTaskPool());
   if (taskId < 0) {
     return SYS_ERR_NO_MEMORY;
   }
   
   Task* task = &tasks[taskId];
-  task->id = taskId;
   task->name = name;
-  task->state = TASK_READY;
   task->entryPoint = entryPoint;
-  task->priority = 10;
+  task->coroutine = coroutine;
+  task->mailbox = nullptr;
+  task->waitKind = WAIT_NONE;
+  taskHot.priority[task->id] = TASK_DEFAULT_PRIORITY;
+  task->basePriority = TASK_DEFAULT_PRIORITY;
+  task->heldMutexes = -1;
+  task->core = -1;  // Placed on the least busy core when first queued
+  task->affinity = TASK_AFFINITY_ANY;
+  task->onCore = -1;
   task->lastRun = 0;
-  task->lastYield = millis();
-  task->sleepUntil = 0;
+  taskHot.lastYield[task->id] = millis();
+  taskHot.sleepUntil[task->id] = 0;
   task->memoryUsed = 0;
-  task->stackTraceDepth = 0;
-  
-  // Clear file handles
-  for (int i = 0; i < MAX_FILE_HANDLES; i++) {
-    task->fileHandles[i] = false;
-  }
-  
-  // Clear dir handles
-  for (int i = 0; i < MAX_DIR_HANDLES; i++) {
-    task->dirHandles[i] = false;
-  }
-  
-  // Set permissions (default: can access SD and display)
-  task->canAccessSD = true;
-  task->canAccessDisplay = true;
-  task->canCreateTasks = false;
-  task->canAccessGPIO = true;   // Default allow GPIO
-  task->canAccessI2C = false;   // Require explicit permission
-  task->canAccessSPI = false;   // Require explicit permission
+  task->memoryPeak = 0;
+  
+  TaskCold* cold = coldOf(task);
+  cold->stackTraceDepth = 0;
+  cold->memPressureMessages = false;
+  
+  task->period = period;
+  task->relativeDeadline = deadline;
+  task->wcet = wcet;
+  task->jobStarted = false;
+  task->jobCount = 0;
+  task->deadlineMisses = 0;
+  task->jitterMax = 0;
+  task->jitterTotal = 0;
+  task->runCycles = 0;
+  task->dispatches = 0;
+  task->sliceMaxCycles = 0;
+  task->loadMarkCycles = 0;
+  task->load = 0;
+#if KERNEL_SCHED_HIST
+  memset(&cold->schedHist, 0, sizeof(cold->schedHist));
+#endif
+  
+  cold->fileHandles = 0;
+  cold->dirHandles = 0;
+  cold->permissions = TASK_PERM_DEFAULT;
   
   // Capture initial stack trace
   captureStackTrace(task);
   
+#ifdef KERNEL_STACKFUL_TASKS
+  // Stacks are pinned so compaction can never move a live stack.
+  // Coroutine tasks have no stack; they borrow the idle stack when resumed.
+  task->stackBase = nullptr;
+  if (!coroutine) {
+    task->stackBase = allocateMemoryInternal(TASK_STACK_SIZE + PORT_STACK_EXTRA, taskId);
+  }
+  if (!coroutine && (!task->stackBase || !portInitStack(task))) {
+    if (task->stackBase) {
+      freeMemoryInternal(task->stackBase);
+      task->stackBase = nullptr;
+    }
+    irq = portEnterCritical();
+    releaseTaskSlot(task);
+    portExitCritical(irq);
+    return SYS_ERR_NO_MEMORY;
+  }
+  if (task->stackBase) {
+    getBlockHeader(task->stackBase)->kind = BLOCK_PINNED;
+  }
+#endif
+  
+  irq = portEnterCritical();
+  if (period) {
+    // First job is released now; later ones follow on the period grid
+    task->releaseTime = ticks();
+    task->absDeadline = task->releaseTime + deadline;
+    task->basePriority = realtimePriority(task);
+    taskHot.priority[task->id] = task->basePriority;
+  }
+  readyEnqueue(task);
+  if (period) {
+    realtimeReprioritize();
+  }
+  portExitCritical(irq);
+  
   Serial.print(F("Task created: "));
   Serial.print(name);
   Serial.print(F(" (ID: "));
-  Serial.print(taskId);
+  Serial.print(taskIdOf(task));
   Serial.println(F(")"));
   
-  return taskId;
+  return taskIdOf(task);
 }
 
 void Kernel::killTask(int taskId) {
   Task* task = getTask(taskId);
-  if (!task || taskId == 0) return;
+  if (!task || task->id == 0) return;
+  if (taskHot.state[task->id] == TASK_ZOMBIE) return;
+  
+#ifdef KERNEL_COROUTINES
+  if (task->coroutine && task->onCore >= 0) {
+    // Being resumed right now (from inside its own body, or on another
+    // core); the scheduler finishes the kill as soon as it suspends
+    taskHot.state[task->id] = TASK_ZOMBIE;
+    return;
+  }
+#endif
   
   // Close all open files
+  TaskCold* cold = coldOf(task);
   for (int i = 0; i < MAX_FILE_HANDLES; i++) {
-    if (task->fileHandles[i]) {
+    if (cold->fileHandles & (1UL << i)) {
       freeFileHandle(i);
     }
   }
   
   // Close all open directories
   for (int i = 0; i < MAX_DIR_HANDLES; i++) {
-    if (task->dirHandles[i]) {
+    if (cold->dirHandles & (1 << i)) {
       freeDirHandle(i);
     }
   }
-  
-  task->state = TASK_EMPTY;
-  task->id = -1;
+  cold->fileHandles = 0;
+  cold->dirHandles = 0;
   
   Serial.print(F("Task killed: "));
   Serial.println(task->name);
+  
+  uint32_t irq = portEnterCritical();
+  if (taskHot.state[task->id] == TASK_READY) {
+    readyRemove(task);
+  } else if (taskHot.state[task->id] == TASK_BLOCKED && waitQueueOf(task)) {
+    waitQueueRemove(waitQueueOf(task), task);
+    if (task->waitKind == WAIT_MUTEX) {
+      mutexInherit(task->waitObject);  // Holder may drop back down
+    }
+  }
+  sleepQueueRemove(task);  // Sleeping, or blocked with a timeout
+  
+  // Dead tasks can't unlock: pass anything it holds to the next waiter
+  while (task->heldMutexes >= 0) {
+    mutexRelease(task->heldMutexes);
+  }
+  
+#ifdef KERNEL_COROUTINES
+  if (task->coroutine) {
+    std::coroutine_handle<>::from_address(task->coroutine).destroy();
+    task->coroutine = nullptr;
+  }
+#endif
+  task->waitKind = WAIT_NONE;
+  
+  if (task->mailbox) {
+    poolFreeInternal(mailboxPool, task->mailbox);  // Unread messages go with it
+    task->mailbox = nullptr;
+  }
+  
+  for (int i = 0; i < MAX_MEM_HANDLES; i++) {
+    MemHandle* h = &memHandles[i];
+    if (h->ptr && h->ownerTaskId == task->id) {
+      if (h->lockCount > 0) {
+        // Someone still has it pinned: the last memUnpin frees it
+        h->ownerTaskId = -1;
+        h->freeOnUnpin = true;
+      } else {
+        freeMemoryInternal(h->ptr);
+        h->ptr = nullptr;
+      }
+    }
+  }
+  for (int i = 0; i < MAX_MEM_POOLS; i++) {
+    if (memPools[i].inUse && memPools[i].ownerTaskId == task->id) {
+      poolRelease(i);
+    }
+  }
+  for (int i = 0; i < MAX_MEM_SHRINKERS; i++) {
+    if (memShrinkers[i].inUse && memShrinkers[i].ownerTaskId == task->id) {
+      memShrinkers[i].inUse = false;
+    }
+  }
+  arenaRelease(task);  // Everything it malloc()ed, in one go
+  
+#ifdef KERNEL_STACKFUL_TASKS
+  if (task->stackBase && task->onCore >= 0) {
+    // Its stack is still live: an idle task frees it once it's switched out
+    taskHot.state[task->id] = TASK_ZOMBIE;
+    zombieCount++;
+    if (task->id != currentTaskIds[currentCore()]) {
+      portKickCore(task->onCore);  // Running on another core
+      portExitCritical(irq);
+      return;
+    }
+    switchTo(pickNextTask());
+    portExitCritical(irq);
+    while (true) {}  // Cortex-M: PendSV takes over once interrupts are back on
+  }
+  
+  if (task->stackBase) {
+    freeMemoryInternal(task->stackBase);
+    task->stackBase = nullptr;
+  }
+#endif
+  
+  releaseTaskSlot(task);
+  portExitCritical(irq);
+}
+
+// Restrict a task to the cores in coreMask. A queued task moves straight
+// away; a running one moves at its next switch (or the next tick).
+int Kernel::setTaskAffinity(int taskId, uint32_t coreMask) {
+  Task* task = getTask(taskId);
+  if (!task || taskId == 0) return SYS_ERR_NOT_FOUND;
+  
+  uint32_t allCores = (KERNEL_MAX_CORES >= 32) ? TASK_AFFINITY_ANY
+                                                : ((1UL << KERNEL_MAX_CORES) - 1);
+  if ((coreMask & allCores) == 0) return SYS_ERR_INVALID_PARAM;
+  
+  uint32_t irq = portEnterCritical();
+  task->affinity = coreMask;
+  if (taskHot.state[task->id] == TASK_READY && task->id > 0 && !(coreMask & (1UL << task->core))) {
+    readyRemove(task);
+    readyEnqueue(task);
+  }
+  portExitCritical(irq);
+  return SYS_OK;
 }
 
 // ============================================================================
@@ -290,7 +702,7 @@ void Kernel::enableWatchdog(bool enable) {
 void Kernel::feedWatchdog() {
   Task* current = getCurrentTask();
   if (current) {
-    current->lastYield = millis();
+    taskHot.lastYield[current->id] = millis();
   }
 }
 
@@ -303,13 +715,15 @@ void Kernel::checkWatchdog() {
   if (now - watchdogLastCheck < 1000) return;
   watchdogLastCheck = now;
   
-  // Check all running/ready tasks
-  for (int i = 0; i < MAX_TASKS; i++) {
+  // Check all running/ready tasks (idle never holds the CPU)
+  for (int i = 1; i < taskSlots; i++) {
     Task* task = &tasks[i];
-    if (task->state == TASK_EMPTY) continue;
-    if (task->state == TASK_SLEEPING) continue;
+    if (taskHot.state[task->id] == TASK_EMPTY) continue;
+    if (taskHot.state[task->id] == TASK_SLEEPING) continue;
+    if (taskHot.state[task->id] == TASK_BLOCKED) continue;
+    if (taskHot.state[task->id] == TASK_ZOMBIE) continue;
     
-    uint32_t timeSinceYield = now - task->lastYield;
+    uint32_t timeSinceYield = now - taskHot.lastYield[task->id];
     
     if (timeSinceYield > WATCHDOG_TIMEOUT_MS) {
       Serial.print(F("[WATCHDOG] Task "));
@@ -318,214 +732,3178 @@ void Kernel::checkWatchdog() {
       Serial.print(timeSinceYield);
       Serial.println(F("ms - forcing reschedule"));
       
-      // Force task to ready state
-      if (task->state == TASK_RUNNING) {
-        task->state = TASK_READY;
+#ifndef KERNEL_STACKFUL_TASKS
+      // Force task to ready state (preemptive builds rely on the tick)
+      if (taskHot.state[task->id] == TASK_RUNNING) {
+        readyEnqueue(task);
       }
+#endif
       
-      task->lastYield = now;
+      taskHot.lastYield[task->id] = now;
     }
   }
 }
 
-void Kernel::schedule() {
-  checkWatchdog();
+// ============================================================================
+// RUN QUEUE
+// ============================================================================
+
+/*
+ * Runnable tasks sit in a per-priority FIFO list; bit N of readyBitmap is set
+ * whenever level N is non-empty. The running task and the idle task (ID 0)
+ * are never queued, so "in the run queue" and "state == TASK_READY" are the
+ * same thing for every other task. Each core has its own queue; task->core
+ * says which one, and an idle core steals from the others.
+ */
+
+// Stay on the task's current core if its affinity allows; otherwise (and
+// for brand-new tasks) pick the allowed core with the shortest queue
+int Kernel::readyTargetCore(Task* task) {
+  if (task->core >= 0 && (task->affinity & (1UL << task->core))) {
+    return task->core;
+  }
+  int best = -1;
+  for (int core = 0; core < KERNEL_MAX_CORES; core++) {
+    if (!(task->affinity & (1UL << core))) continue;
+    if (best < 0 || runQueues[core].count < runQueues[best].count) {
+      best = core;
+    }
+  }
+  return best >= 0 ? best : 0;
+}
+
+void Kernel::readyEnqueue(Task* task) {
+#if KERNEL_SCHED_HIST
+  if (taskHot.state[task->id] != TASK_READY) {
+    task->readySince = readCycleCounter();  // Not just a requeue
+  }
+#endif
+  taskHot.state[task->id] = TASK_READY;
+  if (task->id <= 0) return;  // Idle task is the fallback, never queued
+  
+  task->core = readyTargetCore(task);
+  RunQueue* queue = &runQueues[task->core];
+  int prio = taskHot.priority[task->id];
+  int after = queue->tail[prio];
+  
+  // First peer for the running task: its quantum starts now, not whenever
+  // it was last switched in, or it would be preempted at the next tick
+  Task* running = &tasks[currentTaskIds[task->core]];
+  if (after < 0 && taskHot.state[running->id] == TASK_RUNNING &&
+      taskHot.priority[running->id] == prio) {
+    running->sliceStart = millis();
+  }
+#if KERNEL_RT_POLICY == RT_POLICY_EDF
+  // EDF: periodic jobs are kept sorted by absolute deadline (FIFO on ties)
+  if (task->period) {
+    while (after >= 0 && tasks[after].absDeadline > task->absDeadline) {
+      after = tasks[after].readyPrev;
+    }
+  }
+#endif
   
-  uint32_t now = millis();
-  int bestTask = 0;
-  int bestPriority = -1;
+  task->readyPrev = after;
+  task->readyNext = (after >= 0) ? tasks[after].readyNext : queue->head[prio];
   
-  // Find highest priority ready task
-  for (int i = 0; i < MAX_TASKS; i++) {
-    Task* task = &tasks[i];
-    
-    if (task->state == TASK_EMPTY) continue;
+  if (after >= 0) {
+    tasks[after].readyNext = task->id;
+  } else {
+    queue->head[prio] = task->id;
+  }
+  if (task->readyNext >= 0) {
+    tasks[task->readyNext].readyPrev = task->id;
+  } else {
+    queue->tail[prio] = task->id;
+  }
+  queue->readyBitmap |= (1UL << prio);
+  queue->count++;
+  
+#if KERNEL_MAX_CORES > 1
+  if (task->core != currentCore()) {
+    portKickCore(task->core);  // Wake it if it's idling
+  }
+#else
+  portKickCore(task->core);  // Made ready by an interrupt while idle sleeps
+#endif
+}
+
+void Kernel::readyRemove(Task* task) {
+  if (task->id <= 0) return;
+  
+  RunQueue* queue = &runQueues[task->core];
+  int prio = taskHot.priority[task->id];
+  if (task->readyPrev >= 0) {
+    tasks[task->readyPrev].readyNext = task->readyNext;
+  } else {
+    queue->head[prio] = task->readyNext;
+  }
+  if (task->readyNext >= 0) {
+    tasks[task->readyNext].readyPrev = task->readyPrev;
+  } else {
+    queue->tail[prio] = task->readyPrev;
+  }
+  
+  task->readyNext = -1;
+  task->readyPrev = -1;
+  queue->count--;
+  if (queue->head[prio] < 0) {
+    queue->readyBitmap &= ~(1UL << prio);
+  }
+}
+
+int Kernel::readyHighestPriority(int core) {
+  uint32_t bitmap = runQueues[core].readyBitmap;
+  if (bitmap == 0) return -1;
+  // unsigned long is 32 bits on AVR/ARM but 64 on LP64 hosts
+  return (int)(sizeof(unsigned long) * 8 - 1) -
+         __builtin_clzl((unsigned long)bitmap);
+}
+
+int Kernel::readyPop(int core, int priority) {
+  int taskId = runQueues[core].head[priority];
+  if (taskId >= 0) {
+    readyRemove(&tasks[taskId]);
+  }
+  return taskId;
+}
+
+// Idle core: take the most important task another core has queued that is
+// allowed here and whose registers are already saved. -1 if there is none.
+int Kernel::stealTask(int core) {
+#if KERNEL_MAX_CORES > 1
+  int bestTask = -1;
+  for (int other = 0; other < KERNEL_MAX_CORES; other++) {
+    if (other == core || runQueues[other].count == 0) continue;
     
-    // Wake up sleeping tasks
-    if (task->state == TASK_SLEEPING) {
-      if (now >= task->sleepUntil) {
-        task->state = TASK_READY;
-      } else {
-        continue;
+    for (int prio = MAX_PRIORITIES - 1; prio >= 0; prio--) {
+      if (bestTask >= 0 && prio <= taskHot.priority[bestTask]) break;
+      if (!(runQueues[other].readyBitmap & (1UL << prio))) continue;
+      
+      int candidate = runQueues[other].head[prio];
+      while (candidate >= 0 &&
+             (!(tasks[candidate].affinity & (1UL << core)) || tasks[candidate].onCore >= 0)) {
+        candidate = tasks[candidate].readyNext;
+      }
+      if (candidate >= 0) {
+        bestTask = candidate;
+        break;
       }
     }
+  }
+  return bestTask;
+#else
+  (void)core;
+  return -1;
+#endif
+}
+
+// EDF: is a job on the running task's level due before the running one?
+bool Kernel::earlierDeadlineReady(Task* current) {
+#if KERNEL_RT_POLICY == RT_POLICY_EDF
+  if (!current->period) return false;
+  int head = runQueues[currentCore()].head[taskHot.priority[current->id]];
+  return head >= 0 && tasks[head].absDeadline < current->absDeadline;
+#else
+  (void)current;
+  return false;
+#endif
+}
+
+// Round robin: an ordinary task that has run a full quantum gives way to
+// the next task of its priority. Periodic jobs are never time-sliced.
+bool Kernel::quantumExpired(Task* task) {
+  return !task->period && millis() - task->sliceStart >= KERNEL_TIME_SLICE_MS;
+}
+
+// ============================================================================
+// PERIODIC REAL-TIME TASKS
+// ============================================================================
+
+/*
+ * A periodic task's entry point is one job. Releases sit on a fixed grid
+ * (release += period), so finishing late or early never shifts later jobs.
+ * Under RT_POLICY_RM each task gets a fixed priority in the real-time band
+ * by period rank; under RT_POLICY_EDF they share the top level and the run
+ * queue keeps that level sorted by absolute deadline.
+ */
+
+// Liu & Layland bound n(2^(1/n) - 1) in per-mille for n = 1..8; ln 2 beyond
+static const uint16_t rmBoundPermille[] = {1000, 828, 779, 756, 743, 734, 728, 724};
+
+// Density C / min(D, P), rounded up, so constrained deadlines are covered
+static uint32_t densityPermille(uint32_t period, uint32_t deadline, uint32_t wcet) {
+  uint32_t window = deadline < period ? deadline : period;
+  return (wcet * 1000UL + window - 1) / window;
+}
+
+bool Kernel::admitPeriodicTask(uint32_t period, uint32_t deadline, uint32_t wcet) {
+  uint32_t load = densityPermille(period, deadline, wcet);
+  int count = 1;
+  
+  for (int i = 1; i < taskSlots; i++) {
+    Task* task = &tasks[i];
+    if (taskHot.state[task->id] == TASK_EMPTY || taskHot.state[task->id] == TASK_ZOMBIE || !task->period) continue;
+    load += densityPermille(task->period, task->relativeDeadline, task->wcet);
+    count++;
+  }
+  
+#if KERNEL_RT_POLICY == RT_POLICY_EDF
+  uint32_t bound = 1000;
+#else
+  uint32_t bound = count <= 8 ? rmBoundPermille[count - 1] : 693;
+#endif
+  return load <= bound;
+}
+
+int Kernel::realtimePriority(Task* task) {
+#if KERNEL_RT_POLICY == RT_POLICY_EDF
+  (void)task;
+  return TASK_RT_PRIORITY_MAX;
+#else
+  // One level below the top for every task with a strictly shorter period
+  int rank = 0;
+  for (int i = 1; i < taskSlots; i++) {
+    Task* other = &tasks[i];
+    if (taskHot.state[other->id] == TASK_EMPTY || taskHot.state[other->id] == TASK_ZOMBIE || !other->period) continue;
+    if (other->period < task->period) rank++;
+  }
+  int prio = TASK_RT_PRIORITY_MAX - rank;
+  return prio < TASK_RT_PRIORITY_BASE ? TASK_RT_PRIORITY_BASE : prio;
+#endif
+}
+
+// Rate-monotonic ranks shift when a task joins; caller holds the critical section
+void Kernel::realtimeReprioritize() {
+  for (int i = 1; i < taskSlots; i++) {
+    Task* task = &tasks[i];
+    if (taskHot.state[task->id] == TASK_EMPTY || taskHot.state[task->id] == TASK_ZOMBIE || !task->period) continue;
     
-    if (task->state == TASK_READY && task->priority > bestPriority) {
-      bestTask = i;
-      bestPriority = task->priority;
+    task->basePriority = realtimePriority(task);
+    refreshPriority(task);
+  }
+}
+
+// First dispatch of a job: record how far its start drifted from the grid
+void Kernel::periodicJobStart(Task* task) {
+  uint32_t now = micros();
+  task->jobStarted = true;
+  
+  if (task->jobCount > 0) {
+    uint32_t expected = (uint32_t)(task->releaseTime - task->lastStartRelease) * 1000UL;
+    uint32_t actual = now - task->lastStartMicros;
+    uint32_t jitter = actual > expected ? actual - expected : expected - actual;
+    task->jitterTotal += jitter;
+    if (jitter > task->jitterMax) {
+      task->jitterMax = jitter;
     }
   }
+  task->lastStartMicros = now;
+  task->lastStartRelease = task->releaseTime;
+}
+
+// Job returned: account for it and park the task until its next release.
+// Caller holds the critical section and dispatches afterwards.
+void Kernel::periodicJobDone(Task* task) {
+  uint64_t now = ticks();
+  task->jobStarted = false;
+  task->jobCount++;
+  if (now > task->absDeadline) {
+    task->deadlineMisses++;
+  }
+  
+  task->releaseTime += task->period;
+  while (task->releaseTime + task->relativeDeadline < now) {
+    task->releaseTime += task->period;  // Whole window already gone: drop the job
+    task->deadlineMisses++;
+  }
+  task->absDeadline = task->releaseTime + task->relativeDeadline;
+  taskHot.lastYield[task->id] = millis();
   
-  // Switch to best task
-  if (bestTask != currentTaskId) {
-    if (tasks[currentTaskId].state == TASK_RUNNING) {
-      tasks[currentTaskId].state = TASK_READY;
+  if (task->releaseTime <= now) {
+    readyEnqueue(task);  // Overran into the next window; run it straight away
+  } else {
+    taskHot.state[task->id] = TASK_SLEEPING;
+    taskHot.sleepUntil[task->id] = task->releaseTime;
+    sleepQueueInsert(task);
+  }
+}
+
+// ============================================================================
+// CYCLE COUNTER
+// ============================================================================
+
+#ifdef KERNEL_HAS_DWT
+  #define DWT_CTRL   (*(volatile uint32_t*)0xE0001000)
+  #define DWT_CYCCNT (*(volatile uint32_t*)0xE0001004)
+  #define DWT_LAR    (*(volatile uint32_t*)0xE0001FB0)
+  #define DEMCR      (*(volatile uint32_t*)0xE000EDFC)
+#endif
+
+void Kernel::initCycleCounter() {
+#ifdef KERNEL_HAS_DWT
+  DEMCR |= (1UL << 24);     // TRCENA
+  DWT_LAR = 0xC5ACCE55;     // Unlock (required on M7, ignored elsewhere)
+  DWT_CYCCNT = 0;
+  DWT_CTRL |= 1UL;          // CYCCNTENA
+#endif
+}
+
+uint32_t Kernel::readCycleCounter() {
+#ifdef KERNEL_HAS_DWT
+  return DWT_CYCCNT;
+#else
+  return micros();
+#endif
+}
+
+// ============================================================================
+// SLEEP QUEUE
+// ============================================================================
+
+/*
+ * Sleeping tasks are kept in a binary min-heap keyed on sleepUntil, so the
+ * scheduler only ever touches tasks whose deadline has passed and the next
+ * wakeup is always sleepHeap[0]. Deadlines are on the 64-bit tick from
+ * ticks(), which keeps counting across the 49-day millis() wrap.
+ */
+
+uint64_t Kernel::ticks() {
+  uint32_t irq = portEnterCritical();
+  uint32_t now = millis();
+  if (now < tickLastMillis) {
+    tickEpoch++;  // millis() wrapped since the last call
+  }
+  tickLastMillis = now;
+  uint64_t result = ((uint64_t)tickEpoch << 32) | now;
+  portExitCritical(irq);
+  return result;
+}
+
+void Kernel::sleepHeapSwap(int a, int b) {
+  int taskA = sleepHeap[a];
+  sleepHeap[a] = sleepHeap[b];
+  sleepHeap[b] = taskA;
+  tasks[sleepHeap[a]].sleepIndex = a;
+  tasks[sleepHeap[b]].sleepIndex = b;
+}
+
+void Kernel::sleepHeapSiftUp(int index) {
+  while (index > 0) {
+    int parent = (index - 1) / 2;
+    if (taskHot.sleepUntil[sleepHeap[parent]] <= taskHot.sleepUntil[sleepHeap[index]]) break;
+    sleepHeapSwap(index, parent);
+    index = parent;
+  }
+}
+
+void Kernel::sleepHeapSiftDown(int index) {
+  while (true) {
+    int left = index * 2 + 1;
+    int right = left + 1;
+    int smallest = index;
+    
+    if (left < sleepHeapSize &&
+        taskHot.sleepUntil[sleepHeap[left]] < taskHot.sleepUntil[sleepHeap[smallest]]) {
+      smallest = left;
     }
-    currentTaskId = bestTask;
-    tasks[currentTaskId].state = TASK_RUNNING;
-    tasks[currentTaskId].lastRun = now;
+    if (right < sleepHeapSize &&
+        taskHot.sleepUntil[sleepHeap[right]] < taskHot.sleepUntil[sleepHeap[smallest]]) {
+      smallest = right;
+    }
+    if (smallest == index) break;
+    
+    sleepHeapSwap(index, smallest);
+    index = smallest;
+  }
+}
+
+void Kernel::sleepQueueInsert(Task* task) {
+  if (task->sleepIndex >= 0) {
+    sleepQueueRemove(task);
   }
   
-  // Execute current task
-  Task* current = getCurrentTask();
-  if (current->entryPoint && current->state == TASK_RUNNING) {
-    current->entryPoint();
+  int index = sleepHeapSize++;
+  sleepHeap[index] = task->id;
+  task->sleepIndex = index;
+  sleepHeapSiftUp(index);
+}
+
+void Kernel::sleepQueueRemove(Task* task) {
+  int index = task->sleepIndex;
+  if (index < 0) return;
+  
+  int last = --sleepHeapSize;
+  if (index != last) {
+    // Move the last entry into the hole, then restore heap order around it
+    sleepHeapSwap(index, last);
+    int moved = sleepHeap[index];
+    sleepHeapSiftUp(index);
+    sleepHeapSiftDown(tasks[moved].sleepIndex);
   }
+  task->sleepIndex = -1;
 }
 
-void Kernel::yield() {
+void Kernel::wakeExpiredSleepers(uint64_t now) {
+  while (sleepHeapSize > 0) {
+    Task* task = &tasks[sleepHeap[0]];
+    if (taskHot.sleepUntil[task->id] > now) break;
+    
+    if (taskHot.state[task->id] == TASK_BLOCKED) {
+      wakeWaiter(task, SYS_ERR_TIMEOUT);  // Blocked wait ran out
+    } else {
+      sleepQueueRemove(task);
+      readyEnqueue(task);
+    }
+  }
+}
+
+uint64_t Kernel::nextWakeupTick() {
+  return sleepHeapSize > 0 ? taskHot.sleepUntil[sleepHeap[0]] : UINT64_MAX;
+}
+
+// ============================================================================
+// WAIT QUEUES
+// ============================================================================
+
+/*
+ * A task blocked on a kernel object is TASK_BLOCKED and sits only in that
+ * object's wait queue (plus the sleep heap if the wait has a timeout), so
+ * the scheduler never looks at it. Whoever satisfies the wait, or the timer
+ * when it expires, hands over the result and makes it READY.
+ */
+
+// Only tasks with a context of their own can block: coroutines, and plain
+// tasks on stackful builds. Idle and cooperative plain tasks poll instead.
+bool Kernel::canBlock(Task* task) {
+  if (task->id <= 0) return false;
+#ifdef KERNEL_STACKFUL_TASKS
+  return true;
+#else
+  return task->coroutine != nullptr;
+#endif
+}
+
+// Highest priority first; a newcomer goes behind waiters of equal priority
+void Kernel::waitQueueInsert(int* queueHead, Task* task) {
+  int* link = queueHead;
+  while (*link >= 0 && taskHot.priority[*link] >= taskHot.priority[task->id]) {
+    link = &tasks[*link].waitNext;
+  }
+  task->waitNext = *link;
+  *link = task->id;
+}
+
+void Kernel::waitQueueRemove(int* queueHead, Task* task) {
+  int* link = queueHead;
+  while (*link >= 0 && *link != task->id) {
+    link = &tasks[*link].waitNext;
+  }
+  if (*link == task->id) {
+    *link = task->waitNext;
+  }
+  task->waitNext = -1;
+}
+
+int* Kernel::waitQueueOf(Task* task) {
+  if (task->waitKind == WAIT_SEM) {
+    return &semaphores[task->waitObject].waitHead;
+  }
+  if (task->waitKind == WAIT_MUTEX) {
+    return &mutexes[task->waitObject].waitHead;
+  }
+  return nullptr;
+}
+
+// Block the running task on a wait queue, or on nothing but its own mailbox
+// when queueHead is null. Caller holds the critical section and has checked
+// canBlock(), and returns blockedResult() once it has left the section.
+void Kernel::blockCurrentTask(uint8_t kind, int object, int* queueHead, uint32_t timeoutMs) {
   Task* current = getCurrentTask();
-  if (current) {
-    current->state = TASK_READY;
-    current->lastYield = millis();
+  taskHot.state[current->id] = TASK_BLOCKED;
+  current->waitKind = kind;
+  current->waitObject = object;
+  current->waitResult = SYS_ERR_WOULD_BLOCK;
+  current->waitSince = micros();
+  taskHot.lastYield[current->id] = millis();
+  if (queueHead) {
+    waitQueueInsert(queueHead, current);
+  }
+  if (kind == WAIT_MUTEX) {
+    mutexInherit(object);  // Boost the holder before we stop running
+  }
+  
+  if (timeoutMs > 0) {
+    taskHot.sleepUntil[current->id] = ticks() + timeoutMs;
+    sleepQueueInsert(current);
+  }
+  
+#ifdef KERNEL_STACKFUL_TASKS
+  if (!current->coroutine) {
+    switchTo(pickNextTask());  // On Cortex-M only pends the switch
+  }
+#endif
+}
+
+// Result of a wait set up by blockCurrentTask(), read after the caller's
+// critical section ends. A plain task has been switched out and woken by
+// then: the host port swaps contexts inside switchTo(), but PendSV on
+// Cortex-M only runs as the section is left, so reading it any earlier
+// would see SYS_ERR_WOULD_BLOCK. Coroutines haven't suspended yet; they get
+// SYS_ERR_WOULD_BLOCK, suspend in OS::Wait and read waitResult() on resume.
+int Kernel::blockedResult(Task* task) {
+  if (task->coroutine) return SYS_ERR_WOULD_BLOCK;
+  if (task->waitResult == SYS_ERR_WOULD_BLOCK) {
+    panic("Blocked task ran before it was woken");  // Blocked inside a critical section?
+  }
+  return task->waitResult;
+}
+
+// Finish a blocked wait with result and make the task runnable.
+// Caller holds the critical section.
+void Kernel::wakeWaiter(Task* task, int result) {
+  uint8_t kind = task->waitKind;
+  int* queueHead = waitQueueOf(task);
+  if (queueHead) {
+    waitQueueRemove(queueHead, task);
+  }
+  sleepQueueRemove(task);
+  task->waitKind = WAIT_NONE;
+  task->waitResult = result;
+  readyEnqueue(task);
+  if (kind == WAIT_MUTEX) {
+    mutexInherit(task->waitObject);  // One waiter fewer to inherit from
+  }
+}
+
+// Recompute a task's effective priority: its own, raised to that of the most
+// urgent task waiting on any mutex it holds. If the task is itself blocked
+// on a mutex, the change carries on to that holder, and so on down the chain.
+// Caller holds the critical section.
+void Kernel::refreshPriority(Task* task) {
+  for (int depth = 0; task && depth < MAX_TASKS; depth++) {
+    int prio = task->basePriority;
+    for (int m = task->heldMutexes; m >= 0; m = mutexes[m].nextHeld) {
+      int waiter = mutexes[m].waitHead;
+      if (waiter >= 0 && taskHot.priority[waiter] > prio) {
+        prio = taskHot.priority[waiter];
+      }
+    }
+    if (prio == taskHot.priority[task->id]) return;
+    
+    // Keep whichever queue it's on in priority order
+    int* queueHead = (taskHot.state[task->id] == TASK_BLOCKED) ? waitQueueOf(task) : nullptr;
+    if (taskHot.state[task->id] == TASK_READY) {
+      readyRemove(task);
+      taskHot.priority[task->id] = prio;
+      readyEnqueue(task);
+    } else if (queueHead) {
+      waitQueueRemove(queueHead, task);
+      taskHot.priority[task->id] = prio;
+      waitQueueInsert(queueHead, task);
+    } else {
+      taskHot.priority[task->id] = prio;
+    }
+    
+    if (taskHot.state[task->id] != TASK_BLOCKED || task->waitKind != WAIT_MUTEX) return;
+    int holder = mutexes[task->waitObject].holderTaskId;
+    task = (holder >= 0) ? &tasks[holder] : nullptr;
+  }
+}
+
+// ============================================================================
+// SCHEDULER
+// ============================================================================
+
+/*
+ * CPU accounting and latency histograms. Each sample is a subtraction, a
+ * count-leading-zeros and a few increments, done where the scheduler already
+ * holds the timestamps, so they stay on in normal builds.
+ */
+
+void Kernel::histRecord(uint16_t* hist, uint32_t value) {
+  // unsigned long is 32 bits on AVR/ARM but 64 on LP64 hosts
+  int bucket = value ? (int)(sizeof(unsigned long) * 8) - __builtin_clzl((unsigned long)value) : 0;
+  if (bucket >= SCHED_HIST_BUCKETS) bucket = SCHED_HIST_BUCKETS - 1;
+  if (hist[bucket] != 0xFFFF) hist[bucket]++;
+}
+
+// A READY task is about to get the CPU
+void Kernel::noteWakeToRun(Task* task, uint32_t now) {
+#if KERNEL_SCHED_HIST
+  if (task->id > 0 && taskHot.state[task->id] == TASK_READY) {
+    histRecord(coldOf(task)->schedHist.wakeToRun, now - task->readySince);
+  }
+#else
+  (void)task; (void)now;
+#endif
+}
+
+// A task came off the CPU: charge it for the slice
+void Kernel::noteRunSlice(Task* task, uint32_t start, uint32_t now) {
+  if (task->id <= 0) return;
+  
+  uint32_t cycles = now - start;
+  task->runCycles += cycles;
+  task->dispatches++;
+  if (cycles > task->sliceMaxCycles) {
+    task->sliceMaxCycles = cycles;
+  }
+#if KERNEL_SCHED_HIST
+  histRecord(coldOf(task)->schedHist.runSlice, cycles);
+#endif
+}
+
+/*
+ * Every KERNEL_LOAD_WINDOW_MS, turn each task's CPU time over the window into
+ * a per-mille share and fold it into a moving average (new = 3/4 old + 1/4
+ * sample, so roughly the last four windows). Stackful tasks still running
+ * are charged for their slice so far without ending it. Caller holds the
+ * critical section.
+ */
+void Kernel::updateLoad() {
+  if (millis() - loadSampleMillis < KERNEL_LOAD_WINDOW_MS) return;
+  
+  uint32_t now = readCycleCounter();
+  uint32_t window = now - loadSampleCycles;
+  loadSampleMillis = millis();
+  loadSampleCycles = now;
+  if (window == 0) return;
+  
+  uint64_t busy = 0;
+  for (int i = 1; i < taskSlots; i++) {
+    Task* task = &tasks[i];
+    if (taskHot.state[task->id] == TASK_EMPTY) continue;
+    
+    uint64_t total = task->runCycles;
+#ifdef KERNEL_STACKFUL_TASKS
+    if (task->onCore >= 0 && task->stackBase) {
+      total += now - task->sliceStartCycles;  // Slice in progress
+    }
+#endif
+    uint64_t used = total - task->loadMarkCycles;
+    task->loadMarkCycles = total;
+    busy += used;
+    
+    uint32_t share = used >= window ? 1000 : (uint32_t)(used * 1000 / window);
+    task->load = (uint16_t)((task->load * 3 + share) / 4);
+  }
+  
+  uint64_t capacity = (uint64_t)window * KERNEL_MAX_CORES;
+  uint32_t share = busy >= capacity ? 1000 : (uint32_t)(busy * 1000 / capacity);
+  systemLoad = (uint16_t)((systemLoad * 3 + share) / 4);
+}
+
+int Kernel::pickNextTask() {
+  // Pick the next task: O(1) regardless of how many tasks exist
+  uint32_t pickStart = readCycleCounter();
+  
+  int core = currentCore();
+  int currentId = currentTaskIds[core];
+  Task* current = &tasks[currentId];
+  int bestPriority = readyHighestPriority(core);
+  int bestTask;
+  
+  if (taskHot.state[current->id] == TASK_RUNNING && currentId != 0 &&
+      (current->affinity & (1UL << core)) && !earlierDeadlineReady(current) &&
+      (bestPriority < taskHot.priority[current->id] ||
+       (bestPriority == taskHot.priority[current->id] && !quantumExpired(current)))) {
+    // Nothing more important is ready, and no peer is owed its turn yet
+    bestTask = currentId;
+  } else if (bestPriority >= 0) {
+    bestTask = readyPop(core, bestPriority);
+  } else {
+    // Local queue is empty: steal before falling back to idle
+    bestTask = stealTask(core);
+    if (bestTask >= 0) {
+      readyRemove(&tasks[bestTask]);
+      tasks[bestTask].core = core;
+      schedStats.steals++;
+    } else {
+      bestTask = 0;
+    }
+  }
+  
+  uint32_t pickCycles = readCycleCounter() - pickStart;
+  schedStats.dispatchCount++;
+  schedStats.dispatchCyclesTotal += pickCycles;
+  if (pickCycles > schedStats.dispatchCyclesMax) {
+    schedStats.dispatchCyclesMax = pickCycles;
+  }
+  
+  return bestTask;
+}
+
+// Make taskId the running task. Caller holds the critical section. On
+// stackful builds this returns only once the previous task runs again.
+void Kernel::switchTo(int taskId) {
+  int core = currentCore();
+  Task* from = &tasks[currentTaskIds[core]];
+  Task* to = &tasks[taskId];
+  
+  if (to->period && !to->jobStarted) {
+    periodicJobStart(to);
+  }
+  
+  uint32_t now = readCycleCounter();
+  noteWakeToRun(to, now);
+  
+  if (taskId == currentTaskIds[core]) {
+    taskHot.state[to->id] = TASK_RUNNING;
+    return;
+  }
+  
+  if (taskHot.state[from->id] == TASK_RUNNING) {
+    readyEnqueue(from);  // Preempted by a higher priority task
+  }
+  currentTaskIds[core] = taskId;
+  to->core = core;
+  taskHot.state[to->id] = TASK_RUNNING;
+  to->lastRun = millis();
+  to->sliceStart = to->lastRun;
+  
+#ifdef KERNEL_STACKFUL_TASKS
+  // Coroutine slices are timed around resume() in runCoroutine instead
+  if (from->stackBase) {
+    noteRunSlice(from, from->sliceStartCycles, now);
+  }
+  to->sliceStartCycles = now;
+  
+  Task* fromContext = contextOf(from);
+  Task* toContext = contextOf(to);
+  if (fromContext != toContext) {
+    switchStartCycles = readCycleCounter();
+    portSwitch(fromContext, toContext);
+#ifdef KERNEL_PORT_HOST
+    noteSwitchComplete();
+#endif
+  }
+#endif
+}
+
+// Tasks without a stack of their own (idle, coroutines) run on this core's
+// idle stack
+Task* Kernel::contextOf(Task* task) {
+#ifdef KERNEL_STACKFUL_TASKS
+  if (task->stackBase) return task;
+#else
+  (void)task;
+#endif
+  return &coreIdle[currentCore()];
+}
+
+// Hand the CPU to the best runnable task (possibly the caller)
+void Kernel::dispatch() {
+  uint32_t irq = portEnterCritical();
+  switchTo(pickNextTask());
+  portExitCritical(irq);
+}
+
+void Kernel::schedule() {
+  if (currentCore() == 0) {
+    checkWatchdog();
+  }
+  
+  // Wake up sleeping tasks whose deadline has passed
+  uint32_t irq = portEnterCritical();
+  wakeExpiredSleepers(ticks());
+  updateLoad();
+  portExitCritical(irq);
+  
+#ifdef KERNEL_STACKFUL_TASKS
+  /*
+   * schedule() runs on the idle task, i.e. the Arduino loop() stack. Every
+   * task has its own stack, so this just hands the CPU over and returns once
+   * nothing is runnable and the idle task is picked again.
+   */
+  if (zombieCount > 0) {
+    reapZombies();
+  }
+  dispatch();
+  
+#ifdef KERNEL_COROUTINES
+  // We only come back here as idle or as a coroutine task borrowing this
+  // stack; run coroutines until the idle task itself is picked again
+  while (runningTaskId() != 0) {
+    runCoroutine(getCurrentTask());
+    dispatch();
+  }
+#endif
+#else
+  // Cooperative build: run one slice of the chosen task on this stack
+  switchTo(pickNextTask());
+  
+  Task* current = getCurrentTask();
+  if (taskHot.state[current->id] != TASK_RUNNING) return;
+  
+#ifdef KERNEL_COROUTINES
+  if (current->coroutine) {
+    runCoroutine(current);
+    return;
+  }
+#endif
+  if (current->entryPoint) {
+    uint32_t sliceStart = readCycleCounter();
+    current->entryPoint();
+    noteRunSlice(current, sliceStart, readCycleCounter());
+  }
+  if (current->period && taskHot.state[current->id] == TASK_RUNNING) {
+    periodicJobDone(current);
+  }
+#endif
+}
+
+void Kernel::yield() {
+  Task* current = getCurrentTask();
+  if (!current) return;
+  
+  uint32_t irq = portEnterCritical();
+  if (taskHot.state[current->id] == TASK_RUNNING) {
+    readyEnqueue(current);  // Back of the line for its priority
+    taskHot.lastYield[current->id] = millis();
+  }
+#ifdef KERNEL_STACKFUL_TASKS
+  if (!current->coroutine) {
+    switchTo(pickNextTask());  // Coroutines suspend in OS::Wait instead
+  }
+#endif
+  portExitCritical(irq);
+}
+
+// The checks are a few loads with no lock: a stale answer just means one
+// extra or one late yield, which the tick or the next call makes up for
+bool Kernel::yieldIfNeeded() {
+  Task* current = getCurrentTask();
+  if (current->id <= 0 || current->coroutine) return false;
+  
+  int bestPriority = readyHighestPriority(currentCore());
+  if (bestPriority > taskHot.priority[current->id] || earlierDeadlineReady(current) ||
+      (bestPriority == taskHot.priority[current->id] && quantumExpired(current))) {
+    yield();
+    return true;
+  }
+  taskHot.lastYield[current->id] = millis();  // Still cooperating as far as the watchdog cares
+  return false;
+}
+
+void Kernel::sleep(uint32_t ms) {
+  Task* current = getCurrentTask();
+  if (!current) return;
+  
+  uint32_t irq = portEnterCritical();
+  if (taskHot.state[current->id] == TASK_RUNNING) {  // Not killed from another core
+    taskHot.state[current->id] = TASK_SLEEPING;
+    taskHot.sleepUntil[current->id] = ticks() + ms;
+    taskHot.lastYield[current->id] = millis();
+    sleepQueueInsert(current);
+  }
+#ifdef KERNEL_STACKFUL_TASKS
+  if (!current->coroutine) {
+    switchTo(pickNextTask());
+  }
+#endif
+  portExitCritical(irq);
+}
+
+/*
+ * Timer tick (KERNEL_TICK_HZ), called from interrupt context. Wakes expired
+ * sleepers and preempts the running task when something more important is
+ * ready, or when it has used up its time slice and a peer is waiting. The
+ * host port defers the preemption to the task's next kernel call.
+ */
+void Kernel::tick() {
+  if (!initialized) return;
+  
+#ifdef KERNEL_STACKFUL_TASKS
+  uint32_t irq = portEnterCritical();
+  wakeExpiredSleepers(ticks());
+  updateLoad();
+  
+  int core = currentCore();
+  if (core >= KERNEL_MAX_CORES) {
+    portExitCritical(irq);  // Host timer thread: nothing to preempt
+    return;
+  }
+#ifdef KERNEL_PORT_HOST
+  portPreemptDue = true;  // Not from the signal handler: see portExitCritical()
+#else
+  tickPreempt(core);
+#endif
+  portExitCritical(irq);
+#endif
+}
+
+// The switching half of a tick: move the running task off this core if it
+// was killed or its affinity changed, and preempt it for a more urgent
+// task or an equal one once its quantum is up. Caller holds the critical
+// section.
+void Kernel::tickPreempt(int core) {
+  Task* current = &tasks[currentTaskIds[core]];
+  
+  if (current->stackBase &&
+      (taskHot.state[current->id] == TASK_ZOMBIE || !(current->affinity & (1UL << core)))) {
+    switchTo(pickNextTask());  // Killed, or moved off this core, from elsewhere
+  }
+  
+#if KERNEL_TICK_PREEMPT
+  int bestPriority = readyHighestPriority(core);
+  
+  // Only tasks on their own stack are preempted: coroutines run until they
+  // suspend, and idle is only ever switched out from inside schedule()
+  if (taskHot.state[current->id] == TASK_RUNNING && current->stackBase && bestPriority >= 0) {
+    bool preempt = bestPriority > taskHot.priority[current->id] ||
+                   earlierDeadlineReady(current) ||
+                   (bestPriority == taskHot.priority[current->id] && quantumExpired(current));
+    if (preempt) {
+      schedStats.preemptions++;
+      readyEnqueue(current);
+      switchTo(readyPop(core, bestPriority));
+    }
+  }
+#endif
+}
+
+// Bring up a secondary core once core 0 has finished init()
+void Kernel::coreInit() {
+  while (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE)) {}
+  portCoreInit();
+}
+
+/*
+ * Idle path, called from loop() once schedule() finds nothing to run. Works
+ * out how long until the next sleeper is due and lets the port sleep the
+ * CPU that long (tick suppressed where the port owns it), or until any
+ * interrupt arrives.
+ */
+void Kernel::idle() {
+  uint32_t irq = portEnterCritical();
+  
+  int core = currentCore();
+  if (readyHighestPriority(core) >= 0 || stealTask(core) >= 0) {
+    portExitCritical(irq);  // Woken while we were getting here
+    return;
+  }
+  
+  // Spend the slice on a step of heap compaction while one is due
+  if (compactDue()) {
+    portExitCritical(irq);
+    memCompactIdle();
+    return;
+  }
+  
+  uint64_t now = ticks();
+  uint64_t next = nextWakeupTick();
+  uint32_t sleepMs = KERNEL_IDLE_MAX_MS;
+  if (next <= now) {
+    sleepMs = 0;
+  } else if (next - now < KERNEL_IDLE_MAX_MS) {
+    sleepMs = (uint32_t)(next - now);
+  }
+  if (sleepMs == 0) {
+    portExitCritical(irq);
+    return;
+  }
+  
+  uint32_t start = micros();
+  portIdleWait(sleepMs);
+  uint32_t slept = micros() - start;
+  
+  idleStats.sleeps++;
+  idleStats.idleMicros += slept;
+  if (slept >= sleepMs * 1000UL) {
+    uint32_t late = slept - sleepMs * 1000UL;
+    idleStats.deadlineWakeups++;
+    idleStats.wakeLatencyTotal += late;
+    if (late > idleStats.wakeLatencyMax) {
+      idleStats.wakeLatencyMax = late;
+    }
+  }
+  
+  portExitCritical(irq);
+}
+
+#ifdef KERNEL_STACKFUL_TASKS
+
+void Kernel::noteSwitchComplete() {
+  uint32_t cycles = readCycleCounter() - switchStartCycles;
+  schedStats.switchCount++;
+  schedStats.switchCyclesTotal += cycles;
+  if (cycles > schedStats.switchCyclesMax) {
+    schedStats.switchCyclesMax = cycles;
+  }
+}
+
+// First code run on a new task's stack
+void Kernel::taskTrampoline() {
+#ifdef KERNEL_PORT_HOST
+  noteSwitchComplete();
+#if KERNEL_MAX_CORES > 1
+  portExitCritical(0);  // The switch that started us held the kernel lock
+#endif
+#endif
+  
+  Task* self = getCurrentTask();
+  
+  // Entry points written for the cooperative model return after each slice
+  // and expect to be called again, so keep doing that
+  while (true) {
+    self->entryPoint();
+    if (self->period && taskHot.state[self->id] == TASK_RUNNING) {
+      uint32_t irq = portEnterCritical();
+      periodicJobDone(self);
+      switchTo(pickNextTask());
+      portExitCritical(irq);
+    } else {
+      yield();
+    }
+  }
+}
+
+// Free the stacks of killed tasks once no core is running on them; runs on
+// an idle stack
+void Kernel::reapZombies() {
+  uint32_t irq = portEnterCritical();
+  for (int i = 1; i < taskSlots; i++) {
+    Task* task = &tasks[i];
+    if (taskHot.state[task->id] != TASK_ZOMBIE || task->onCore >= 0) continue;
+    
+    if (task->stackBase) {
+      freeMemoryInternal(task->stackBase);
+      task->stackBase = nullptr;
+    }
+    releaseTaskSlot(task);
+    zombieCount--;
+  }
+  portExitCritical(irq);
+}
+
+#endif // KERNEL_STACKFUL_TASKS
+
+// ============================================================================
+// COROUTINE TASKS
+// ============================================================================
+
+/*
+ * A coroutine task is a heap frame plus a task slot, no stack. The scheduler
+ * resumes it on the idle stack; it runs until it co_awaits an OS::Wait, at
+ * which point the kernel call has already moved it to SLEEPING, BLOCKED on a
+ * semaphore, mutex or its mailbox, or back into the run queue.
+ */
+
+void* Kernel::coroutineFrameAlloc(size_t size) {
+  // Frames hold live pointers into themselves, so they must never move
+  void* frame = allocateMemoryInternal(size, -1);
+  if (frame) {
+    getBlockHeader(frame)->kind = BLOCK_PINNED;
+  }
+  return frame;
+}
+
+void Kernel::coroutineFrameFree(void* frame) {
+  freeMemoryInternal(frame);
+}
+
+bool Kernel::mustSuspend() {
+  Task* current = getCurrentTask();
+  return current->coroutine && taskHot.state[current->id] != TASK_RUNNING;
+}
+
+int Kernel::waitResult(int result) {
+  return result == SYS_ERR_WOULD_BLOCK ? getCurrentTask()->waitResult : result;
+}
+
+#ifdef KERNEL_COROUTINES
+void Kernel::runCoroutine(Task* task) {
+  std::coroutine_handle<> handle = std::coroutine_handle<>::from_address(task->coroutine);
+  task->onCore = currentCore();
+  uint32_t sliceStart = readCycleCounter();
+  handle.resume();
+  noteRunSlice(task, sliceStart, readCycleCounter());
+  task->onCore = -1;
+  
+  if (handle.done() || taskHot.state[task->id] == TASK_ZOMBIE) {
+    taskHot.state[task->id] = TASK_RUNNING;
+    killTask(taskIdOf(task));
+  } else if (taskHot.state[task->id] == TASK_RUNNING) {
+    yield();  // Suspended on something that isn't a kernel wait
+  }
+}
+#endif
+
+// ============================================================================
+// PORT LAYER
+// ============================================================================
+
+#if defined(KERNEL_PORT_CORTEXM)
+
+/*
+ * Cortex-M port. Tasks run in thread mode on PSP; handlers get their own
+ * MSP stack. PendSV (lowest priority) saves r4-r11 (and s16-s31 when the FPU
+ * was in use) on the outgoing task's stack and loads the incoming one, so a
+ * switch requested from thread mode or from the tick happens as soon as no
+ * other interrupt is active.
+ */
+
+#define SCB_ICSR  (*(volatile uint32_t*)0xE000ED04)
+#define SCB_SHPR3 (*(volatile uint32_t*)0xE000ED20)
+#define SYST_CSR  (*(volatile uint32_t*)0xE000E010)
+#define SYST_RVR  (*(volatile uint32_t*)0xE000E014)
+#define SYST_CVR  (*(volatile uint32_t*)0xE000E018)
+#define ICSR_PENDSVSET (1UL << 28)
+
+#ifndef KERNEL_HANDLER_STACK_WORDS
+  #define KERNEL_HANDLER_STACK_WORDS 512
+#endif
+
+// SAMD's core owns SysTick for millis() and forwards to sysTickHook()
+#if !defined(KERNEL_PORT_SYSTICK) && !defined(ARDUINO_ARCH_SAMD)
+  #define KERNEL_PORT_SYSTICK 1
+#endif
+
+static uint32_t portHandlerStack[KERNEL_MAX_CORES][KERNEL_HANDLER_STACK_WORDS]
+  __attribute__((aligned(8)));
+extern "C" uint32_t portHandlerStackTop;
+uint32_t portHandlerStackTop;
+
+static Task* volatile portRunning[KERNEL_MAX_CORES];  // Task whose registers are live
+static Task* volatile portPending[KERNEL_MAX_CORES];  // Task PendSV should load
+
+#if KERNEL_MAX_CORES > 1
+/*
+ * RP2040: both cores share the kernel behind SIO hardware spinlock 14
+ * (reserved for OS use by the SDK). Each core has its own PendSV, SysTick
+ * and PRIMASK; idle cores WFE and are woken with SEV.
+ */
+#define SIO_CPUID    (*(volatile uint32_t*)0xD0000000)
+#define SIO_SPINLOCK (*(volatile uint32_t*)(0xD0000100 + 4 * 14))
+#define SCB_SCR      (*(volatile uint32_t*)0xE000ED10)
+#define SCR_SEVONPEND (1UL << 4)
+#define PORT_NESTED  2  // portEnterCritical() state flag: lock already held
+
+static volatile int portLockOwner = -1;
+
+static void portLock(int core) {
+  while (SIO_SPINLOCK == 0) {}
+  __asm volatile("dmb" ::: "memory");
+  portLockOwner = core;
+}
+
+static void portUnlock() {
+  portLockOwner = -1;
+  __asm volatile("dmb" ::: "memory");
+  SIO_SPINLOCK = 0;
+}
+#endif
+
+// Move thread mode onto PSP (same stack) and give handlers their own MSP
+extern "C" __attribute__((naked)) void portUseProcessStack() {
+  __asm volatile(
+    "mrs r0, control      \n"
+    "movs r1, #2          \n"
+    "tst r0, r1           \n"
+    "bne 1f               \n"   // Already on PSP
+    "mrs r2, msp          \n"
+    "msr psp, r2          \n"
+    "orrs r0, r1          \n"
+    "msr control, r0      \n"
+    "isb                  \n"
+    "ldr r0, =portHandlerStackTop \n"
+    "ldr r0, [r0]         \n"
+    "msr msp, r0          \n"
+    "1:                   \n"
+    "bx lr                \n"
+    ".ltorg               \n"
+  );
+}
+
+int Kernel::currentCore() {
+#if KERNEL_MAX_CORES > 1
+  return (int)SIO_CPUID;
+#else
+  return 0;
+#endif
+}
+
+void Kernel::portInit() {
+  portCoreInit();
+}
+
+// Per-core setup: handler stack, PendSV priority and this core's SysTick
+void Kernel::portCoreInit() {
+  int core = currentCore();
+  portHandlerStackTop = (uint32_t)&portHandlerStack[core][KERNEL_HANDLER_STACK_WORDS];
+  portUseProcessStack();
+  
+  SCB_SHPR3 |= (0xFFUL << 16);  // PendSV at lowest priority
+  portRunning[core] = &coreIdle[core];
+  coreIdle[core].onCore = core;
+  
+#if KERNEL_MAX_CORES > 1
+  SCB_SCR |= SCR_SEVONPEND;  // Pending interrupts end a WFE even when masked
+#endif
+  
+#ifdef KERNEL_PORT_SYSTICK
+  SYST_RVR = (F_CPU / KERNEL_TICK_HZ) - 1;
+  SYST_CVR = 0;
+  SYST_CSR = 0x7;  // Core clock, interrupt, enable
+#endif
+}
+
+void Kernel::portKickCore(int core) {
+  (void)core;
+#if KERNEL_MAX_CORES > 1
+  __asm volatile("sev" ::: "memory");
+#endif
+}
+
+uint32_t Kernel::portEnterCritical() {
+  uint32_t primask;
+  __asm volatile("mrs %0, primask\n cpsid i" : "=r"(primask) :: "memory");
+#if KERNEL_MAX_CORES > 1
+  int core = currentCore();
+  if (portLockOwner == core) {
+    return primask | PORT_NESTED;
+  }
+  portLock(core);
+#endif
+  return primask;
+}
+
+void Kernel::portExitCritical(uint32_t state) {
+#if KERNEL_MAX_CORES > 1
+  if (!(state & PORT_NESTED)) {
+    portUnlock();
+  }
+  state &= 1;
+#endif
+  __asm volatile("msr primask, %0" :: "r"(state) : "memory");
+}
+
+// Called with interrupts masked: WFI still wakes on a pending interrupt,
+// which then runs as soon as the caller leaves its critical section
+void Kernel::portIdleWait(uint32_t ms) {
+#ifdef KERNEL_PORT_SYSTICK
+  // Stretch the tick into a one-shot covering the whole sleep (24-bit max)
+  uint64_t reload = (uint64_t)ms * (F_CPU / 1000);
+  if (reload > 0x1000000) reload = 0x1000000;
+  SYST_CSR = 0;
+  SYST_RVR = (uint32_t)reload - 1;
+  SYST_CVR = 0;
+  SYST_CSR = 0x7;
+#else
+  (void)ms;  // Core owns SysTick; its 1 kHz interrupt ends the sleep
+#endif
+  
+#if KERNEL_MAX_CORES > 1
+  // Let the other core into the kernel while we sleep; SEV or any pending
+  // interrupt ends the WFE
+  portUnlock();
+  __asm volatile("dsb\n wfe\n isb" ::: "memory");
+  portLock(currentCore());
+#else
+  __asm volatile("dsb\n wfi\n isb" ::: "memory");
+#endif
+  
+#ifdef KERNEL_PORT_SYSTICK
+  SYST_CSR = 0;
+  SYST_RVR = (F_CPU / KERNEL_TICK_HZ) - 1;
+  SYST_CVR = 0;
+  SYST_CSR = 0x7;
+#endif
+}
+
+bool Kernel::portInitStack(Task* task) {
+  uint8_t* base = (uint8_t*)task->stackBase;
+  uint32_t* sp = (uint32_t*)(((uintptr_t)base + TASK_STACK_SIZE) & ~(uintptr_t)7);
+  
+  // Exception frame popped by hardware on return from PendSV
+  *--sp = 0x01000000;                                   // xPSR (Thumb)
+  *--sp = (uint32_t)&Kernel::taskTrampoline & ~1UL;     // PC
+  *--sp = 0xFFFFFFFF;                                   // LR (never returns)
+  for (int i = 0; i < 5; i++) *--sp = 0;                // r12, r3-r0
+  
+  // Software frame popped by PendSV
+  *--sp = 0xFFFFFFFD;                                   // EXC_RETURN: thread, PSP
+  for (int i = 0; i < 8; i++) *--sp = 0;                // r11-r4
+  
+  task->context = sp;
+  return true;
+}
+
+void Kernel::portSwitch(Task* from, Task* to) {
+  (void)from;
+  portPending[currentCore()] = to;
+  SCB_ICSR = ICSR_PENDSVSET;  // Runs once the critical section ends
+}
+
+// Called from PendSV with the outgoing task's saved SP; returns the next SP.
+// onCore only clears once the registers are saved, so no other core can
+// pick the task up half-switched.
+void* Kernel::portSwitchStack(void* sp) {
+  uint32_t irq = portEnterCritical();
+  int core = currentCore();
+  Task* from = portRunning[core];
+  Task* to = portPending[core];
+  
+  from->context = sp;
+  from->onCore = -1;
+  to->onCore = core;
+  portRunning[core] = to;
+  noteSwitchComplete();
+  
+  portExitCritical(irq);
+  return to->context;
+}
+
+extern "C" void* portSwitchStackC(void* sp) {
+  return Kernel::portSwitchStack(sp);
+}
+
+extern "C" __attribute__((naked)) void PendSV_Handler() {
+#if defined(__ARM_ARCH_6M__)
+  __asm volatile(
+    "mrs r0, psp          \n"
+    "subs r0, #36         \n"
+    "mov r1, r0           \n"
+    "stmia r1!, {r4-r7}   \n"
+    "mov r4, r8           \n"
+    "mov r5, r9           \n"
+    "mov r6, r10          \n"
+    "mov r7, r11          \n"
+    "stmia r1!, {r4-r7}   \n"
+    "mov r2, lr           \n"
+    "str r2, [r1]         \n"
+    "cpsid i              \n"
+    "bl portSwitchStackC  \n"
+    "cpsie i              \n"
+    "adds r0, #16         \n"
+    "ldmia r0!, {r4-r7}   \n"
+    "mov r8, r4           \n"
+    "mov r9, r5           \n"
+    "mov r10, r6          \n"
+    "mov r11, r7          \n"
+    "ldr r1, [r0]         \n"
+    "adds r0, #4          \n"
+    "msr psp, r0          \n"
+    "subs r0, #36         \n"
+    "ldmia r0!, {r4-r7}   \n"
+    "bx r1                \n"
+  );
+#else
+  __asm volatile(
+    "mrs r0, psp          \n"
+    "isb                  \n"
+#if defined(__ARM_FP)
+    "tst lr, #0x10        \n"
+    "it eq                \n"
+    "vstmdbeq r0!, {s16-s31} \n"
+#endif
+    "stmdb r0!, {r4-r11, lr} \n"
+    "cpsid i              \n"
+    "bl portSwitchStackC  \n"
+    "cpsie i              \n"
+    "ldmia r0!, {r4-r11, lr} \n"
+#if defined(__ARM_FP)
+    "tst lr, #0x10        \n"
+    "it eq                \n"
+    "vldmiaeq r0!, {s16-s31} \n"
+#endif
+    "msr psp, r0          \n"
+    "isb                  \n"
+    "bx lr                \n"
+  );
+#endif
+}
+
+#ifdef KERNEL_PORT_SYSTICK
+extern "C" void SysTick_Handler() {
+  Kernel::tick();
+}
+#else
+extern "C" int sysTickHook() {
+  Kernel::tick();
+  return 0;
+}
+#endif
+
+#elif defined(KERNEL_PORT_HOST)
+
+/*
+ * Linux host port. Each task context is a ucontext_t at the bottom of its
+ * stack block; SIGALRM stands in for the tick interrupt and blocking it
+ * stands in for disabling interrupts.
+ *
+ * The tick never switches from inside the signal handler: the task it
+ * interrupted could be anywhere in libc (malloc's arena lock, a half-written
+ * stdio buffer), and another task calling in would deadlock or corrupt it.
+ * tick() only marks a preemption as due, and the task switches at the end
+ * of its next outermost critical section, i.e. its next kernel call. A task
+ * spinning without calling into the kernel isn't preempted.
+ *
+ * With KERNEL_MAX_CORES > 1 each extra core is a std::thread running the
+ * schedule()/idle() loop, and a spinlock replaces signal blocking. There is
+ * no tick in that mode: tasks switch at kernel calls, and sleepers are woken
+ * from schedule(). It exists to measure how the scheduler scales.
+ */
+
+static ucontext_t portIdleContexts[KERNEL_MAX_CORES];
+
+#if KERNEL_MAX_CORES > 1
+static thread_local int portCore = 0;
+static std::atomic<int> portLockOwner(-1);
+
+struct PortCoreWake {
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool kicked;
+};
+static PortCoreWake portCoreWake[KERNEL_MAX_CORES];
+
+static void portLock(int core) {
+  int expected = -1;
+  while (!portLockOwner.compare_exchange_weak(expected, core, std::memory_order_acquire)) {
+    expected = -1;
+    std::this_thread::yield();
+  }
+}
+
+static void portUnlock() {
+  portLockOwner.store(-1, std::memory_order_release);
+}
+
+static void portCoreThread(int core) {
+  portCore = core;
+  Kernel::coreInit();
+  while (true) {
+    Kernel::schedule();
+    Kernel::idle();
+  }
+}
+
+// Stand-in timer. It is not a core (it gets its own lock owner ID) and
+// cannot preempt one, so tick() only wakes sleepers from here.
+static void portTickThread() {
+  portCore = KERNEL_MAX_CORES;
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::microseconds(1000000 / KERNEL_TICK_HZ));
+    Kernel::tick();
+  }
+}
+#else
+static void portTickSignal(int) {
+  Kernel::tick();
+}
+
+static void portArmTimer(uint32_t firstUs, uint32_t intervalUs) {
+  struct itimerval timer;
+  timer.it_value.tv_sec = firstUs / 1000000;
+  timer.it_value.tv_usec = firstUs % 1000000;
+  timer.it_interval.tv_sec = intervalUs / 1000000;
+  timer.it_interval.tv_usec = intervalUs % 1000000;
+  setitimer(ITIMER_REAL, &timer, nullptr);
+}
+#endif
+
+
+// Not inlined: a task can resume on another thread after a switch, so the
+// thread-local must be re-read rather than cached across the call
+__attribute__((noinline)) int Kernel::currentCore() {
+#if KERNEL_MAX_CORES > 1
+  return portCore;
+#else
+  return 0;
+#endif
+}
+
+void Kernel::portCoreInit() {
+  int core = currentCore();
+  coreIdle[core].stackBase = nullptr;
+  coreIdle[core].context = &portIdleContexts[core];
+  coreIdle[core].onCore = core;
+}
+
+void Kernel::portKickCore(int core) {
+#if KERNEL_MAX_CORES > 1
+  std::lock_guard<std::mutex> guard(portCoreWake[core].mutex);
+  portCoreWake[core].kicked = true;
+  portCoreWake[core].wake.notify_one();
+#else
+  (void)core;
+#endif
+}
+
+void Kernel::portInit() {
+  portCoreInit();
+  
+#if KERNEL_MAX_CORES > 1
+  for (int core = 1; core < KERNEL_MAX_CORES; core++) {
+    std::thread(portCoreThread, core).detach();
+  }
+  std::thread(portTickThread).detach();
+#else
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = portTickSignal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGALRM, &sa, nullptr);
+  
+  portArmTimer(1000000 / KERNEL_TICK_HZ, 1000000 / KERNEL_TICK_HZ);
+#endif
+}
+
+// Stand-in for a one-shot timer plus WFI: SIGALRM is blocked by the
+// caller's critical section and sigsuspend() atomically unblocks it
+void Kernel::portIdleWait(uint32_t ms) {
+#if KERNEL_MAX_CORES > 1
+  // Drop the kernel lock and wait to be kicked (or for the deadline)
+  int core = currentCore();
+  PortCoreWake* wake = &portCoreWake[core];
+  portUnlock();
+  {
+    std::unique_lock<std::mutex> guard(wake->mutex);
+    wake->wake.wait_for(guard, std::chrono::milliseconds(ms), [wake] { return wake->kicked; });
+    wake->kicked = false;
+  }
+  portLock(core);
+#else
+  portArmTimer(ms * 1000, 0);
+  
+  sigset_t waitMask;
+  sigprocmask(SIG_SETMASK, nullptr, &waitMask);
+  sigdelset(&waitMask, SIGALRM);
+  sigsuspend(&waitMask);
+  
+  portArmTimer(1000000 / KERNEL_TICK_HZ, 1000000 / KERNEL_TICK_HZ);
+#endif
+}
+
+uint32_t Kernel::portEnterCritical() {
+#if KERNEL_MAX_CORES > 1
+  int core = currentCore();
+  if (portLockOwner.load(std::memory_order_relaxed) == core) {
+    return 1;  // Nested
+  }
+  portLock(core);
+  return 0;
+#else
+  sigset_t block, previous;
+  sigemptyset(&block);
+  sigaddset(&block, SIGALRM);
+  sigprocmask(SIG_BLOCK, &block, &previous);
+  return sigismember(&previous, SIGALRM) ? 1 : 0;
+#endif
+}
+
+void Kernel::portExitCritical(uint32_t state) {
+  if (state) return;  // Was already held by an outer section
+#if KERNEL_MAX_CORES > 1
+  portUnlock();
+#else
+  if (portPreemptDue && initialized) {
+    portPreemptDue = false;
+    tickPreempt(currentCore());  // In the task's own context, outside libc
+  }
+  sigset_t unblock;
+  sigemptyset(&unblock);
+  sigaddset(&unblock, SIGALRM);
+  sigprocmask(SIG_UNBLOCK, &unblock, nullptr);
+#endif
+}
+
+bool Kernel::portInitStack(Task* task) {
+  uintptr_t base = ((uintptr_t)task->stackBase + 15) & ~(uintptr_t)15;
+  ucontext_t* ctx = (ucontext_t*)base;
+  uint8_t* stack = (uint8_t*)(base + ((sizeof(ucontext_t) + 15) & ~(size_t)15));
+  
+  if (getcontext(ctx) != 0) return false;
+  ctx->uc_stack.ss_sp = stack;
+  ctx->uc_stack.ss_size = TASK_STACK_SIZE;
+  ctx->uc_link = nullptr;
+  sigemptyset(&ctx->uc_sigmask);
+  makecontext(ctx, &Kernel::taskTrampoline, 0);
+  
+  task->context = ctx;
+  return true;
+}
+
+// The kernel lock (or blocked SIGALRM) is held across the swap, so nothing
+// can see onCore cleared before the registers are actually saved
+void Kernel::portSwitch(Task* from, Task* to) {
+  from->onCore = -1;
+  to->onCore = currentCore();
+  swapcontext((ucontext_t*)from->context, (ucontext_t*)to->context);
+}
+
+#else
+
+// No port: cooperative only, nothing can interrupt the kernel
+int Kernel::currentCore() {
+  return 0;
+}
+
+#if defined(ARDUINO_ARCH_MBED)
+/*
+ * mbed: idle waits on a thread flag of the loop() thread, which lets RTX
+ * sleep tickless and lets a task made ready from an interrupt end the wait
+ * at once. Other interrupts don't; the next deadline still does.
+ */
+#define PORT_IDLE_FLAG 1
+static osThreadId_t portIdleThread;
+static volatile bool portIdleWaiting = false;
+#endif
+
+void Kernel::portInit() {
+#if defined(ARDUINO_ARCH_MBED)
+  portIdleThread = osThreadGetId();
+#endif
+}
+
+void Kernel::portCoreInit() {
+}
+
+void Kernel::portKickCore(int core) {
+  (void)core;
+#if defined(ARDUINO_ARCH_MBED)
+  if (portIdleWaiting) {
+    osThreadFlagsSet(portIdleThread, PORT_IDLE_FLAG);
+  }
+#endif
+}
+
+uint32_t Kernel::portEnterCritical() {
+  return 0;
+}
+
+void Kernel::portExitCritical(uint32_t state) {
+  (void)state;
+}
+
+void Kernel::portIdleWait(uint32_t ms) {
+#if defined(__AVR__)
+  // Idle sleep; the timer0 overflow (~1ms) or any other interrupt wakes us
+  (void)ms;
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_mode();
+#elif defined(ARDUINO_ARCH_MBED)
+  // Look again once kicks are on, so one that just missed can't be lost
+  portIdleWaiting = true;
+  if (readyHighestPriority(0) < 0) {
+    rtos::ThisThread::flags_wait_any_for(PORT_IDLE_FLAG, std::chrono::milliseconds(ms));
+  }
+  portIdleWaiting = false;
+#else
+  delay(ms);
+#endif
+}
+
+#endif
+
+// ============================================================================
+// MEMORY MANAGEMENT - TLSF HEAP
+// ============================================================================
+
+/*
+ * Two-level segregated fit: every free block sits on the list for its size
+ * class, and a bitmap per level says which lists are non-empty. Allocation
+ * rounds the request up to the next class and takes the head of the first
+ * non-empty list at or above it (two bit scans); freeing merges the block
+ * with free physical neighbours and pushes it on its list. Both are O(1).
+ */
+
+// Index of the highest set bit; unsigned long is 32 bits on AVR/ARM but
+// 64 on LP64 hosts
+static inline int heapFls(unsigned long x) {
+  return (int)(sizeof(unsigned long) * 8 - 1) - __builtin_clzl(x);
+}
+
+static inline int heapFfs(uint32_t x) {
+  return __builtin_ctzl((unsigned long)x);
+}
+
+static inline FreeBlockLinks* freeLinks(MemoryBlock* block) {
+  return (FreeBlockLinks*)((uint8_t*)block + sizeof(MemoryBlock));
+}
+
+static inline size_t blockSize(const MemoryBlock* block) {
+  return (size_t)block->units << MEM_ALIGN_LOG2;
+}
+
+static inline void setBlockSize(MemoryBlock* block, size_t size) {
+  block->units = size >> MEM_ALIGN_LOG2;
+}
+
+// Boundary tag: a free block's payload size in its last word, and prevFree
+// set in the header above it
+static inline void writeFooter(MemoryBlock* block) {
+  uint8_t* end = (uint8_t*)block + sizeof(MemoryBlock) + blockSize(block);
+  *((uint32_t*)end - 1) = (uint32_t)blockSize(block);
+  ((MemoryBlock*)end)->prevFree = 1;
+}
+
+// The free block just below one whose prevFree is set
+static inline MemoryBlock* prevFreeBlock(MemoryBlock* block) {
+  uint32_t size = *((uint32_t*)block - 1);
+  return (MemoryBlock*)((uint8_t*)block - size - sizeof(MemoryBlock));
+}
+
+static inline void initBlock(MemoryBlock* block, size_t size, bool inUse, uint8_t kind) {
+  block->units = 0;
+  setBlockSize(block, size);
+  block->inUse = inUse;
+  block->prevFree = 0;
+  block->kind = kind;
+  block->tag = 0;
+}
+
+// Mark a block allocated, which also clears the tag the block above had on it
+static inline void markInUse(MemoryBlock* block, int ownerTaskId, uint8_t kind) {
+  block->inUse = 1;
+  block->kind = kind;
+  block->tag = ownerTaskId + 1;
+  ((MemoryBlock*)((uint8_t*)block + sizeof(MemoryBlock) + blockSize(block)))->prevFree = 0;
+}
+
+// Size class of a block of this payload size
+static void heapMapping(size_t size, int* fl, int* sl) {
+  if (size < MEM_SMALL_BLOCK) {
+    *fl = 0;
+    *sl = (int)(size / (MEM_SMALL_BLOCK / MEM_SL_COUNT));
+  } else {
+    int bit = heapFls(size);
+    *sl = (int)(size >> (bit - MEM_SL_LOG2)) ^ MEM_SL_COUNT;
+    *fl = bit - (MEM_FL_SHIFT - 1);
+  }
+}
+
+MemoryBlock* Kernel::getBlockHeader(void* ptr) {
+  if (!ptr) return nullptr;
+  return (MemoryBlock*)((uint8_t*)ptr - sizeof(MemoryBlock));
+}
+
+MemoryBlock* Kernel::nextBlock(MemoryBlock* block) {
+  return (MemoryBlock*)((uint8_t*)block + sizeof(MemoryBlock) + blockSize(block));
+}
+
+// Task slot charged for an in-use block, -1 = the kernel
+int Kernel::blockOwner(MemoryBlock* block) {
+  if (block->kind == BLOCK_HANDLE) return memHandles[block->tag].ownerTaskId;
+  return (int)block->tag - 1;
+}
+
+// Regions emulated with static arrays, where there's no fixed address
+#if KERNEL_DTCM_HEAP_SIZE && !defined(KERNEL_DTCM_HEAP_ADDR)
+static uint8_t dtcmHeap[KERNEL_DTCM_HEAP_SIZE] __attribute__((aligned(16)));
+#endif
+#if KERNEL_SDRAM_HEAP_SIZE && !defined(KERNEL_SDRAM_HEAP_ADDR)
+static uint8_t sdramHeap[KERNEL_SDRAM_HEAP_SIZE] __attribute__((aligned(16)));
+#endif
+
+// Largest payload a block can have
+#define MEM_BLOCK_MAX (((size_t)1 << MEM_FL_INDEX_MAX) - MEM_ALIGN)
+
+// Times a failed allocation asks the shrinkers before it compacts; freed
+// space needn't be in one piece, so one round may not be enough
+#define MEM_SHRINK_ROUNDS 4
+
+// Which region to try first, second and third for each MemHint (-1 = none)
+static const int8_t regionOrder[][MEM_REGION_COUNT] = {
+  {MEM_REGION_SRAM, MEM_REGION_SDRAM, MEM_REGION_DTCM},  // MEM_ANY
+  {MEM_REGION_DTCM, MEM_REGION_SRAM, -1},                // MEM_FAST
+  {MEM_REGION_SDRAM, MEM_REGION_SRAM, -1},               // MEM_BULK
+  {MEM_REGION_SRAM, MEM_REGION_SDRAM, -1}                // MEM_DMA
+};
+
+// Bytes to cut off the front of a free block so its payload starts on an
+// align boundary. What's cut off must be big enough to stay a free block.
+static size_t alignLead(MemoryBlock* block, size_t align) {
+  uintptr_t payload = (uintptr_t)block + sizeof(MemoryBlock);
+  if ((payload & (align - 1)) == 0) return 0;
+  uintptr_t aligned = (payload + sizeof(MemoryBlock) + MEM_MIN_PAYLOAD + align - 1) &
+                      ~(uintptr_t)(align - 1);
+  return aligned - payload;
+}
+
+// Split lead bytes off the front of a free block, leaving the front part
+// for the caller to put back on a free list. Returns the aligned block.
+static MemoryBlock* splitLead(MemoryBlock* block, size_t lead) {
+  MemoryBlock* aligned = (MemoryBlock*)((uint8_t*)block + lead);
+  initBlock(aligned, blockSize(block) - lead, false, BLOCK_RAW);
+  setBlockSize(block, lead - sizeof(MemoryBlock));
+  return aligned;
+}
+
+void Kernel::heapInit() {
+  memset(&compactStats, 0, sizeof(compactStats));
+  memset(&reallocStats, 0, sizeof(reallocStats));
+  compactCursor = nullptr;
+  compactRegion = MEM_REGION_SRAM;
+  
+  heapInitRegion(MEM_REGION_SRAM, "sram", kernelHeap, KERNEL_HEAP_SIZE);
+#if defined(KERNEL_DTCM_HEAP_ADDR)
+  heapInitRegion(MEM_REGION_DTCM, "dtcm", (uint8_t*)KERNEL_DTCM_HEAP_ADDR, KERNEL_DTCM_HEAP_SIZE);
+#elif KERNEL_DTCM_HEAP_SIZE
+  heapInitRegion(MEM_REGION_DTCM, "dtcm", dtcmHeap, KERNEL_DTCM_HEAP_SIZE);
+#else
+  heapInitRegion(MEM_REGION_DTCM, "dtcm", nullptr, 0);
+#endif
+#if defined(KERNEL_SDRAM_HEAP_ADDR)
+  // Start the controller only; the region is ours, not SDRAM.malloc()'s
+  if (SDRAM.begin(0)) {
+    heapInitRegion(MEM_REGION_SDRAM, "sdram", (uint8_t*)KERNEL_SDRAM_HEAP_ADDR, KERNEL_SDRAM_HEAP_SIZE);
+  } else {
+    heapInitRegion(MEM_REGION_SDRAM, "sdram", nullptr, 0);
+  }
+#elif KERNEL_SDRAM_HEAP_SIZE
+  heapInitRegion(MEM_REGION_SDRAM, "sdram", sdramHeap, KERNEL_SDRAM_HEAP_SIZE);
+#else
+  heapInitRegion(MEM_REGION_SDRAM, "sdram", nullptr, 0);
+#endif
+}
+
+// Free blocks spanning the region, closed off by an in-use sentinel. A
+// region too big for one block is cut into segments by zero-size in-use
+// fences, which nothing merges across or moves.
+void Kernel::heapInitRegion(int region, const char* name, uint8_t* base, size_t size) {
+  HeapControl* h = &heaps[region];
+  memset(h, 0, sizeof(HeapControl));
+  h->name = name;
+  size &= ~(size_t)(MEM_ALIGN - 1);
+  if (!base || size < 2 * sizeof(MemoryBlock) + MEM_MIN_PAYLOAD) return;
+  h->base = base;
+  h->size = size;
+  
+  h->sentinel = (MemoryBlock*)(base + size - sizeof(MemoryBlock));
+  initBlock(h->sentinel, 0, true, BLOCK_PINNED);
+  MemoryBlock* block = (MemoryBlock*)base;
+  h->first = block;
+  while (true) {
+    size_t room = (uint8_t*)h->sentinel - (uint8_t*)block - sizeof(MemoryBlock);
+    size_t payload = room;
+    if (room > MEM_BLOCK_MAX) {
+      // Leave the next segment at least a minimal block
+      payload = MEM_BLOCK_MAX;
+      if (room - payload < 2 * sizeof(MemoryBlock) + MEM_MIN_PAYLOAD) {
+        payload = room - 2 * sizeof(MemoryBlock) - MEM_MIN_PAYLOAD;
+      }
+    }
+    initBlock(block, payload, false, BLOCK_RAW);
+    h->capacity += payload;
+    if (payload == room) {
+      heapInsertFree(h, block);
+      break;
+    }
+    MemoryBlock* fence = nextBlock(block);
+    initBlock(fence, 0, true, BLOCK_PINNED);
+    heapInsertFree(h, block);
+    block = (MemoryBlock*)((uint8_t*)fence + sizeof(MemoryBlock));
+  }
+}
+
+// Region holding an address, -1 = none
+int Kernel::regionOf(void* ptr) {
+  for (int r = 0; r < MEM_REGION_COUNT; r++) {
+    if ((uint8_t*)ptr >= heaps[r].base && (uint8_t*)ptr < heaps[r].base + heaps[r].size) {
+      return r;
+    }
+  }
+  return -1;
+}
+
+// Also writes the block's boundary tag
+void Kernel::heapInsertFree(HeapControl* h, MemoryBlock* block) {
+  int fl, sl;
+  heapMapping(blockSize(block), &fl, &sl);
+  writeFooter(block);
+  FreeBlockLinks* links = freeLinks(block);
+  links->prev = nullptr;
+  links->next = h->freeHeads[fl][sl];
+  if (links->next) freeLinks(links->next)->prev = block;
+  h->freeHeads[fl][sl] = block;
+  h->flBitmap |= 1UL << fl;
+  h->slBitmap[fl] |= 1UL << sl;
+}
+
+void Kernel::heapRemoveFree(HeapControl* h, MemoryBlock* block) {
+  int fl, sl;
+  heapMapping(blockSize(block), &fl, &sl);
+  FreeBlockLinks* links = freeLinks(block);
+  if (links->next) freeLinks(links->next)->prev = links->prev;
+  if (links->prev) {
+    freeLinks(links->prev)->next = links->next;
+  } else {
+    h->freeHeads[fl][sl] = links->next;
+    if (!links->next) {
+      h->slBitmap[fl] &= ~(1UL << sl);
+      if (!h->slBitmap[fl]) h->flBitmap &= ~(1UL << fl);
+    }
+  }
+}
+
+// Unlink and return a free block with at least size bytes of payload
+MemoryBlock* Kernel::heapTakeFree(HeapControl* h, size_t size) {
+  // Round up to the next class boundary: any block there is big enough
+  size_t search = size;
+  if (search >= MEM_SMALL_BLOCK) {
+    search += ((size_t)1 << (heapFls(search) - MEM_SL_LOG2)) - 1;
+  }
+  int fl, sl;
+  heapMapping(search, &fl, &sl);
+  
+  MemoryBlock* block = nullptr;
+  if (fl < MEM_FL_COUNT) {
+    uint32_t slMap = h->slBitmap[fl] & (~0UL << sl);
+    if (!slMap) {
+      uint32_t flMap = (fl + 1 < 32) ? h->flBitmap & (~0UL << (fl + 1)) : 0;
+      if (flMap) {
+        fl = heapFfs(flMap);
+        slMap = h->slBitmap[fl];
+      }
+    }
+    if (slMap) block = h->freeHeads[fl][heapFfs(slMap)];
+  }
+  
+  if (!block) {
+    // Nothing a whole class up; a block in the request's own class may
+    // still be big enough (matters when one big block is all that's left)
+    heapMapping(size, &fl, &sl);
+    if (fl >= MEM_FL_COUNT) return nullptr;
+    for (block = h->freeHeads[fl][sl]; block; block = freeLinks(block)->next) {
+      if (blockSize(block) >= size) break;
+    }
+    if (!block) return nullptr;
+  }
+  
+  heapRemoveFree(h, block);
+  return block;
+}
+
+// Trim a block to size, returning the tail to the free lists if it's big
+// enough to be a block of its own. The block itself isn't on a list and is
+// about to be used.
+void Kernel::heapSplit(HeapControl* h, MemoryBlock* block, size_t size) {
+  if (blockSize(block) < size + sizeof(MemoryBlock) + MEM_MIN_PAYLOAD) return;
+  
+  MemoryBlock* rest = (MemoryBlock*)((uint8_t*)block + sizeof(MemoryBlock) + size);
+  initBlock(rest, blockSize(block) - size - sizeof(MemoryBlock), false, BLOCK_RAW);
+  setBlockSize(block, size);
+  
+  MemoryBlock* next = nextBlock(rest);
+  if (!next->inUse) {
+    heapRemoveFree(h, next);
+    if (compactCursor == next) compactCursor = rest;
+    setBlockSize(rest, blockSize(rest) + sizeof(MemoryBlock) + blockSize(next));
+  }
+  heapInsertFree(h, rest);
+}
+
+// Merge a free block (not on any list) with free neighbours, which are
+// taken off their lists. Returns the merged block. A compaction cursor on
+// a header that disappears moves to the merged block.
+MemoryBlock* Kernel::heapMergeFree(HeapControl* h, MemoryBlock* block) {
+  if (block->prevFree) {
+    MemoryBlock* prev = prevFreeBlock(block);
+    heapRemoveFree(h, prev);
+    if (compactCursor == block) compactCursor = prev;
+    setBlockSize(prev, blockSize(prev) + sizeof(MemoryBlock) + blockSize(block));
+    block = prev;
+  }
+  MemoryBlock* next = nextBlock(block);
+  if (!next->inUse) {  // The sentinel (or a fence) stops us at the end
+    heapRemoveFree(h, next);
+    if (compactCursor == next) compactCursor = block;
+    setBlockSize(block, blockSize(block) + sizeof(MemoryBlock) + blockSize(next));
+  }
+  return block;
+}
+
+// The largest is taken from the head of the top non-empty class, so it
+// can read a little low. Caller holds the critical section.
+size_t Kernel::heapLargestFree(HeapControl* h) {
+  if (!h->flBitmap) return 0;
+  int fl = heapFls(h->flBitmap);
+  return blockSize(h->freeHeads[fl][heapFls(h->slBitmap[fl])]);
+}
+
+// Resize an in-use block in place: shrink by splitting the tail off, grow
+// by taking the free block just above. False if it can't grow there.
+// Caller holds the critical section.
+bool Kernel::heapResize(HeapControl* h, MemoryBlock* block, size_t size) {
+  size_t oldSize = blockSize(block);
+  if (size > oldSize) {
+    MemoryBlock* next = nextBlock(block);
+    if (next->inUse || oldSize + sizeof(MemoryBlock) + blockSize(next) < size) return false;
+    heapRemoveFree(h, next);
+    if (compactCursor == next) compactCursor = block;
+    setBlockSize(block, oldSize + sizeof(MemoryBlock) + blockSize(next));
+    nextBlock(block)->prevFree = 0;
+  }
+  heapSplit(h, block, size);
+  
+  size_t newSize = blockSize(block);
+  h->used += newSize - oldSize;
+  if (h->used > h->peak) h->peak = h->used;
+  int owner = blockOwner(block);
+  if (owner >= 0 && owner < taskSlots) {
+    Task* task = &tasks[owner];
+    task->memoryUsed += newSize - oldSize;
+    if (task->memoryUsed > task->memoryPeak) task->memoryPeak = task->memoryUsed;
+  }
+  return true;
+}
+
+// Share of a region's free space (percent) outside its largest free block,
+// counting no more than one fenced segment's worth as the ideal
+int Kernel::heapFragmentation(int region) {
+  HeapControl* h = &heaps[region];
+  uint32_t irq = portEnterCritical();
+  size_t freeBytes = h->capacity - h->used;
+  size_t largest = heapLargestFree(h);
+  portExitCritical(irq);
+  if (freeBytes > MEM_BLOCK_MAX) freeBytes = MEM_BLOCK_MAX;
+  if (freeBytes == 0 || !h->base) return 0;
+  return 100 - (int)((uint64_t)largest * 100 / freeBytes);
+}
+
+// Tries the hint's regions in order, compacting them all before giving up.
+// A bigger align than MEM_ALIGN pads size to it and searches for enough
+// room to cut a free block off the front.
+void* Kernel::allocateMemoryInternal(size_t size, int taskId, MemHint hint, size_t align) {
+  if (size == 0) return nullptr;
+  
+  size = (size + align - 1) & ~(size_t)(align - 1);
+  if (size < MEM_MIN_PAYLOAD) size = MEM_MIN_PAYLOAD;
+  size_t search = (align > MEM_ALIGN) ? size + align + sizeof(MemoryBlock) + MEM_MIN_PAYLOAD : size;
+  
+  const int8_t* order = regionOrder[hint];
+  HeapControl* first = nullptr;
+  for (int i = 0; i < MEM_REGION_COUNT && order[i] >= 0 && !first; i++) {
+    if (heaps[order[i]].base) first = &heaps[order[i]];
+  }
+  
+  // Out of room: ask the shrinkers, a few rounds while they find something
+  // to give back, then compact
+  HeapControl* h = nullptr;
+  MemoryBlock* block = nullptr;
+  uint32_t irq = 0;
+  int shrinkRounds = 0;
+  bool compacted = false;
+  for (;;) {
+    irq = portEnterCritical();
+    for (int i = 0; i < MEM_REGION_COUNT && order[i] >= 0 && !block; i++) {
+      h = &heaps[order[i]];
+      if (h->base) block = heapTakeFree(h, search);
+    }
+    if (block) {
+      if (shrinkRounds) pressureStats.rescued++;
+      break;
+    }
+    if (first && shrinkRounds == 0) pressureStats.events[MEM_PRESSURE_OOM]++;
+    portExitCritical(irq);
+    
+    if (first && shrinkRounds < MEM_SHRINK_ROUNDS) {
+      if (shrinkRounds == 0) pressureMessage(MEM_PRESSURE_OOM, (int)(first - heaps), search);
+      shrinkRounds = memShrink((int)(first - heaps), search) ? shrinkRounds + 1 : MEM_SHRINK_ROUNDS;
+    } else if (!compacted) {
+      Serial.println(F("[Memory] Out of space, compacting..."));
+      for (int i = 0; i < MEM_REGION_COUNT && order[i] >= 0; i++) {
+        if (heaps[order[i]].base) compactMemory(order[i]);
+      }
+      compacted = true;
+    } else {
+      break;
+    }
+  }
+  
+  if (!block) {
+    irq = portEnterCritical();
+    if (first) first->failures++;
+    portExitCritical(irq);
+    Serial.println(F("[Memory] Out of memory after compaction!"));
+    return nullptr;
+  }
+  if (h != first) first->spills++;
+  
+  size_t lead = alignLead(block, align);
+  if (lead) {
+    MemoryBlock* aligned = splitLead(block, lead);
+    heapInsertFree(h, block);
+    block = aligned;
+  }
+  heapSplit(h, block, size);
+  markInUse(block, taskId, BLOCK_RAW);
+  
+  h->used += sizeof(MemoryBlock) + blockSize(block);
+  if (h->used > h->peak) h->peak = h->used;
+  h->allocs++;
+  
+  if (taskId >= 0 && taskId < taskSlots) {
+    Task* owner = &tasks[taskId];
+    owner->memoryUsed += blockSize(block);
+    if (owner->memoryUsed > owner->memoryPeak) owner->memoryPeak = owner->memoryUsed;
+  }
+  int level = regionPressure(h);
+  bool deeper = level > h->pressure;
+  if (deeper) {
+    h->pressure = level;
+    pressureStats.events[level]++;
+  }
+  portExitCritical(irq);
+  
+  if (deeper) {
+    pressureMessage(level, (int)(h - heaps), 0);
+    if (level >= MEM_PRESSURE_MIN) memShrink((int)(h - heaps), 0);
+  }
+  return (void*)((uint8_t*)block + sizeof(MemoryBlock));
+}
+
+void Kernel::freeMemoryInternal(void* ptr) {
+  if (!ptr) return;
+  
+  MemoryBlock* block = getBlockHeader(ptr);
+  int region = regionOf(block);
+  uint32_t irq = portEnterCritical();
+  if (region < 0 || block >= heaps[region].sentinel || !block->inUse) {
+    portExitCritical(irq);
+    Serial.println(F("[Memory] Warning: Invalid free()"));
+    return;
+  }
+  
+  if (block->kind == BLOCK_ARENA) {
+    arenaFreeBlock(block);
+    portExitCritical(irq);
+    return;
+  }
+  
+  int owner = blockOwner(block);
+  if (owner >= 0 && owner < taskSlots) {
+    tasks[owner].memoryUsed -= blockSize(block);
+  }
+  HeapControl* h = &heaps[region];
+  h->used -= sizeof(MemoryBlock) + blockSize(block);
+  h->frees++;
+  
+  block->inUse = false;
+  block->kind = BLOCK_RAW;
+  block->tag = 0;
+  heapInsertFree(h, heapMergeFree(h, block));
+  if (h->pressure) {
+    int level = regionPressure(h);
+    if (level < h->pressure) h->pressure = level;  // Report the next drop again
+  }
+  portExitCritical(irq);
+}
+
+/*
+ * Compaction slides movable blocks down over the free space. Only handle
+ * blocks nobody has pinned are movable: raw malloc() pointers, arenas,
+ * stacks and pinned handles stay where they are. Each move pushes the free
+ * block in front of a movable block past it, merging it with whatever free
+ * space follows.
+ *
+ * The work is done in steps that each hold the lock for about budget bytes
+ * of copying (visiting a block counts as its header's worth), resuming
+ * where the last step stopped. idle() runs one step per slice while a
+ * sweep is due; a block bigger than the budget still moves in one go.
+ * Each sweep covers one region (compactRegion); blocks never move between
+ * regions.
+ */
+
+// Returns whether the sweep has further to go
+bool Kernel::compactStep(size_t budget) {
+  uint32_t irq = portEnterCritical();
+  uint32_t start = micros();
+  
+  HeapControl* h = &heaps[compactRegion];
+  MemoryBlock* block = compactCursor;
+  if (!block) {
+    block = h->first;
+    h->freesAtSweep = h->frees;
+  }
+  
+  size_t spent = 0;
+  while (block != h->sentinel && spent < budget) {
+    MemoryBlock* next = nextBlock(block);
+    spent += sizeof(MemoryBlock);
+    bool movable = next->inUse && next->kind == BLOCK_HANDLE &&
+                   memHandles[next->tag].lockCount == 0;
+    if (block->inUse || !movable) {
+      block = next;
+      continue;
+    }
+    
+    heapRemoveFree(h, block);
+    size_t holeSize = blockSize(block);
+    size_t moveSize = sizeof(MemoryBlock) + blockSize(next);
+    
+    // Move the block down and tell its handle. Free blocks never sit next
+    // to each other, so whatever is below it now is in use.
+    memmove(block, next, moveSize);
+    MemoryBlock* moved = block;
+    moved->prevFree = 0;
+    memHandles[moved->tag].ptr = (uint8_t*)moved + sizeof(MemoryBlock);
+    compactStats.blocksMoved++;
+    compactStats.bytesMoved += moveSize;
+    spent += moveSize;
+    
+    // The free space is now above it
+    MemoryBlock* hole = nextBlock(moved);
+    initBlock(hole, holeSize, false, BLOCK_RAW);
+    compactCursor = nullptr;  // Not tracking a header while we rebuild them
+    block = heapMergeFree(h, hole);
+    heapInsertFree(h, block);
+  }
+  
+  bool more = (block != h->sentinel);
+  compactCursor = more ? block : nullptr;
+  if (!more) compactStats.passes++;
+  
+  uint32_t pause = micros() - start;
+  compactStats.steps++;
+  compactStats.pauseTotalMicros += pause;
+  if (pause > compactStats.pauseMaxMicros) compactStats.pauseMaxMicros = pause;
+  portExitCritical(irq);
+  return more;
+}
+
+// A sweep is under way, or some region has had blocks freed since its last
+// one and has fragmented past the threshold (which picks it for the sweep)
+bool Kernel::compactDue() {
+  if (compactCursor) return true;
+  for (int r = 0; r < MEM_REGION_COUNT; r++) {
+    HeapControl* h = &heaps[r];
+    if (h->base && h->frees != h->freesAtSweep &&
+        heapFragmentation(r) >= KERNEL_COMPACT_THRESHOLD) {
+      compactRegion = r;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Full sweep of a region, still in bounded steps so other cores and
+// interrupts get in between them
+void Kernel::compactMemory(int region) {
+  uint32_t irq = portEnterCritical();
+  compactRegion = region;
+  compactCursor = nullptr;  // Start from the bottom
+  portExitCritical(irq);
+  while (compactStep(KERNEL_COMPACT_STEP_BYTES)) {}
+}
+
+// What idle() does with a slice while compaction is due; a host replay of
+// a malloc trace calls it where the trace shows the device idle
+bool Kernel::memCompactIdle() {
+  uint32_t irq = portEnterCritical();
+  bool due = compactDue();
+  portExitCritical(irq);
+  if (due) compactStep(KERNEL_COMPACT_STEP_BYTES);
+  return due;
+}
+
+int Kernel::memCompactInfo(CompactStats* out) {
+  if (!out) return SYS_ERR_INVALID_PARAM;
+  uint32_t irq = portEnterCritical();
+  *out = compactStats;
+  portExitCritical(irq);
+  return SYS_OK;
+}
+
+// The running task's arena, or the heap for loop(), which has no arena
+void* Kernel::taskAlloc(size_t size, MemHint hint, size_t align) {
+  int taskId = runningTaskId();
+  if (taskId == 0) {
+    return allocateMemoryInternal(size, taskId, hint, align);
+  }
+  return arenaAlloc(&tasks[taskId], size, hint, align);
+}
+
+void* Kernel::memAlloc(size_t size, MemHint hint) {
+  void* ptr = taskAlloc(size, hint, MEM_ALIGN);
+  MEM_TRACE(MEM_TRACE_ALLOC, ptr, size, 0, hint);
+  return ptr;
+}
+
+void Kernel::memFree(void* ptr) {
+  MEM_TRACE(MEM_TRACE_FREE, ptr, 0, 0, 0);
+  freeMemoryInternal(ptr);
+}
+
+void* Kernel::memAllocAligned(size_t size, size_t align, MemHint hint) {
+  if (align & (align - 1)) return nullptr;  // Not a power of two
+  if (align < MEM_ALIGN) align = MEM_ALIGN;
+  void* ptr = taskAlloc(size, hint, align);
+  MEM_TRACE(MEM_TRACE_ALLOC, ptr, size, align, hint);
+  return ptr;
+}
+
+void* Kernel::memAllocDma(size_t size) {
+  void* ptr = taskAlloc(size, MEM_DMA, DMA_ALIGN);
+  MEM_TRACE(MEM_TRACE_ALLOC, ptr, size, DMA_ALIGN, MEM_DMA);
+  return ptr;
+}
+
+#if KERNEL_MEM_TRACE
+void Kernel::memTraceRecord(uint8_t op, void* ptr, size_t size, uintptr_t aux,
+                            uint8_t hint, void* site) {
+  uint32_t now = micros();
+  uint32_t irq = portEnterCritical();
+  MemTraceEntry* e = &memTrace[memTraceTotal % KERNEL_MEM_TRACE];
+  e->micros = now;
+  e->size = (uint32_t)size;
+  e->ptr = (uintptr_t)ptr;
+  e->aux = aux;
+  e->site = (uintptr_t)site;
+  e->taskId = (int16_t)runningTaskId();
+  e->op = op;
+  e->hint = hint;
+  memTraceTotal++;
+  portExitCritical(irq);
+}
+#endif
+
+// One CSV line per entry, oldest first. Entries are copied out one at a
+// time, so recording carries on meanwhile; any the ring overwrites before
+// they're reached are skipped.
+int Kernel::memTraceDump(const char* path) {
+#if KERNEL_MEM_TRACE
+  if (!sdInitialized) return SYS_ERR_IO_ERROR;
+  if (!path) return SYS_ERR_INVALID_PARAM;
+  if (!hasPermission(getCurrentTask(), TASK_PERM_SD)) return SYS_ERR_PERMISSION;
+  
+  SD.remove(path);
+  File file = SD.open(path, FILE_WRITE);
+  if (!file) return SYS_ERR_IO_ERROR;
+  file.println(F("micros,op,task,size,hint,ptr,aux,site"));
+  
+  uint32_t irq = portEnterCritical();
+  uint32_t end = memTraceTotal;
+  portExitCritical(irq);
+  uint32_t start = (end > KERNEL_MEM_TRACE) ? end - KERNEL_MEM_TRACE : 0;
+  
+  int written = 0;
+  char line[96];
+  for (uint32_t i = start; i < end; i++) {
+    irq = portEnterCritical();
+    bool lost = memTraceTotal - i > KERNEL_MEM_TRACE;
+    MemTraceEntry e = memTrace[i % KERNEL_MEM_TRACE];
+    portExitCritical(irq);
+    if (lost) continue;
+    
+    snprintf(line, sizeof(line), "%lu,%c,%d,%lu,%u,%lx,%lx,%lx",
+             (unsigned long)e.micros, e.op, e.taskId, (unsigned long)e.size, e.hint,
+             (unsigned long)e.ptr, (unsigned long)e.aux, (unsigned long)e.site);
+    file.println(line);
+    written++;
+  }
+  file.close();
+  return written;
+#else
+  (void)path;
+  return SYS_ERR_INVALID_CALL;
+#endif
+}
+
+// D-cache maintenance by address through CMSIS, widened to whole lines; a
+// no-op on cores without a data cache
+void Kernel::dmaClean(const void* ptr, size_t size) {
+#if defined(__DCACHE_PRESENT) && __DCACHE_PRESENT
+  uintptr_t start = (uintptr_t)ptr & ~(uintptr_t)(DMA_ALIGN - 1);
+  uintptr_t end = ((uintptr_t)ptr + size + DMA_ALIGN - 1) & ~(uintptr_t)(DMA_ALIGN - 1);
+  SCB_CleanDCache_by_Addr((uint32_t*)start, (int32_t)(end - start));
+#else
+  (void)ptr; (void)size;
+#endif
+}
+
+// A range that doesn't cover its first and last lines whole is cleaned as
+// well, so whatever else is in those lines survives
+void Kernel::dmaInvalidate(void* ptr, size_t size) {
+#if defined(__DCACHE_PRESENT) && __DCACHE_PRESENT
+  uintptr_t start = (uintptr_t)ptr & ~(uintptr_t)(DMA_ALIGN - 1);
+  uintptr_t end = ((uintptr_t)ptr + size + DMA_ALIGN - 1) & ~(uintptr_t)(DMA_ALIGN - 1);
+  if (start == (uintptr_t)ptr && end == (uintptr_t)ptr + size) {
+    SCB_InvalidateDCache_by_Addr((uint32_t*)start, (int32_t)(end - start));
+  } else {
+    SCB_CleanInvalidateDCache_by_Addr((uint32_t*)start, (int32_t)(end - start));
+  }
+#else
+  (void)ptr; (void)size;
+#endif
+}
+
+// Whether DMA can work on a buffer in place: it covers whole cache lines,
+// so it shares none, and lies in a region DMA reaches. Memory outside the
+// heap regions is never assumed to be reachable.
+bool Kernel::isDmaSafe(const void* ptr, size_t size) {
+  if (((uintptr_t)ptr | size) & (DMA_ALIGN - 1)) return false;
+  int region = regionOf((void*)ptr);
+  return region >= 0 && region != MEM_REGION_DTCM;
+}
+
+// Handle blocks are resized through their owner, not by address, and
+// kernel-pinned blocks not at all
+void* Kernel::memRealloc(void* ptr, size_t size) {
+  if (!ptr) {
+    void* fresh = taskAlloc(size, MEM_ANY, MEM_ALIGN);
+    MEM_TRACE(MEM_TRACE_REALLOC, fresh, size, 0, MEM_ANY);
+    return fresh;
+  }
+  if (size == 0) {
+    MEM_TRACE(MEM_TRACE_REALLOC, nullptr, 0, (uintptr_t)ptr, MEM_ANY);
+    freeMemoryInternal(ptr);
+    return nullptr;
+  }
+  size_t want = (size + MEM_ALIGN - 1) & ~(size_t)(MEM_ALIGN - 1);
+  if (want < MEM_MIN_PAYLOAD) want = MEM_MIN_PAYLOAD;
+  
+  MemoryBlock* block = getBlockHeader(ptr);
+  int region = regionOf(block);
+  uint32_t irq = portEnterCritical();
+  if (region < 0 || block >= heaps[region].sentinel || !block->inUse ||
+      (block->kind != BLOCK_RAW && block->kind != BLOCK_ARENA)) {
+    portExitCritical(irq);
+    Serial.println(F("[Memory] Warning: Invalid realloc()"));
+    return nullptr;
+  }
+  
+  size_t oldSize = blockSize(block);
+  bool resized = (block->kind == BLOCK_ARENA) ? arenaResize(block, want)
+                                              : heapResize(&heaps[region], block, want);
+  if (resized) {
+    if (want > oldSize) {
+      reallocStats.grownInPlace++;
+    } else if (want < oldSize) {
+      reallocStats.shrunkInPlace++;
+    }
+    portExitCritical(irq);
+    MEM_TRACE(MEM_TRACE_REALLOC, ptr, size, (uintptr_t)ptr, MEM_ANY);
+    return ptr;
+  }
+  portExitCritical(irq);
+  
+  // Move it, staying in the same region if there's room
+  static const MemHint regionHint[MEM_REGION_COUNT] = {MEM_ANY, MEM_FAST, MEM_BULK};
+  void* moved = taskAlloc(size, regionHint[region], MEM_ALIGN);
+  MEM_TRACE(MEM_TRACE_REALLOC, moved, size, (uintptr_t)ptr, regionHint[region]);
+  if (!moved) return nullptr;
+  memcpy(moved, ptr, oldSize);
+  freeMemoryInternal(ptr);
+  
+  irq = portEnterCritical();
+  reallocStats.moved++;
+  reallocStats.bytesCopied += oldSize;
+  portExitCritical(irq);
+  return moved;
+}
+
+size_t Kernel::memAvailable() {
+  size_t available = 0;
+  for (int r = 0; r < MEM_REGION_COUNT; r++) {
+    available += heaps[r].capacity - heaps[r].used;
+  }
+  return available;
+}
+
+void Kernel::memCompact() {
+  for (int r = 0; r < MEM_REGION_COUNT; r++) {
+    if (heaps[r].base) compactMemory(r);
+  }
+}
+
+int Kernel::memRegionInfo(int region, MemRegionInfo* out) {
+  if (region < 0 || region >= MEM_REGION_COUNT || !out) return SYS_ERR_INVALID_PARAM;
+  
+  HeapControl* h = &heaps[region];
+  uint32_t irq = portEnterCritical();
+  out->name = h->name;
+  out->size = h->size;
+  out->used = h->used;
+  out->peak = h->peak;
+  out->largestFree = h->base ? heapLargestFree(h) : 0;
+  out->allocs = h->allocs;
+  out->failures = h->failures;
+  out->spills = h->spills;
+  portExitCritical(irq);
+  out->fragmentation = heapFragmentation(region);
+  return SYS_OK;
+}
+
+int Kernel::memHandleAlloc(size_t size) {
+  int taskId = runningTaskId();
+  void* ptr = allocateMemoryInternal(size, taskId);
+  if (!ptr) return SYS_ERR_NO_MEMORY;
+  
+  // The block can't move until its header names the handle
+  uint32_t irq = portEnterCritical();
+  for (int i = 0; i < MAX_MEM_HANDLES; i++) {
+    if (!memHandles[i].ptr) {
+      memHandles[i].ptr = ptr;
+      memHandles[i].ownerTaskId = taskId;
+      memHandles[i].lockCount = 0;
+      memHandles[i].freeOnUnpin = false;
+      getBlockHeader(ptr)->kind = BLOCK_HANDLE;
+      getBlockHeader(ptr)->tag = i;
+      portExitCritical(irq);
+      return i;
+    }
+  }
+  freeMemoryInternal(ptr);
+  portExitCritical(irq);
+  return SYS_ERR_NO_MEMORY;
+}
+
+int Kernel::memHandleFree(int handle) {
+  if (handle < 0 || handle >= MAX_MEM_HANDLES) return SYS_ERR_INVALID_PARAM;
+  
+  uint32_t irq = portEnterCritical();
+  MemHandle* h = &memHandles[handle];
+  if (!h->ptr) {
+    portExitCritical(irq);
+    return SYS_ERR_NOT_FOUND;
+  }
+  
+  // Only owner or kernel can free
+  int callerId = runningTaskId();
+  if (h->ownerTaskId != callerId && callerId != 0) {
+    portExitCritical(irq);
+    return SYS_ERR_PERMISSION;
+  }
+  if (h->lockCount > 0) {
+    portExitCritical(irq);
+    return SYS_ERR_BUSY;  // Freeing would pull the block out from under a deref
+  }
+  
+  freeMemoryInternal(h->ptr);
+  h->ptr = nullptr;
+  portExitCritical(irq);
+  return SYS_OK;
+}
+
+void* Kernel::memDeref(int handle) {
+  if (handle < 0 || handle >= MAX_MEM_HANDLES) return nullptr;
+  
+  uint32_t irq = portEnterCritical();
+  MemHandle* h = &memHandles[handle];
+  void* ptr = nullptr;
+  if (h->ptr && !h->freeOnUnpin && h->lockCount < 255) {
+    h->lockCount++;
+    ptr = h->ptr;
+  }
+  portExitCritical(irq);
+  return ptr;
+}
+
+int Kernel::memUnpin(int handle) {
+  if (handle < 0 || handle >= MAX_MEM_HANDLES) return SYS_ERR_INVALID_PARAM;
+  
+  uint32_t irq = portEnterCritical();
+  MemHandle* h = &memHandles[handle];
+  int result = SYS_OK;
+  if (!h->ptr) {
+    result = SYS_ERR_NOT_FOUND;
+  } else if (h->lockCount == 0) {
+    result = SYS_ERR_INVALID_PARAM;  // Unbalanced unpin
+  } else if (--h->lockCount == 0 && h->freeOnUnpin) {
+    freeMemoryInternal(h->ptr);  // Owner's gone; this was the last pin
+    h->ptr = nullptr;
+  }
+  portExitCritical(irq);
+  return result;
+}
+
+// ============================================================================
+// TASK ARENAS
+// ============================================================================
+
+/*
+ * A task's malloc()s come from its own arena: chunks taken from the heap,
+ * each laid out as a small heap (blocks with the usual headers and boundary
+ * tags, closed by an in-use sentinel with the ArenaChunk record after it)
+ * whose free blocks sit on one first-fit list per task. Freeing merges
+ * neighbours within the chunk; a chunk that empties goes back to the heap
+ * unless it's the task's last ordinary one. killTask hands all the chunks
+ * back without looking at the blocks inside.
+ */
+
+#define ARENA_TRAILER ((sizeof(ArenaChunk) + MEM_ALIGN - 1) & ~(size_t)(MEM_ALIGN - 1))
+#define ARENA_CHUNK_USABLE (ARENA_CHUNK_SIZE - ARENA_TRAILER - 2 * sizeof(MemoryBlock))
+
+// Also writes the block's boundary tag
+void Kernel::arenaInsertFree(Task* task, MemoryBlock* block) {
+  writeFooter(block);
+  FreeBlockLinks* links = freeLinks(block);
+  links->prev = nullptr;
+  links->next = task->arenaFree;
+  if (links->next) freeLinks(links->next)->prev = block;
+  task->arenaFree = block;
+}
+
+void Kernel::arenaRemoveFree(Task* task, MemoryBlock* block) {
+  FreeBlockLinks* links = freeLinks(block);
+  if (links->next) freeLinks(links->next)->prev = links->prev;
+  if (links->prev) {
+    freeLinks(links->prev)->next = links->next;
+  } else {
+    task->arenaFree = links->next;
+  }
+}
+
+// Add a chunk with room for at least size bytes, placed as hinted. Returns
+// its free block (already on the task's list), nullptr if none could be had.
+MemoryBlock* Kernel::arenaGrow(Task* task, size_t size, MemHint hint) {
+  size_t usable = (size > ARENA_CHUNK_USABLE) ? size : ARENA_CHUNK_USABLE;
+  MemoryBlock* block = (MemoryBlock*)allocateMemoryInternal(
+      2 * sizeof(MemoryBlock) + usable + ARENA_TRAILER, -1, hint);
+  if (!block) return nullptr;
+  MemoryBlock* header = getBlockHeader(block);
+  header->kind = BLOCK_PINNED;
+  
+  initBlock(block, usable, false, BLOCK_RAW);
+  MemoryBlock* sentinel = nextBlock(block);
+  initBlock(sentinel, 0, true, BLOCK_PINNED);
+  ArenaChunk* chunk = (ArenaChunk*)((uint8_t*)sentinel + sizeof(MemoryBlock));
+  chunk->first = block;
+  
+  uint32_t irq = portEnterCritical();
+  if (taskHot.state[task->id] == TASK_EMPTY || taskHot.state[task->id] == TASK_ZOMBIE) {
+    freeMemoryInternal(block);  // Killed meanwhile; its arena is gone
+    portExitCritical(irq);
+    return nullptr;
+  }
+  chunk->prev = nullptr;
+  chunk->next = task->arena;
+  if (chunk->next) chunk->next->prev = chunk;
+  task->arena = chunk;
+  task->arenaBytes += sizeof(MemoryBlock) + blockSize(header);
+  arenaInsertFree(task, block);
+  portExitCritical(irq);
+  return block;
+}
+
+// Like heapSplit, for a block in an arena chunk
+void Kernel::arenaSplit(Task* task, MemoryBlock* block, size_t size) {
+  if (blockSize(block) < size + sizeof(MemoryBlock) + MEM_MIN_PAYLOAD) return;
+  
+  MemoryBlock* rest = (MemoryBlock*)((uint8_t*)block + sizeof(MemoryBlock) + size);
+  initBlock(rest, blockSize(block) - size - sizeof(MemoryBlock), false, BLOCK_RAW);
+  setBlockSize(block, size);
+  
+  MemoryBlock* next = nextBlock(rest);
+  if (!next->inUse) {
+    arenaRemoveFree(task, next);
+    setBlockSize(rest, blockSize(rest) + sizeof(MemoryBlock) + blockSize(next));
+  }
+  arenaInsertFree(task, rest);
+}
+
+// Like heapResize, within the block's arena chunk. Caller holds the
+// critical section.
+bool Kernel::arenaResize(MemoryBlock* block, size_t size) {
+  Task* task = &tasks[blockOwner(block)];
+  size_t oldSize = blockSize(block);
+  if (size > oldSize) {
+    MemoryBlock* next = nextBlock(block);
+    if (next->inUse || oldSize + sizeof(MemoryBlock) + blockSize(next) < size) return false;
+    arenaRemoveFree(task, next);
+    setBlockSize(block, oldSize + sizeof(MemoryBlock) + blockSize(next));
+    nextBlock(block)->prevFree = 0;
+  }
+  arenaSplit(task, block, size);
+  
+  task->memoryUsed += blockSize(block) - oldSize;
+  if (task->memoryUsed > task->memoryPeak) task->memoryPeak = task->memoryUsed;
+  return true;
+}
+
+// Chunks from every region share the task's free list; the search goes
+// through it once per region the hint allows, in the hint's order
+void* Kernel::arenaAlloc(Task* task, size_t size, MemHint hint, size_t align) {
+  if (size == 0) return nullptr;
+  size = (size + align - 1) & ~(size_t)(align - 1);
+  if (size < MEM_MIN_PAYLOAD) size = MEM_MIN_PAYLOAD;
+  
+  const int8_t* order = regionOrder[hint];
+  uint32_t irq = portEnterCritical();
+  MemoryBlock* block = nullptr;
+  for (int i = 0; i < MEM_REGION_COUNT && order[i] >= 0 && !block; i++) {
+    if (!heaps[order[i]].base) continue;
+    for (block = task->arenaFree; block; block = freeLinks(block)->next) {
+      if (blockSize(block) >= size + alignLead(block, align) && regionOf(block) == order[i]) break;
+    }
+  }
+  
+  if (!block) {
+    // No room: another chunk (the heap takes its own lock)
+    portExitCritical(irq);
+    size_t room = (align > MEM_ALIGN) ? size + align + sizeof(MemoryBlock) + MEM_MIN_PAYLOAD : size;
+    block = arenaGrow(task, room, hint);
+    if (!block) return nullptr;
+    irq = portEnterCritical();
+    if (!task->arena) {
+      portExitCritical(irq);  // Killed meanwhile; the chunk went with it
+      return nullptr;
+    }
+  }
+  
+  arenaRemoveFree(task, block);
+  size_t lead = alignLead(block, align);
+  if (lead) {
+    MemoryBlock* aligned = splitLead(block, lead);
+    arenaInsertFree(task, block);
+    block = aligned;
+  }
+  arenaSplit(task, block, size);
+  markInUse(block, task->id, BLOCK_ARENA);
+  task->memoryUsed += blockSize(block);
+  if (task->memoryUsed > task->memoryPeak) task->memoryPeak = task->memoryUsed;
+  portExitCritical(irq);
+  
+  return (void*)((uint8_t*)block + sizeof(MemoryBlock));
+}
+
+// Caller holds the critical section
+void Kernel::arenaFreeBlock(MemoryBlock* block) {
+  Task* task = &tasks[blockOwner(block)];
+  task->memoryUsed -= blockSize(block);
+  block->inUse = false;
+  block->kind = BLOCK_RAW;
+  block->tag = 0;
+  
+  if (block->prevFree) {
+    MemoryBlock* prev = prevFreeBlock(block);
+    arenaRemoveFree(task, prev);
+    setBlockSize(prev, blockSize(prev) + sizeof(MemoryBlock) + blockSize(block));
+    block = prev;
+  }
+  MemoryBlock* next = nextBlock(block);
+  if (!next->inUse) {
+    arenaRemoveFree(task, next);
+    setBlockSize(block, blockSize(block) + sizeof(MemoryBlock) + blockSize(next));
+    next = nextBlock(block);
+  }
+  
+  // Whole chunk free: give it back, unless it's the last ordinary one.
+  // Only the sentinel has size 0, and the chunk record follows it.
+  if (blockSize(next) == 0) {
+    ArenaChunk* chunk = (ArenaChunk*)((uint8_t*)next + sizeof(MemoryBlock));
+    if (chunk->first == block &&
+        (chunk->next || chunk->prev || blockSize(block) > ARENA_CHUNK_USABLE)) {
+      if (chunk->next) chunk->next->prev = chunk->prev;
+      if (chunk->prev) {
+        chunk->prev->next = chunk->next;
+      } else {
+        task->arena = chunk->next;
+      }
+      task->arenaBytes -= sizeof(MemoryBlock) + blockSize(getBlockHeader(block));
+      freeMemoryInternal(block);
+      return;
+    }
+  }
+  arenaInsertFree(task, block);
+}
+
+// Give a dead task's chunks back. Caller holds the critical section.
+void Kernel::arenaRelease(Task* task) {
+  ArenaChunk* chunk = task->arena;
+  while (chunk) {
+    ArenaChunk* next = chunk->next;
+    freeMemoryInternal(chunk->first);  // The record goes with it
+    chunk = next;
+  }
+  task->arena = nullptr;
+  task->arenaFree = nullptr;
+  task->arenaBytes = 0;
+}
+
+int Kernel::memUsage(int taskId, MemUsage* out) {
+  if (!out) return SYS_ERR_INVALID_PARAM;
+  
+  uint32_t irq = portEnterCritical();
+  Task* task = getTask(taskId);
+  if (!task) {
+    portExitCritical(irq);
+    return SYS_ERR_NOT_FOUND;
+  }
+  out->used = task->memoryUsed;
+  out->peak = task->memoryPeak;
+  out->arenaBytes = task->arenaBytes;
+  out->arenaChunks = 0;
+  for (ArenaChunk* chunk = task->arena; chunk; chunk = chunk->next) {
+    out->arenaChunks++;
+  }
+  portExitCritical(irq);
+  return SYS_OK;
+}
+
+// ============================================================================
+// MEMORY POOLS
+// ============================================================================
+
+// A slab is one pinned heap block: a link to the next slab, then perSlab
+// objects. Slabs stay until the pool is destroyed.
+int Kernel::poolCreateInternal(size_t objSize, int perSlab, int ownerTaskId, const char* name) {
+  if (objSize == 0 || perSlab <= 0) return SYS_ERR_INVALID_PARAM;
+  
+  uint32_t irq = portEnterCritical();
+  for (int i = 0; i < MAX_MEM_POOLS; i++) {
+    if (!memPools[i].inUse) {
+      MemPool* pool = &memPools[i];
+      memset(pool, 0, sizeof(MemPool));
+      pool->inUse = true;
+      pool->ownerTaskId = ownerTaskId;
+      pool->name = name;
+      pool->objSize = (objSize + MEM_ALIGN - 1) & ~(size_t)(MEM_ALIGN - 1);
+      pool->perSlab = perSlab;
+      portExitCritical(irq);
+      return i;
+    }
+  }
+  portExitCritical(irq);
+  return SYS_ERR_NO_MEMORY;
+}
+
+bool Kernel::poolGrow(MemPool* pool) {
+  uint8_t* slab = (uint8_t*)allocateMemoryInternal(
+      MEM_ALIGN + pool->objSize * pool->perSlab, pool->ownerTaskId);
+  if (!slab) return false;
+  getBlockHeader(slab)->kind = BLOCK_PINNED;
+  
+  uint32_t irq = portEnterCritical();
+  *(void**)slab = pool->slabs;
+  pool->slabs = slab;
+  pool->slabCount++;
+  for (int i = pool->perSlab - 1; i >= 0; i--) {
+    void* obj = slab + MEM_ALIGN + i * pool->objSize;
+    *(void**)obj = pool->freeList;
+    pool->freeList = obj;
+  }
+  portExitCritical(irq);
+  return true;
+}
+
+// Free every slab. Caller holds the critical section.
+void Kernel::poolRelease(int poolId) {
+  MemPool* pool = &memPools[poolId];
+  void* slab = pool->slabs;
+  while (slab) {
+    void* next = *(void**)slab;
+    freeMemoryInternal(slab);
+    slab = next;
+  }
+  pool->inUse = false;
+}
+
+int Kernel::poolCreate(size_t objSize, int count, const char* name) {
+  if (count <= 0) return SYS_ERR_INVALID_PARAM;
+  int poolId = poolCreateInternal(objSize, count, runningTaskId(), name);
+  if (poolId < 0) return poolId;
+  
+  if (!poolGrow(&memPools[poolId])) {
+    memPools[poolId].inUse = false;
+    return SYS_ERR_NO_MEMORY;
+  }
+  return poolId;
+}
+
+void* Kernel::poolAlloc(int poolId) {
+  if (poolId < 0 || poolId >= MAX_MEM_POOLS) return nullptr;
+  MemPool* pool = &memPools[poolId];
+  
+  uint32_t irq = portEnterCritical();
+  while (pool->inUse && !pool->freeList) {
+    // Out of objects: add a slab (the heap takes its own lock)
+    portExitCritical(irq);
+    bool grown = poolGrow(pool);
+    irq = portEnterCritical();
+    if (!grown) {
+      pool->failures++;
+      portExitCritical(irq);
+      return nullptr;
+    }
+  }
+  
+  void* obj = pool->freeList;
+  if (obj) {
+    pool->freeList = *(void**)obj;
+    pool->objectsInUse++;
+    if (pool->objectsInUse > pool->peakInUse) pool->peakInUse = pool->objectsInUse;
+    pool->allocs++;
+  }
+  portExitCritical(irq);
+  return obj;
+}
+
+int Kernel::poolFree(int poolId, void* ptr) {
+  if (poolId < 0 || poolId >= MAX_MEM_POOLS || !ptr) return SYS_ERR_INVALID_PARAM;
+  if (poolId == mailboxPool) return SYS_ERR_PERMISSION;  // Only the kernel frees mailboxes
+  return poolFreeInternal(poolId, ptr);
+}
+
+// Is ptr the start of an object in one of the pool's slabs? Caller holds
+// the critical section.
+bool Kernel::poolOwns(MemPool* pool, void* ptr) {
+  for (uint8_t* slab = (uint8_t*)pool->slabs; slab; slab = *(uint8_t**)slab) {
+    uint8_t* lo = slab + MEM_ALIGN;
+    uint8_t* hi = lo + pool->objSize * pool->perSlab;
+    if ((uint8_t*)ptr >= lo && (uint8_t*)ptr < hi) {
+      return ((uint8_t*)ptr - lo) % pool->objSize == 0;
+    }
+  }
+  return false;
+}
+
+int Kernel::poolFreeInternal(int poolId, void* ptr) {
+  MemPool* pool = &memPools[poolId];
+  
+  uint32_t irq = portEnterCritical();
+  if (!pool->inUse) {
+    portExitCritical(irq);
+    return SYS_ERR_NOT_FOUND;
+  }
+  if (!poolOwns(pool, ptr)) {
+    portExitCritical(irq);
+    return SYS_ERR_INVALID_PARAM;  // Not one of its objects: don't corrupt the free list
+  }
+  // Freed twice would put it on the list twice and hand it out twice.
+  // Pools are a few slabs, so walking the list is cheap enough.
+  bool alreadyFree = pool->objectsInUse == 0;
+  for (void* obj = pool->freeList; obj && !alreadyFree; obj = *(void**)obj) {
+    alreadyFree = obj == ptr;
+  }
+  if (alreadyFree) {
+    portExitCritical(irq);
+    return SYS_ERR_INVALID_PARAM;
+  }
+  *(void**)ptr = pool->freeList;
+  pool->freeList = ptr;
+  pool->objectsInUse--;
+  portExitCritical(irq);
+  return SYS_OK;
+}
+
+int Kernel::poolDestroy(int poolId) {
+  if (poolId < 0 || poolId >= MAX_MEM_POOLS) return SYS_ERR_INVALID_PARAM;
+  if (poolId == mailboxPool) return SYS_ERR_PERMISSION;
+  
+  uint32_t irq = portEnterCritical();
+  if (!memPools[poolId].inUse) {
+    portExitCritical(irq);
+    return SYS_ERR_NOT_FOUND;
+  }
+  
+  // Only owner or kernel can destroy
+  int callerId = runningTaskId();
+  if (memPools[poolId].ownerTaskId != callerId && callerId != 0) {
+    portExitCritical(irq);
+    return SYS_ERR_PERMISSION;
+  }
+  
+  poolRelease(poolId);
+  portExitCritical(irq);
+  return SYS_OK;
+}
+
+// Give back slabs none of whose objects are in use. Returns bytes freed.
+size_t Kernel::poolTrim(MemPool* pool) {
+  size_t freed = 0;
+  uint32_t irq = portEnterCritical();
+  void** link = &pool->slabs;
+  while (*link) {
+    uint8_t* slab = (uint8_t*)*link;
+    uint8_t* lo = slab + MEM_ALIGN;
+    uint8_t* hi = lo + pool->objSize * pool->perSlab;
+    int idle = 0;
+    for (void* obj = pool->freeList; obj; obj = *(void**)obj) {
+      if (obj >= lo && obj < hi) idle++;
+    }
+    if (idle < pool->perSlab) {
+      link = (void**)slab;
+      continue;
+    }
+    
+    for (void** objLink = &pool->freeList; *objLink;) {
+      if (*objLink >= lo && *objLink < hi) {
+        *objLink = *(void**)*objLink;
+      } else {
+        objLink = (void**)*objLink;
+      }
+    }
+    *link = *(void**)slab;
+    pool->slabCount--;
+    freed += sizeof(MemoryBlock) + blockSize(getBlockHeader(slab));
+    freeMemoryInternal(slab);
   }
+  portExitCritical(irq);
+  return freed;
 }
 
-void Kernel::sleep(uint32_t ms) {
-  Task* current = getCurrentTask();
-  if (current) {
-    current->state = TASK_SLEEPING;
-    current->sleepUntil = millis() + ms;
-    current->lastYield = millis();
+// The kernel's own shrinker: empty slabs of its pools. A task's pools keep
+// theirs, which it sized them for.
+void Kernel::poolShrinker(size_t wanted) {
+  size_t freed = 0;
+  for (int i = 0; i < MAX_MEM_POOLS && freed < wanted; i++) {
+    if (memPools[i].inUse && memPools[i].ownerTaskId < 0) {
+      freed += poolTrim(&memPools[i]);
+    }
   }
 }
 
 // ============================================================================
-// MEMORY MANAGEMENT - FIXED COMPACTION
+// MEMORY PRESSURE
 // ============================================================================
 
-MemoryBlock* Kernel::getBlockHeader(void* ptr) {
-  if (!ptr) return nullptr;
-  return (MemoryBlock*)((uint8_t*)ptr - sizeof(MemoryBlock));
-}
-
-void* Kernel::allocateMemoryInternal(size_t size, int taskId) {
-  if (size == 0) return nullptr;
-  
-  // Align to 4 bytes
-  size = (size + 3) & ~3;
-  
-  size_t totalNeeded = sizeof(MemoryBlock) + size;
-  
-  // Check if we have space
-  if (heapUsed + totalNeeded > KERNEL_HEAP_SIZE) {
-    Serial.println(F("[Memory] Out of space, compacting..."));
-    compactMemory();
-    
-    if (heapUsed + totalNeeded > KERNEL_HEAP_SIZE) {
-      Serial.println(F("[Memory] Out of memory after compaction!"));
-      return nullptr;
+int Kernel::shrinkerAddInternal(const char* name, void (*shrink)(size_t), int ownerTaskId) {
+  if (!shrink) return SYS_ERR_INVALID_PARAM;
+  
+  uint32_t irq = portEnterCritical();
+  for (int i = 0; i < MAX_MEM_SHRINKERS; i++) {
+    if (!memShrinkers[i].inUse) {
+      MemShrinker* s = &memShrinkers[i];
+      memset(s, 0, sizeof(MemShrinker));
+      s->inUse = true;
+      s->ownerTaskId = ownerTaskId;
+      s->name = name;
+      s->shrink = shrink;
+      portExitCritical(irq);
+      return i;
     }
   }
-  
-  // Allocate at end of used heap
-  MemoryBlock* block = (MemoryBlock*)&kernelHeap[heapUsed];
-  void* userPtr = (void*)((uint8_t*)block + sizeof(MemoryBlock));
-  
-  block->size = size;
-  block->ownerTaskId = taskId;
-  block->inUse = true;
-  block->handleId = -1;
-  
-  heapUsed += totalNeeded;
-  
-  if (taskId >= 0 && taskId < MAX_TASKS) {
-    tasks[taskId].memoryUsed += size;
-  }
-  
-  return userPtr;
+  portExitCritical(irq);
+  return SYS_ERR_NO_MEMORY;
 }
 
-void Kernel::freeMemoryInternal(void* ptr) {
-  if (!ptr) return;
+int Kernel::memShrinkerAdd(const char* name, void (*shrink)(size_t wanted)) {
+  return shrinkerAddInternal(name, shrink, runningTaskId());
+}
+
+int Kernel::memShrinkerRemove(int shrinkerId) {
+  if (shrinkerId < 0 || shrinkerId >= MAX_MEM_SHRINKERS) return SYS_ERR_INVALID_PARAM;
   
-  MemoryBlock* block = getBlockHeader(ptr);
-  if (!block || !block->inUse) {
-    Serial.println(F("[Memory] Warning: Invalid free()"));
-    return;
+  uint32_t irq = portEnterCritical();
+  MemShrinker* s = &memShrinkers[shrinkerId];
+  if (!s->inUse) {
+    portExitCritical(irq);
+    return SYS_ERR_NOT_FOUND;
   }
-  
-  if (block->ownerTaskId >= 0 && block->ownerTaskId < MAX_TASKS) {
-    tasks[block->ownerTaskId].memoryUsed -= block->size;
+  if (s->ownerTaskId != runningTaskId()) {
+    portExitCritical(irq);
+    return SYS_ERR_PERMISSION;
   }
-  
-  block->inUse = false;
+  s->inUse = false;
+  portExitCritical(irq);
+  return SYS_OK;
 }
 
-void Kernel::compactMemory() {
-  /*
-   * FIXED COMPACTION ALGORITHM
-   * 
-   * Problem with old version: User-space pointers become invalid when
-   * blocks are moved, causing crashes when dereferenced.
-   * 
-   * Solution: We can't safely update user pointers in cooperative multitasking
-   * without handles. So instead, we just mark blocks as free and consolidate
-   * free space by moving in-use blocks together, but we warn users that
-   * compaction invalidates pointers.
-   * 
-   * Better solution for future: Use handle-based allocation where OS::malloc
-   * returns a handle (integer ID) and users must call OS::deref(handle) to
-   * get the actual pointer before each use.
-   */
-  
-  Serial.println(F("[Memory] Compacting heap (WARNING: may invalidate pointers)"));
-  
-  size_t writePos = 0;
-  size_t readPos = 0;
-  int movedBlocks = 0;
-  
-  while (readPos < heapUsed) {
-    MemoryBlock* block = (MemoryBlock*)&kernelHeap[readPos];
-    size_t blockTotalSize = sizeof(MemoryBlock) + block->size;
-    
-    if (block->inUse) {
-      if (writePos != readPos) {
-        // Move block to write position
-        memmove(&kernelHeap[writePos], &kernelHeap[readPos], blockTotalSize);
-        movedBlocks++;
-      }
-      writePos += blockTotalSize;
-    }
-    
-    readPos += blockTotalSize;
-    
-    // Safety check
-    if (readPos > KERNEL_HEAP_SIZE || writePos > KERNEL_HEAP_SIZE) {
-      panic("Heap corruption detected during compaction");
-      break;
-    }
-  }
-  
-  size_t freedSpace = heapUsed - writePos;
-  heapUsed = writePos;
-  
-  Serial.print(F("[Memory] Compaction complete: freed "));
-  Serial.print(freedSpace);
-  Serial.print(F(" bytes, moved "));
-  Serial.print(movedBlocks);
-  Serial.println(F(" blocks"));
-  
-  if (movedBlocks > 0) {
-    Serial.println(F("[Memory] WARNING: Existing pointers may be invalid!"));
-    Serial.println(F("[Memory] Recommendation: Free and reallocate after compaction"));
+int Kernel::memPressureNotify(bool enable) {
+  Task* current = getCurrentTask();
+  if (enable && !current->mailbox) {
+    // Pressure messages never allocate one, so take it now
+    int result = mailboxCreate(current, getCurrentTaskId());
+    if (result != SYS_OK) return result;
   }
+  coldOf(current)->memPressureMessages = enable;
+  return SYS_OK;
 }
 
-void* Kernel::memAlloc(size_t size) {
-  return allocateMemoryInternal(size, currentTaskId);
+int Kernel::memSetWatermarks(int lowPercent, int minPercent) {
+  if (minPercent < 0 || lowPercent < minPercent || lowPercent > 100) return SYS_ERR_INVALID_PARAM;
+  uint32_t irq = portEnterCritical();
+  lowWatermark = lowPercent;
+  minWatermark = minPercent;
+  portExitCritical(irq);
+  return SYS_OK;
 }
 
-void Kernel::memFree(void* ptr) {
-  freeMemoryInternal(ptr);
+// Caller holds the critical section
+int Kernel::regionPressure(HeapControl* h) {
+  uint64_t free100 = (uint64_t)(h->capacity - h->used) * 100;
+  if (free100 < (uint64_t)h->capacity * minWatermark) return MEM_PRESSURE_MIN;
+  if (free100 < (uint64_t)h->capacity * lowWatermark) return MEM_PRESSURE_LOW;
+  return MEM_PRESSURE_NONE;
 }
 
-size_t Kernel::memAvailable() {
-  return KERNEL_HEAP_SIZE - heapUsed;
+// Bytes it would take to get a region back over its low watermark
+static size_t belowLowWatermark(HeapControl* h, uint8_t lowWatermark) {
+  size_t freeBytes = h->capacity - h->used;
+  size_t lowBytes = (size_t)((uint64_t)h->capacity * lowWatermark / 100);
+  return (freeBytes < lowBytes) ? lowBytes - freeBytes : 0;
 }
 
-void Kernel::memCompact() {
-  compactMemory();
+// Tell the tasks that asked that a region has reached a new pressure level
+void Kernel::pressureMessage(int level, int region, size_t wanted) {
+  HeapControl* h = &heaps[region];
+  MemPressureMsg msg;
+  msg.level = level;
+  msg.region = region;
+  uint32_t irq = portEnterCritical();
+  if (pressureSending) {
+    portExitCritical(irq);  // Already telling everyone, from further up
+    return;
+  }
+  pressureSending = true;
+  msg.freeBytes = h->capacity - h->used;
+  size_t deficit = belowLowWatermark(h, lowWatermark);
+  portExitCritical(irq);
+  msg.wanted = (deficit > wanted) ? deficit : wanted;
+  
+  for (int id = nextTask(-1); id >= 0; id = nextTask(id)) {
+    Task* task = getTask(id);
+    if (task && coldOf(task)->memPressureMessages &&
+        ipcDeliver(id, IPC_FROM_KERNEL, &msg, sizeof(msg)) == SYS_OK) {
+      irq = portEnterCritical();
+      pressureStats.messages++;
+      portExitCritical(irq);
+    }
+  }
+  
+  irq = portEnterCritical();
+  pressureSending = false;
+  portExitCritical(irq);
+}
+
+/*
+ * Call the shrinkers in turn until they've given back wanted bytes, or
+ * enough to get the region over its low watermark if that's more. Returns
+ * the bytes the heap got back. One caller at a time: a shrinker that
+ * allocates (or anyone else meanwhile) finds it busy and gets 0.
+ */
+size_t Kernel::memShrink(int region, size_t wanted) {
+  uint32_t irq = portEnterCritical();
+  if (shrinking) {
+    portExitCritical(irq);
+    return 0;
+  }
+  shrinking = true;
+  size_t deficit = belowLowWatermark(&heaps[region], lowWatermark);
+  portExitCritical(irq);
+  if (deficit > wanted) wanted = deficit;
+  
+  size_t reclaimed = 0;
+  for (int i = 0; i < MAX_MEM_SHRINKERS && reclaimed < wanted; i++) {
+    irq = portEnterCritical();
+    void (*shrink)(size_t) = memShrinkers[i].inUse ? memShrinkers[i].shrink : nullptr;
+    size_t before = 0;
+    for (int r = 0; r < MEM_REGION_COUNT; r++) before += heaps[r].used;
+    portExitCritical(irq);
+    if (!shrink) continue;
+    
+    shrink(wanted - reclaimed);
+    
+    irq = portEnterCritical();
+    size_t after = 0;
+    for (int r = 0; r < MEM_REGION_COUNT; r++) after += heaps[r].used;
+    size_t got = (before > after) ? before - after : 0;
+    memShrinkers[i].calls++;
+    memShrinkers[i].bytesReclaimed += got;
+    portExitCritical(irq);
+    reclaimed += got;
+  }
+  
+  irq = portEnterCritical();
+  pressureStats.bytesReclaimed += reclaimed;
+  shrinking = false;
+  portExitCritical(irq);
+  return reclaimed;
 }
 
 // ============================================================================
@@ -533,19 +3911,38 @@ void Kernel::memCompact() {
 // ============================================================================
 
 int Kernel::ipcSend(int toTaskId, const void* data, size_t length) {
-  if (toTaskId < 0 || toTaskId >= MAX_TASKS) return SYS_ERR_INVALID_PARAM;
-  if (tasks[toTaskId].state == TASK_EMPTY) return SYS_ERR_NOT_FOUND;
+  return ipcDeliver(toTaskId, getCurrentTaskId(), data, length);
+}
+
+// ipcSend with the sender given, so the kernel can send as IPC_FROM_KERNEL
+int Kernel::ipcDeliver(int toTaskId, int fromTaskId, const void* data, size_t length) {
+  if (toTaskId < 0) return SYS_ERR_INVALID_PARAM;
   if (length > sizeof(Message::data)) return SYS_ERR_INVALID_PARAM;
   if (!data && length > 0) return SYS_ERR_INVALID_PARAM;
   
-  MessageQueue* queue = &messageQueues[toTaskId];
+  Task* to = getTask(toTaskId);
+  if (!to) return SYS_ERR_NOT_FOUND;
+  
+  // The kernel sends from inside the allocator, so it never grows the
+  // mailbox pool: listeners got their mailbox when they signed up
+  if (!to->mailbox && fromTaskId != IPC_FROM_KERNEL) {
+    int result = mailboxCreate(to, toTaskId);
+    if (result != SYS_OK) return result;
+  }
   
+  uint32_t irq = portEnterCritical();
+  MessageQueue* queue = to->mailbox;
+  if (!queue || taskIdOf(to) != toTaskId) {
+    portExitCritical(irq);
+    return SYS_ERR_NOT_FOUND;
+  }
   if (queue->count >= MAX_MESSAGE_QUEUE_SIZE) {
+    portExitCritical(irq);
     return SYS_ERR_NO_MEMORY;
   }
   
   Message* msg = &queue->messages[queue->tail];
-  msg->fromTaskId = currentTaskId;
+  msg->fromTaskId = fromTaskId;
   msg->toTaskId = toTaskId;
   msg->length = length;
   if (length > 0) {
@@ -557,13 +3954,64 @@ int Kernel::ipcSend(int toTaskId, const void* data, size_t length) {
   queue->tail = (queue->tail + 1) % MAX_MESSAGE_QUEUE_SIZE;
   queue->count++;
   
+  // A coroutine blocked in ipcReceive() gets it straight into its buffer
+  if (taskHot.state[to->id] == TASK_BLOCKED && to->waitKind == WAIT_MESSAGE) {
+    wakeWaiter(to, mailboxTake(to, to->waitBuffer, to->waitLength, to->waitFrom));
+  }
+  portExitCritical(irq);
+  
+  return SYS_OK;
+}
+
+// Give a task its mailbox ahead of its first message
+int Kernel::mailboxCreate(Task* task, int taskId) {
+  MessageQueue* fresh = (MessageQueue*)poolAlloc(mailboxPool);
+  if (!fresh) return SYS_ERR_NO_MEMORY;
+  memset(fresh, 0, sizeof(MessageQueue));
+  
+  uint32_t irq = portEnterCritical();
+  bool installed = !task->mailbox && taskIdOf(task) == taskId;
+  if (installed) {
+    task->mailbox = fresh;
+  }
+  portExitCritical(irq);
+  if (!installed) {
+    poolFreeInternal(mailboxPool, fresh);  // Lost a race with another sender, or the task died
+  }
   return SYS_OK;
 }
 
+// A coroutine with nothing to read blocks until ipcDeliver() hands it a
+// message; plain tasks get SYS_ERR_WOULD_BLOCK and poll
 int Kernel::ipcReceive(void* buffer, size_t maxLength, int* fromTaskId) {
-  MessageQueue* queue = &messageQueues[currentTaskId];
+  uint32_t irq = portEnterCritical();
+  int result = ipcTryReceive(buffer, maxLength, fromTaskId);
   
-  if (queue->count == 0) {
+  Task* current = getCurrentTask();
+  if (result == SYS_ERR_WOULD_BLOCK && current->coroutine) {
+    current->waitBuffer = buffer;
+    current->waitLength = maxLength;
+    current->waitFrom = fromTaskId;
+    blockCurrentTask(WAIT_MESSAGE, taskIdOf(current), nullptr, 0);
+    portExitCritical(irq);
+    return blockedResult(current);
+  }
+  portExitCritical(irq);
+  return result;
+}
+
+int Kernel::ipcTryReceive(void* buffer, size_t maxLength, int* fromTaskId) {
+  uint32_t irq = portEnterCritical();
+  int result = mailboxTake(getCurrentTask(), buffer, maxLength, fromTaskId);
+  portExitCritical(irq);
+  return result;
+}
+
+// Pop the oldest message in a task's mailbox. Caller holds the critical
+// section.
+int Kernel::mailboxTake(Task* task, void* buffer, size_t maxLength, int* fromTaskId) {
+  MessageQueue* queue = task->mailbox;
+  if (!queue || queue->count == 0) {
     return SYS_ERR_WOULD_BLOCK;
   }
   
@@ -589,12 +4037,12 @@ int Kernel::ipcReceive(void* buffer, size_t maxLength, int* fromTaskId) {
   msg->valid = false;
   queue->head = (queue->head + 1) % MAX_MESSAGE_QUEUE_SIZE;
   queue->count--;
-  
   return length;
 }
 
 int Kernel::ipcPoll() {
-  return messageQueues[currentTaskId].count;
+  MessageQueue* queue = getCurrentTask()->mailbox;
+  return queue ? queue->count : 0;
 }
 
 // ============================================================================
@@ -615,36 +4063,73 @@ int Kernel::semCreate(int initialValue, int maxValue, const char* name) {
     return SYS_ERR_INVALID_PARAM;
   }
   
+  int ownerTaskId = runningTaskId();
+  uint32_t irq = portEnterCritical();
   int semId = allocateSemaphore();
   if (semId < 0) {
+    portExitCritical(irq);
     return SYS_ERR_NO_MEMORY;
   }
   
   semaphores[semId].value = initialValue;
   semaphores[semId].maxValue = maxValue;
   semaphores[semId].inUse = true;
-  semaphores[semId].ownerTaskId = currentTaskId;
+  semaphores[semId].ownerTaskId = ownerTaskId;
   semaphores[semId].name = name;
+  semaphores[semId].waitHead = -1;
+  portExitCritical(irq);
   
   return semId;
 }
 
+int Kernel::semTryTake(int semId) {
+  if (semId < 0 || semId >= MAX_SEMAPHORES) return SYS_ERR_INVALID_PARAM;
+  if (!semaphores[semId].inUse) return SYS_ERR_NOT_FOUND;
+  
+  Semaphore* sem = &semaphores[semId];
+  uint32_t irq = portEnterCritical();
+  if (sem->value <= 0) {
+    portExitCritical(irq);
+    return SYS_ERR_WOULD_BLOCK;
+  }
+  
+  sem->value--;
+  portExitCritical(irq);
+  return SYS_OK;
+}
+
 int Kernel::semWait(int semId, uint32_t timeoutMs) {
   if (semId < 0 || semId >= MAX_SEMAPHORES) return SYS_ERR_INVALID_PARAM;
   if (!semaphores[semId].inUse) return SYS_ERR_NOT_FOUND;
   
   Semaphore* sem = &semaphores[semId];
+  Task* current = getCurrentTask();
+  
+  uint32_t irq = portEnterCritical();
+  if (sem->value > 0) {
+    sem->value--;
+    portExitCritical(irq);
+    return SYS_OK;
+  }
+  if (canBlock(current)) {
+    blockCurrentTask(WAIT_SEM, semId, &sem->waitHead, timeoutMs);
+    portExitCritical(irq);
+    return blockedResult(current);
+  }
+  portExitCritical(irq);
+  
+  // Can't block here: poll, letting other tasks run in between
+  int result;
   uint32_t startTime = millis();
   
-  while (sem->value <= 0) {
+  while ((result = semTryTake(semId)) == SYS_ERR_WOULD_BLOCK) {
     if (timeoutMs > 0 && (millis() - startTime) >= timeoutMs) {
       return SYS_ERR_TIMEOUT;
     }
     yield();
   }
   
-  sem->value--;
-  return SYS_OK;
+  return result;
 }
 
 int Kernel::semPost(int semId) {
@@ -652,12 +4137,33 @@ int Kernel::semPost(int semId) {
   if (!semaphores[semId].inUse) return SYS_ERR_NOT_FOUND;
   
   Semaphore* sem = &semaphores[semId];
+  Task* current = getCurrentTask();
+  
+  uint32_t irq = portEnterCritical();
+  if (sem->waitHead >= 0) {
+    // Hand the count straight to the first waiter
+    wakeWaiter(&tasks[sem->waitHead], SYS_OK);
+    bool preempted = readyHighestPriority(currentCore()) > taskHot.priority[current->id];
+    portExitCritical(irq);
+    
+#ifdef KERNEL_STACKFUL_TASKS
+    // Woke a task that outranks us: let it run now, not at the next tick
+    if (preempted && !current->coroutine && current->id != 0) {
+      yield();
+    }
+#else
+    (void)preempted;
+#endif
+    return SYS_OK;
+  }
   
   if (sem->value >= sem->maxValue) {
+    portExitCritical(irq);
     return SYS_ERR_INVALID_PARAM;
   }
   
   sem->value++;
+  portExitCritical(irq);
   return SYS_OK;
 }
 
@@ -666,11 +4172,206 @@ int Kernel::semDestroy(int semId) {
   if (!semaphores[semId].inUse) return SYS_ERR_NOT_FOUND;
   
   // Only owner or kernel can destroy
-  if (semaphores[semId].ownerTaskId != currentTaskId && currentTaskId != 0) {
+  int callerId = runningTaskId();
+  if (semaphores[semId].ownerTaskId != callerId && callerId != 0) {
     return SYS_ERR_PERMISSION;
   }
   
+  uint32_t irq = portEnterCritical();
+  while (semaphores[semId].waitHead >= 0) {
+    wakeWaiter(&tasks[semaphores[semId].waitHead], SYS_ERR_NOT_FOUND);
+  }
   semaphores[semId].inUse = false;
+  portExitCritical(irq);
+  return SYS_OK;
+}
+
+// ============================================================================
+// IPC - MUTEXES
+// ============================================================================
+
+/*
+ * Unlike a binary semaphore a mutex knows its holder, so a waiter can lend
+ * the holder its priority: a low-priority task inside a critical region then
+ * can't be held off by medium-priority work while something urgent waits
+ * on it. Unlock hands the mutex straight to the most urgent waiter.
+ */
+
+int Kernel::allocateMutex() {
+  for (int i = 0; i < MAX_MUTEXES; i++) {
+    if (!mutexes[i].inUse) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int Kernel::mutexCreate(const char* name) {
+  int ownerTaskId = runningTaskId();
+  uint32_t irq = portEnterCritical();
+  int mutexId = allocateMutex();
+  if (mutexId < 0) {
+    portExitCritical(irq);
+    return SYS_ERR_NO_MEMORY;
+  }
+  
+  Mutex* mutex = &mutexes[mutexId];
+  mutex->inUse = true;
+  mutex->ownerTaskId = ownerTaskId;
+  mutex->name = name;
+  mutex->holderTaskId = -1;
+  mutex->lockCount = 0;
+  mutex->nextHeld = -1;
+  mutex->waitHead = -1;
+  mutex->contentions = 0;
+  mutex->blockMaxMicros = 0;
+  portExitCritical(irq);
+  
+  return mutexId;
+}
+
+// Take the mutex for task if it's free or already its own.
+// Caller holds the critical section.
+int Kernel::mutexTryLock(int mutexId, Task* task) {
+  Mutex* mutex = &mutexes[mutexId];
+  if (mutex->holderTaskId == task->id) {
+    mutex->lockCount++;
+    return SYS_OK;
+  }
+  if (mutex->holderTaskId >= 0) {
+    return SYS_ERR_WOULD_BLOCK;
+  }
+  
+  mutex->holderTaskId = task->id;
+  mutex->lockCount = 1;
+  mutex->nextHeld = task->heldMutexes;
+  task->heldMutexes = mutexId;
+  return SYS_OK;
+}
+
+// Drop the holder's claim entirely and pass the mutex to the first waiter.
+// Caller holds the critical section.
+void Kernel::mutexRelease(int mutexId) {
+  Mutex* mutex = &mutexes[mutexId];
+  Task* holder = &tasks[mutex->holderTaskId];
+  
+  int* link = &holder->heldMutexes;
+  while (*link != mutexId) {
+    link = &mutexes[*link].nextHeld;
+  }
+  *link = mutex->nextHeld;
+  mutex->nextHeld = -1;
+  mutex->holderTaskId = -1;
+  mutex->lockCount = 0;
+  
+  if (mutex->waitHead >= 0) {
+    Task* next = &tasks[mutex->waitHead];
+    uint32_t blocked = micros() - next->waitSince;
+    if (blocked > mutex->blockMaxMicros) mutex->blockMaxMicros = blocked;
+    
+    wakeWaiter(next, SYS_OK);
+    mutexTryLock(mutexId, next);
+    refreshPriority(next);  // Inherits from whoever is still waiting
+  }
+  refreshPriority(holder);  // Back down to what it still owes others
+}
+
+// The wait queue changed; re-derive the holder's inherited priority
+void Kernel::mutexInherit(int mutexId) {
+  int holder = mutexes[mutexId].holderTaskId;
+  if (holder >= 0) {
+    refreshPriority(&tasks[holder]);
+  }
+}
+
+int Kernel::mutexLock(int mutexId, uint32_t timeoutMs) {
+  if (mutexId < 0 || mutexId >= MAX_MUTEXES) return SYS_ERR_INVALID_PARAM;
+  if (!mutexes[mutexId].inUse) return SYS_ERR_NOT_FOUND;
+  
+  Mutex* mutex = &mutexes[mutexId];
+  Task* current = getCurrentTask();
+  
+  uint32_t irq = portEnterCritical();
+  int result = mutexTryLock(mutexId, current);
+  if (result != SYS_ERR_WOULD_BLOCK) {
+    portExitCritical(irq);
+    return result;
+  }
+  mutex->contentions++;
+  if (canBlock(current)) {
+    blockCurrentTask(WAIT_MUTEX, mutexId, &mutex->waitHead, timeoutMs);
+    portExitCritical(irq);
+    return blockedResult(current);
+  }
+  portExitCritical(irq);
+  
+  // Can't block here, so no inheritance either: poll like semWait does
+  uint32_t startTime = millis();
+  while (true) {
+    irq = portEnterCritical();
+    result = mutex->inUse ? mutexTryLock(mutexId, current) : SYS_ERR_NOT_FOUND;
+    portExitCritical(irq);
+    if (result != SYS_ERR_WOULD_BLOCK) return result;
+    
+    if (timeoutMs > 0 && (millis() - startTime) >= timeoutMs) {
+      return SYS_ERR_TIMEOUT;
+    }
+    yield();
+  }
+}
+
+int Kernel::mutexUnlock(int mutexId) {
+  if (mutexId < 0 || mutexId >= MAX_MUTEXES) return SYS_ERR_INVALID_PARAM;
+  if (!mutexes[mutexId].inUse) return SYS_ERR_NOT_FOUND;
+  
+  Mutex* mutex = &mutexes[mutexId];
+  Task* current = getCurrentTask();
+  
+  uint32_t irq = portEnterCritical();
+  if (mutex->holderTaskId != current->id) {
+    portExitCritical(irq);
+    return SYS_ERR_PERMISSION;
+  }
+  if (--mutex->lockCount > 0) {
+    portExitCritical(irq);
+    return SYS_OK;
+  }
+  
+  mutexRelease(mutexId);
+  bool preempted = readyHighestPriority(currentCore()) > taskHot.priority[current->id];
+  portExitCritical(irq);
+  
+#ifdef KERNEL_STACKFUL_TASKS
+  // Lost our boost to a waiter that now outranks us: let it run right away
+  if (preempted && !current->coroutine && current->id != 0) {
+    yield();
+  }
+#else
+  (void)preempted;
+#endif
+  return SYS_OK;
+}
+
+int Kernel::mutexDestroy(int mutexId) {
+  if (mutexId < 0 || mutexId >= MAX_MUTEXES) return SYS_ERR_INVALID_PARAM;
+  if (!mutexes[mutexId].inUse) return SYS_ERR_NOT_FOUND;
+  
+  // Only owner or kernel can destroy
+  int callerId = runningTaskId();
+  if (mutexes[mutexId].ownerTaskId != callerId && callerId != 0) {
+    return SYS_ERR_PERMISSION;
+  }
+  
+  uint32_t irq = portEnterCritical();
+  Mutex* mutex = &mutexes[mutexId];
+  while (mutex->waitHead >= 0) {
+    wakeWaiter(&tasks[mutex->waitHead], SYS_ERR_NOT_FOUND);
+  }
+  if (mutex->holderTaskId >= 0) {
+    mutexRelease(mutexId);
+  }
+  mutex->inUse = false;
+  portExitCritical(irq);
   return SYS_OK;
 }
 
@@ -680,7 +4381,7 @@ int Kernel::semDestroy(int semId) {
 
 int Kernel::gpioSetMode(int pin, int mode) {
   Task* current = getCurrentTask();
-  if (!current->canAccessGPIO) return SYS_ERR_PERMISSION;
+  if (!hasPermission(current, TASK_PERM_GPIO)) return SYS_ERR_PERMISSION;
   
   pinMode(pin, mode);
   return SYS_OK;
@@ -688,7 +4389,7 @@ int Kernel::gpioSetMode(int pin, int mode) {
 
 int Kernel::gpioWrite(int pin, int value) {
   Task* current = getCurrentTask();
-  if (!current->canAccessGPIO) return SYS_ERR_PERMISSION;
+  if (!hasPermission(current, TASK_PERM_GPIO)) return SYS_ERR_PERMISSION;
   
   digitalWrite(pin, value);
   return SYS_OK;
@@ -696,21 +4397,21 @@ int Kernel::gpioWrite(int pin, int value) {
 
 int Kernel::gpioRead(int pin) {
   Task* current = getCurrentTask();
-  if (!current->canAccessGPIO) return SYS_ERR_PERMISSION;
+  if (!hasPermission(current, TASK_PERM_GPIO)) return SYS_ERR_PERMISSION;
   
   return digitalRead(pin);
 }
 
 int Kernel::gpioAnalogRead(int pin) {
   Task* current = getCurrentTask();
-  if (!current->canAccessGPIO) return SYS_ERR_PERMISSION;
+  if (!hasPermission(current, TASK_PERM_GPIO)) return SYS_ERR_PERMISSION;
   
   return analogRead(pin);
 }
 
 int Kernel::gpioAnalogWrite(int pin, int value) {
   Task* current = getCurrentTask();
-  if (!current->canAccessGPIO) return SYS_ERR_PERMISSION;
+  if (!hasPermission(current, TASK_PERM_GPIO)) return SYS_ERR_PERMISSION;
   
   analogWrite(pin, value);
   return SYS_OK;
@@ -722,7 +4423,7 @@ int Kernel::gpioAnalogWrite(int pin, int value) {
 
 int Kernel::i2cBegin(uint8_t address) {
   Task* current = getCurrentTask();
-  if (!current->canAccessI2C) return SYS_ERR_PERMISSION;
+  if (!hasPermission(current, TASK_PERM_I2C)) return SYS_ERR_PERMISSION;
   
   if (address == 0) {
     Wire.begin();
@@ -735,7 +4436,7 @@ int Kernel::i2cBegin(uint8_t address) {
 
 int Kernel::i2cWrite(uint8_t address, const uint8_t* data, size_t length) {
   Task* current = getCurrentTask();
-  if (!current->canAccessI2C) return SYS_ERR_PERMISSION;
+  if (!hasPermission(current, TASK_PERM_I2C)) return SYS_ERR_PERMISSION;
   if (!data || length == 0) return SYS_ERR_INVALID_PARAM;
   
   Wire.beginTransmission(address);
@@ -751,7 +4452,7 @@ int Kernel::i2cWrite(uint8_t address, const uint8_t* data, size_t length) {
 
 int Kernel::i2cRead(uint8_t address, uint8_t* buffer, size_t length) {
   Task* current = getCurrentTask();
-  if (!current->canAccessI2C) return SYS_ERR_PERMISSION;
+  if (!hasPermission(current, TASK_PERM_I2C)) return SYS_ERR_PERMISSION;
   if (!buffer || length == 0) return SYS_ERR_INVALID_PARAM;
   
   Wire.beginTransmission(address);
@@ -773,7 +4474,7 @@ int Kernel::i2cRead(uint8_t address, uint8_t* buffer, size_t length) {
 
 int Kernel::i2cRequest(uint8_t address, size_t quantity) {
   Task* current = getCurrentTask();
-  if (!current->canAccessI2C) return SYS_ERR_PERMISSION;
+  if (!hasPermission(current, TASK_PERM_I2C)) return SYS_ERR_PERMISSION;
   
   return Wire.requestFrom(address, (uint8_t)quantity);
 }
@@ -784,17 +4485,66 @@ int Kernel::i2cRequest(uint8_t address, size_t quantity) {
 
 int Kernel::spiBegin() {
   Task* current = getCurrentTask();
-  if (!current->canAccessSPI) return SYS_ERR_PERMISSION;
+  if (!hasPermission(current, TASK_PERM_SPI)) return SYS_ERR_PERMISSION;
   
   SPI.begin();
   return SYS_OK;
 }
 
+// One DMA-safe buffer out and back, keeping the cache out of the way
+static void spiDmaTransfer(uint8_t* buf, size_t length) {
+  Kernel::dmaClean(buf, length);
+  SPI.transfer(buf, length);
+  Kernel::dmaInvalidate(buf, length);
+}
+
 int Kernel::spiTransfer(uint8_t* txData, uint8_t* rxData, size_t length) {
   Task* current = getCurrentTask();
-  if (!current->canAccessSPI) return SYS_ERR_PERMISSION;
+  if (!hasPermission(current, TASK_PERM_SPI)) return SYS_ERR_PERMISSION;
   if (length == 0) return SYS_ERR_INVALID_PARAM;
   
+  if (!txData && !rxData) return length;
+  
+  // SPI.transfer(buf, n) sends buf and overwrites it with what comes back,
+  // by DMA on cores that have it. A DMA-safe rxData is used in place; any
+  // other buffer goes through the kernel's bounce buffer (txData alone
+  // always does, since it mustn't be overwritten).
+  if (length >= KERNEL_SPI_DMA_MIN) {
+    if (rxData && isDmaSafe(rxData, length)) {
+      if (!txData) {
+        memset(rxData, 0, length);
+      } else if (txData != rxData) {
+        memmove(rxData, txData, length);
+      }
+      spiDmaTransfer(rxData, length);
+      return length;
+    }
+    
+    uint32_t irq = portEnterCritical();
+    uint8_t* bounce = spiBounceBusy ? nullptr : spiBounce;
+    if (bounce) spiBounceBusy = true;
+    portExitCritical(irq);
+    if (bounce) {
+      for (size_t done = 0; done < length; ) {
+        size_t chunk = length - done;
+        if (chunk > KERNEL_SPI_BOUNCE_SIZE) chunk = KERNEL_SPI_BOUNCE_SIZE;
+        if (txData) {
+          memcpy(bounce, txData + done, chunk);
+        } else {
+          memset(bounce, 0, chunk);
+        }
+        spiDmaTransfer(bounce, chunk);
+        if (rxData) memcpy(rxData + done, bounce, chunk);
+        done += chunk;
+      }
+      irq = portEnterCritical();
+      spiBounceBusy = false;
+      portExitCritical(irq);
+      return length;
+    }
+  }
+  
+  // Short, or another task has the bounce buffer: a byte at a time
   if (txData && rxData) {
     for (size_t i = 0; i < length; i++) {
       rxData[i] = SPI.transfer(txData[i]);
@@ -814,7 +4564,7 @@ int Kernel::spiTransfer(uint8_t* txData, uint8_t* rxData, size_t length) {
 
 int Kernel::spiEnd() {
   Task* current = getCurrentTask();
-  if (!current->canAccessSPI) return SYS_ERR_PERMISSION;
+  if (!hasPermission(current, TASK_PERM_SPI)) return SYS_ERR_PERMISSION;
   
   SPI.end();
   return SYS_OK;
@@ -824,21 +4574,31 @@ int Kernel::spiEnd() {
 // FILE SYSTEM
 // ============================================================================
 
+// Handle slots are claimed (inUse set) under the lock; the caller clears
+// inUse again if the open fails
 int Kernel::allocateFileHandle() {
+  uint32_t irq = portEnterCritical();
   for (int i = 0; i < MAX_FILE_HANDLES; i++) {
     if (!fileHandles[i].inUse) {
+      fileHandles[i].inUse = true;
+      portExitCritical(irq);
       return i;
     }
   }
+  portExitCritical(irq);
   return -1;
 }
 
 int Kernel::allocateDirHandle() {
+  uint32_t irq = portEnterCritical();
   for (int i = 0; i < MAX_DIR_HANDLES; i++) {
     if (!dirHandles[i].inUse) {
+      dirHandles[i].inUse = true;
+      portExitCritical(irq);
       return i;
     }
   }
+  portExitCritical(irq);
   return -1;
 }
 
@@ -864,7 +4624,7 @@ int Kernel::fileOpen(const char* path, bool write) {
   if (!sdInitialized) return SYS_ERR_IO_ERROR;
   
   Task* current = getCurrentTask();
-  if (!current->canAccessSD) return SYS_ERR_PERMISSION;
+  if (!hasPermission(current, TASK_PERM_SD)) return SYS_ERR_PERMISSION;
   
   int handle = allocateFileHandle();
   if (handle < 0) return SYS_ERR_NO_MEMORY;
@@ -873,13 +4633,13 @@ int Kernel::fileOpen(const char* path, bool write) {
   fh->file = SD.open(path, write ? FILE_WRITE : FILE_READ);
   
   if (!fh->file) {
+    fh->inUse = false;
     return SYS_ERR_NOT_FOUND;
   }
   
-  fh->inUse = true;
-  fh->ownerTaskId = currentTaskId;
+  fh->ownerTaskId = runningTaskId();
   fh->canWrite = write;
-  current->fileHandles[handle] = true;
+  coldOf(current)->fileHandles |= 1UL << handle;
   
   return handle;
 }
@@ -887,10 +4647,10 @@ int Kernel::fileOpen(const char* path, bool write) {
 int Kernel::fileClose(int handle) {
   if (handle < 0 || handle >= MAX_FILE_HANDLES) return SYS_ERR_INVALID_PARAM;
   if (!fileHandles[handle].inUse) return SYS_ERR_INVALID_PARAM;
-  if (fileHandles[handle].ownerTaskId != currentTaskId) return SYS_ERR_PERMISSION;
+  if (fileHandles[handle].ownerTaskId != runningTaskId()) return SYS_ERR_PERMISSION;
   
   freeFileHandle(handle);
-  getCurrentTask()->fileHandles[handle] = false;
+  coldOf(getCurrentTask())->fileHandles &= ~(1UL << handle);
   
   return SYS_OK;
 }
@@ -898,7 +4658,7 @@ int Kernel::fileClose(int handle) {
 int Kernel::fileRead(int handle, void* buffer, size_t size) {
   if (handle < 0 || handle >= MAX_FILE_HANDLES) return SYS_ERR_INVALID_PARAM;
   if (!fileHandles[handle].inUse) return SYS_ERR_INVALID_PARAM;
-  if (fileHandles[handle].ownerTaskId != currentTaskId) return SYS_ERR_PERMISSION;
+  if (fileHandles[handle].ownerTaskId != runningTaskId()) return SYS_ERR_PERMISSION;
   
   return fileHandles[handle].file.read((uint8_t*)buffer, size);
 }
@@ -906,7 +4666,7 @@ int Kernel::fileRead(int handle, void* buffer, size_t size) {
 int Kernel::fileWrite(int handle, const void* buffer, size_t size) {
   if (handle < 0 || handle >= MAX_FILE_HANDLES) return SYS_ERR_INVALID_PARAM;
   if (!fileHandles[handle].inUse) return SYS_ERR_INVALID_PARAM;
-  if (fileHandles[handle].ownerTaskId != currentTaskId) return SYS_ERR_PERMISSION;
+  if (fileHandles[handle].ownerTaskId != runningTaskId()) return SYS_ERR_PERMISSION;
   if (!fileHandles[handle].canWrite) return SYS_ERR_PERMISSION;
   
   return fileHandles[handle].file.write((const uint8_t*)buffer, size);
@@ -916,7 +4676,7 @@ bool Kernel::fileDelete(const char* path) {
   if (!sdInitialized) return false;
   
   Task* current = getCurrentTask();
-  if (!current->canAccessSD) return false;
+  if (!hasPermission(current, TASK_PERM_SD)) return false;
   
   return SD.remove(path);
 }
@@ -925,7 +4685,7 @@ bool Kernel::fileExists(const char* path) {
   if (!sdInitialized) return false;
   
   Task* current = getCurrentTask();
-  if (!current->canAccessSD) return false;
+  if (!hasPermission(current, TASK_PERM_SD)) return false;
   
   return SD.exists(path);
 }
@@ -933,7 +4693,7 @@ bool Kernel::fileExists(const char* path) {
 size_t Kernel::fileSize(int handle) {
   if (handle < 0 || handle >= MAX_FILE_HANDLES) return 0;
   if (!fileHandles[handle].inUse) return 0;
-  if (fileHandles[handle].ownerTaskId != currentTaskId) return 0;
+  if (fileHandles[handle].ownerTaskId != runningTaskId()) return 0;
   
   return fileHandles[handle].file.size();
 }
@@ -946,7 +4706,7 @@ int Kernel::dirOpen(const char* path) {
   if (!sdInitialized) return SYS_ERR_IO_ERROR;
   
   Task* current = getCurrentTask();
-  if (!current->canAccessSD) return SYS_ERR_PERMISSION;
+  if (!hasPermission(current, TASK_PERM_SD)) return SYS_ERR_PERMISSION;
   
   int handle = allocateDirHandle();
   if (handle < 0) return SYS_ERR_NO_MEMORY;
@@ -955,17 +4715,18 @@ int Kernel::dirOpen(const char* path) {
   dh->dir = SD.open(path);
   
   if (!dh->dir) {
+    dh->inUse = false;
     return SYS_ERR_NOT_FOUND;
   }
   
   if (!dh->dir.isDirectory()) {
     dh->dir.close();
+    dh->inUse = false;
     return SYS_ERR_INVALID_PARAM;
   }
   
-  dh->inUse = true;
-  dh->ownerTaskId = currentTaskId;
-  current->dirHandles[handle] = true;
+  dh->ownerTaskId = runningTaskId();
+  coldOf(current)->dirHandles |= 1 << handle;
   
   return handle;
 }
@@ -973,10 +4734,10 @@ int Kernel::dirOpen(const char* path) {
 int Kernel::dirClose(int handle) {
   if (handle < 0 || handle >= MAX_DIR_HANDLES) return SYS_ERR_INVALID_PARAM;
   if (!dirHandles[handle].inUse) return SYS_ERR_INVALID_PARAM;
-  if (dirHandles[handle].ownerTaskId != currentTaskId) return SYS_ERR_PERMISSION;
+  if (dirHandles[handle].ownerTaskId != runningTaskId()) return SYS_ERR_PERMISSION;
   
   freeDirHandle(handle);
-  getCurrentTask()->dirHandles[handle] = false;
+  coldOf(getCurrentTask())->dirHandles &= ~(1 << handle);
   
   return SYS_OK;
 }
@@ -984,7 +4745,7 @@ int Kernel::dirClose(int handle) {
 bool Kernel::dirRead(int handle, DirEntry* entry) {
   if (handle < 0 || handle >= MAX_DIR_HANDLES) return false;
   if (!dirHandles[handle].inUse) return false;
-  if (dirHandles[handle].ownerTaskId != currentTaskId) return false;
+  if (dirHandles[handle].ownerTaskId != runningTaskId()) return false;
   if (!entry) return false;
   
   File nextEntry = dirHandles[handle].dir.openNextFile();
@@ -1005,7 +4766,7 @@ bool Kernel::dirCreate(const char* path) {
   if (!sdInitialized) return false;
   
   Task* current = getCurrentTask();
-  if (!current->canAccessSD) return false;
+  if (!hasPermission(current, TASK_PERM_SD)) return false;
   
   return SD.mkdir(path);
 }
@@ -1014,7 +4775,7 @@ bool Kernel::dirRemove(const char* path) {
   if (!sdInitialized) return false;
   
   Task* current = getCurrentTask();
-  if (!current->canAccessSD) return false;
+  if (!hasPermission(current, TASK_PERM_SD)) return false;
   
   return SD.rmdir(path);
 }
@@ -1022,7 +4783,7 @@ bool Kernel::dirRemove(const char* path) {
 void Kernel::dirRewind(int handle) {
   if (handle < 0 || handle >= MAX_DIR_HANDLES) return;
   if (!dirHandles[handle].inUse) return;
-  if (dirHandles[handle].ownerTaskId != currentTaskId) return;
+  if (dirHandles[handle].ownerTaskId != runningTaskId()) return;
   
   dirHandles[handle].dir.rewindDirectory();
 }
@@ -1066,13 +4827,57 @@ int Kernel::syscall(SyscallType type, void* arg1, void* arg2, void* arg3, void*
     
     // Memory operations
     case SYS_MEM_ALLOC:
-      return (int)(intptr_t)memAlloc((size_t)(intptr_t)arg1);
+      return (int)(intptr_t)memAlloc((size_t)(intptr_t)arg1, (MemHint)(intptr_t)arg2);
     case SYS_MEM_FREE:
       memFree(arg1);
       return SYS_OK;
+    case SYS_MEM_REALLOC:
+      return (int)(intptr_t)memRealloc(arg1, (size_t)(intptr_t)arg2);
+    case SYS_MEM_ALLOC_ALIGNED:
+      return (int)(intptr_t)memAllocAligned((size_t)(intptr_t)arg1, (size_t)(intptr_t)arg2);
+    case SYS_MEM_ALLOC_DMA:
+      return (int)(intptr_t)memAllocDma((size_t)(intptr_t)arg1);
+    case SYS_DMA_CLEAN:
+      dmaClean(arg1, (size_t)(intptr_t)arg2);
+      return SYS_OK;
+    case SYS_DMA_INVALIDATE:
+      dmaInvalidate(arg1, (size_t)(intptr_t)arg2);
+      return SYS_OK;
+    case SYS_MEM_TRACE_DUMP:
+      return memTraceDump((const char*)arg1);
+    case SYS_MEM_COMPACT_INFO:
+      return memCompactInfo((CompactStats*)arg1);
     case SYS_MEM_COMPACT:
       memCompact();
       return SYS_OK;
+    case SYS_MEM_HALLOC:
+      return memHandleAlloc((size_t)(intptr_t)arg1);
+    case SYS_MEM_HFREE:
+      return memHandleFree((int)(intptr_t)arg1);
+    case SYS_MEM_DEREF:
+      return (int)(intptr_t)memDeref((int)(intptr_t)arg1);
+    case SYS_MEM_UNPIN:
+      return memUnpin((int)(intptr_t)arg1);
+    case SYS_MEM_USAGE:
+      return memUsage((int)(intptr_t)arg1, (MemUsage*)arg2);
+    case SYS_MEM_REGION:
+      return memRegionInfo((int)(intptr_t)arg1, (MemRegionInfo*)arg2);
+    case SYS_POOL_CREATE:
+      return poolCreate((size_t)(intptr_t)arg1, (int)(intptr_t)arg2);
+    case SYS_POOL_ALLOC:
+      return (int)(intptr_t)poolAlloc((int)(intptr_t)arg1);
+    case SYS_POOL_FREE:
+      return poolFree((int)(intptr_t)arg1, arg2);
+    case SYS_MEM_SHRINKER_ADD:
+      return memShrinkerAdd((const char*)arg1, (void (*)(size_t))arg2);
+    case SYS_MEM_SHRINKER_REMOVE:
+      return memShrinkerRemove((int)(intptr_t)arg1);
+    case SYS_MEM_PRESSURE_NOTIFY:
+      return memPressureNotify(arg1 != nullptr);
+    case SYS_MEM_WATERMARKS:
+      return memSetWatermarks((int)(intptr_t)arg1, (int)(intptr_t)arg2);
+    case SYS_POOL_DESTROY:
+      return poolDestroy((int)(intptr_t)arg1);
     
     // Task operations
     case SYS_TASK_YIELD:
@@ -1081,6 +4886,8 @@ int Kernel::syscall(SyscallType type, void* arg1, void* arg2, void* arg3, void*
     case SYS_TASK_SLEEP:
       sleep((uint32_t)(intptr_t)arg1);
       return SYS_OK;
+    case SYS_SCHED_HIST:
+      return getSchedHistogram((int)(intptr_t)arg1, (SchedHistogram*)arg2);
     
     // IPC operations
     case SYS_IPC_SEND:
@@ -1100,6 +4907,16 @@ int Kernel::syscall(SyscallType type, void* arg1, void* arg2, void* arg3, void*
     case SYS_SEM_DESTROY:
       return semDestroy((int)(intptr_t)arg1);
     
+    // Mutex operations
+    case SYS_MUTEX_CREATE:
+      return mutexCreate((const char*)arg1);
+    case SYS_MUTEX_LOCK:
+      return mutexLock((int)(intptr_t)arg1, (uint32_t)(intptr_t)arg2);
+    case SYS_MUTEX_UNLOCK:
+      return mutexUnlock((int)(intptr_t)arg1);
+    case SYS_MUTEX_DESTROY:
+      return mutexDestroy((int)(intptr_t)arg1);
+    
     // GPIO operations
     case SYS_GPIO_PINMODE:
       return gpioSetMode((int)(intptr_t)arg1, (int)(intptr_t)arg2);
@@ -1160,7 +4977,7 @@ uint32_t Kernel::uptime() {
 }
 
 int Kernel::getCurrentTaskId() {
-  return currentTaskId;
+  return taskIdOf(getCurrentTask());
 }
 
 void Kernel::printTaskList() {
@@ -1168,68 +4985,389 @@ void Kernel::printTaskList() {
   Serial.println(F("ID  Name            State      Memory   LastYield"));
   Serial.println(F("--- --------------- ---------- -------- ---------"));
   
-  for (int i = 0; i < MAX_TASKS; i++) {
-    if (tasks[i].state == TASK_EMPTY) continue;
+  for (int i = 0; i < taskSlots; i++) {
+    if (taskHot.state[i] == TASK_EMPTY) continue;
     
-    Serial.print(i);
-    Serial.print(F("   "));
+    int id = taskIdOf(&tasks[i]);
+    Serial.print(id);
+    Serial.print(id < 10 ? F("   ") : (id < 100 ? F("  ") : F(" ")));
     Serial.print(tasks[i].name);
     
     for (int j = strlen(tasks[i].name); j < 16; j++) {
       Serial.print(' ');
     }
     
-    switch (tasks[i].state) {
+    switch (taskHot.state[i]) {
       case TASK_READY: Serial.print(F("READY     ")); break;
       case TASK_RUNNING: Serial.print(F("RUNNING   ")); break;
       case TASK_SLEEPING: Serial.print(F("SLEEPING  ")); break;
       case TASK_BLOCKED: Serial.print(F("BLOCKED   ")); break;
+      case TASK_ZOMBIE: Serial.print(F("ZOMBIE    ")); break;
       default: Serial.print(F("UNKNOWN   ")); break;
     }
     
     Serial.print(tasks[i].memoryUsed);
     Serial.print(F(" B    "));
     
-    uint32_t timeSinceYield = millis() - tasks[i].lastYield;
+    uint32_t timeSinceYield = millis() - taskHot.lastYield[i];
     Serial.print(timeSinceYield);
     Serial.println(F("ms"));
   }
+  
+  Serial.print(F("Dispatch: "));
+  Serial.print(schedStats.dispatchCount);
+  Serial.print(F(" picks, avg "));
+  Serial.print(schedStats.dispatchCount ?
+               (uint32_t)(schedStats.dispatchCyclesTotal / schedStats.dispatchCount) : 0);
+  Serial.print(F(" / max "));
+  Serial.print(schedStats.dispatchCyclesMax);
+  Serial.println(F(" " KERNEL_CYCLE_UNIT));
+  
+#ifdef KERNEL_STACKFUL_TASKS
+  Serial.print(F("Switch:   "));
+  Serial.print(schedStats.switchCount);
+  Serial.print(F(" switches ("));
+  Serial.print(schedStats.preemptions);
+  Serial.print(F(" preempted), avg "));
+  Serial.print(schedStats.switchCount ?
+               (uint32_t)(schedStats.switchCyclesTotal / schedStats.switchCount) : 0);
+  Serial.print(F(" / max "));
+  Serial.print(schedStats.switchCyclesMax);
+  Serial.println(F(" " KERNEL_CYCLE_UNIT));
+#endif
+  
+  for (int i = 1; i < taskSlots; i++) {
+    Task* task = &tasks[i];
+    if (taskHot.state[task->id] == TASK_EMPTY || !task->period) continue;
+    
+    Serial.print(KERNEL_RT_POLICY == RT_POLICY_EDF ? F("EDF ") : F("RM  "));
+    Serial.print(task->name);
+    Serial.print(F(": P="));
+    Serial.print(task->period);
+    Serial.print(F(" D="));
+    Serial.print(task->relativeDeadline);
+    Serial.print(F(" C="));
+    Serial.print(task->wcet);
+    Serial.print(F("ms prio "));
+    Serial.print(taskHot.priority[task->id]);
+    Serial.print(F(", "));
+    Serial.print(task->jobCount);
+    Serial.print(F(" jobs, "));
+    Serial.print(task->deadlineMisses);
+    Serial.print(F(" missed, jitter avg "));
+    Serial.print(task->jobCount > 1 ? (uint32_t)(task->jitterTotal / (task->jobCount - 1)) : 0);
+    Serial.print(F(" / max "));
+    Serial.print(task->jitterMax);
+    Serial.println(F(" us"));
+  }
+  
+  for (int i = 0; i < MAX_MUTEXES; i++) {
+    Mutex* mutex = &mutexes[i];
+    if (!mutex->inUse) continue;
+    
+    Serial.print(F("Mutex "));
+    Serial.print(mutex->name ? mutex->name : "?");
+    Serial.print(F(": "));
+    if (mutex->holderTaskId >= 0) {
+      Serial.print(F("held by "));
+      Serial.print(tasks[mutex->holderTaskId].name);
+    } else {
+      Serial.print(F("free"));
+    }
+    Serial.print(F(", "));
+    Serial.print(mutex->contentions);
+    Serial.print(F(" contended, max block "));
+    Serial.print(mutex->blockMaxMicros);
+    Serial.println(F(" us"));
+  }
+  
+#if KERNEL_MAX_CORES > 1
+  for (int core = 0; core < KERNEL_MAX_CORES; core++) {
+    Serial.print(F("Core "));
+    Serial.print(core);
+    Serial.print(F(":   running "));
+    Serial.print(tasks[currentTaskIds[core]].name);
+    Serial.print(F(", "));
+    Serial.print(runQueues[core].count);
+    Serial.println(F(" queued"));
+  }
+  Serial.print(F("Steals:   "));
+  Serial.println(schedStats.steals);
+#endif
+  
+  uint32_t up = uptime();
+  Serial.print(F("Idle:     "));
+  Serial.print(up ? (uint32_t)(idleStats.idleMicros / 10 / up) : 0);
+  Serial.print(F("% residency, "));
+  Serial.print(idleStats.sleeps);
+  Serial.print(F(" sleeps, wake latency avg "));
+  Serial.print(idleStats.deadlineWakeups ?
+               (uint32_t)(idleStats.wakeLatencyTotal / idleStats.deadlineWakeups) : 0);
+  Serial.print(F(" / max "));
+  Serial.print(idleStats.wakeLatencyMax);
+  Serial.println(F(" us"));
+  
+  uint64_t nextWakeup = nextWakeupTick();
+  if (nextWakeup != UINT64_MAX) {
+    uint64_t now = ticks();
+    Serial.print(F("Next wakeup in "));
+    Serial.print(nextWakeup > now ? (uint32_t)(nextWakeup - now) : 0);
+    Serial.println(F("ms"));
+  }
   Serial.println();
 }
 
 void Kernel::printMemoryInfo() {
   Serial.println(F("\n=== Memory Info ==="));
-  Serial.print(F("Total heap:     "));
-  Serial.print(KERNEL_HEAP_SIZE);
-  Serial.println(F(" bytes"));
-  Serial.print(F("Used:           "));
-  Serial.print(heapUsed);
-  Serial.println(F(" bytes"));
+  for (int r = 0; r < MEM_REGION_COUNT; r++) {
+    HeapControl* h = &heaps[r];
+    if (!h->base) continue;
+    Serial.print(F("Region "));
+    Serial.print(h->name);
+    Serial.print(F(":   "));
+    Serial.print(h->used);
+    Serial.print(F(" of "));
+    Serial.print(h->size);
+    Serial.print(F(" bytes (peak "));
+    Serial.print(h->peak);
+    Serial.print(F("), "));
+    Serial.print(heapFragmentation(r));
+    Serial.println(F("% fragmented"));
+    Serial.print(F("                "));
+    Serial.print(h->allocs);
+    Serial.print(F(" allocs / "));
+    Serial.print(h->frees);
+    Serial.print(F(" frees, "));
+    Serial.print(h->spills);
+    Serial.print(F(" spilled elsewhere, "));
+    Serial.print(h->failures);
+    Serial.println(F(" failed"));
+  }
   Serial.print(F("Available:      "));
   Serial.print(memAvailable());
   Serial.println(F(" bytes"));
   
-  // Count blocks
-  size_t readPos = 0;
+  // Count blocks (not fences and sentinels)
   int usedBlocks = 0;
   int freeBlocks = 0;
-  
-  while (readPos < heapUsed) {
-    MemoryBlock* block = (MemoryBlock*)&kernelHeap[readPos];
-    if (block->inUse) {
-      usedBlocks++;
-    } else {
-      freeBlocks++;
+  size_t largestFree = 0;
+  
+  uint32_t irq = portEnterCritical();
+  for (int r = 0; r < MEM_REGION_COUNT; r++) {
+    HeapControl* h = &heaps[r];
+    if (!h->base) continue;
+    for (MemoryBlock* block = h->first; block != h->sentinel; block = nextBlock(block)) {
+      if (block->inUse) {
+        if (blockSize(block)) usedBlocks++;
+      } else {
+        freeBlocks++;
+        if (blockSize(block) > largestFree) largestFree = blockSize(block);
+      }
     }
-    readPos += sizeof(MemoryBlock) + block->size;
+  }
+  portExitCritical(irq);
+  
+  Serial.print(F("Task slots:     "));
+  Serial.print(taskSlots);
+  Serial.print(F(" of "));
+  Serial.print(MAX_TASKS);
+  Serial.print(F(", "));
+  Serial.print(sizeof(TaskHotTable) / MAX_TASKS);
+  Serial.print(F(" hot + "));
+  Serial.print(sizeof(Task));
+  Serial.print(F(" TCB + "));
+  Serial.print(sizeof(TaskCold));
+  Serial.print(F(" cold bytes each (+"));
+  Serial.print(sizeof(MessageQueue));
+  Serial.println(F(" once sent a message)"));
+  
+  int handlesUsed = 0;
+  int handlesPinned = 0;
+  for (int i = 0; i < MAX_MEM_HANDLES; i++) {
+    if (memHandles[i].ptr) {
+      handlesUsed++;
+      if (memHandles[i].lockCount > 0) handlesPinned++;
+    }
+  }
+  Serial.print(F("Handles:        "));
+  Serial.print(handlesUsed);
+  Serial.print(F(" of "));
+  Serial.print(MAX_MEM_HANDLES);
+  Serial.print(F(", "));
+  Serial.print(handlesPinned);
+  Serial.println(F(" pinned"));
+  
+  size_t arenaBytes = 0;
+  int arenaTasks = 0;
+  for (int i = 0; i < taskSlots; i++) {
+    if (taskHot.state[i] != TASK_EMPTY && tasks[i].arena) {
+      arenaBytes += tasks[i].arenaBytes;
+      arenaTasks++;
+    }
+  }
+  Serial.print(F("Task arenas:    "));
+  Serial.print(arenaBytes);
+  Serial.print(F(" bytes across "));
+  Serial.print(arenaTasks);
+  Serial.println(F(" tasks"));
+  
+  for (int i = 0; i < MAX_MEM_POOLS; i++) {
+    MemPool* pool = &memPools[i];
+    if (!pool->inUse) continue;
+    Serial.print(F("Pool "));
+    Serial.print(pool->name ? pool->name : "?");
+    Serial.print(F(": "));
+    Serial.print(pool->objSize);
+    Serial.print(F(" B, "));
+    Serial.print(pool->perSlab);
+    Serial.print(F(" per slab, "));
+    Serial.print(pool->slabCount);
+    Serial.print(F(" slabs, "));
+    Serial.print(pool->objectsInUse);
+    Serial.print(F(" in use (peak "));
+    Serial.print(pool->peakInUse);
+    Serial.print(F("), "));
+    Serial.print(pool->allocs);
+    Serial.print(F(" allocs, "));
+    Serial.print(pool->failures);
+    Serial.println(F(" failed"));
   }
   
   Serial.print(F("Used blocks:    "));
   Serial.println(usedBlocks);
   Serial.print(F("Free blocks:    "));
-  Serial.println(freeBlocks);
-  if (freeBlocks > 0) {
-    Serial.println(F("Fragmentation detected - consider compacting"));
+  Serial.print(freeBlocks);
+  Serial.print(F(", largest "));
+  Serial.print(largestFree);
+  Serial.println(F(" bytes"));
+  
+  Serial.print(F("Compaction:     "));
+  Serial.print(compactStats.passes);
+  Serial.print(F(" sweeps, "));
+  Serial.print(compactStats.blocksMoved);
+  Serial.print(F(" blocks / "));
+  Serial.print(compactStats.bytesMoved);
+  Serial.print(F(" bytes moved, pause avg "));
+  Serial.print(compactStats.steps ?
+               (uint32_t)(compactStats.pauseTotalMicros / compactStats.steps) : 0);
+  Serial.print(F(" / max "));
+  Serial.print(compactStats.pauseMaxMicros);
+  Serial.println(F(" us"));
+  if (compactCursor) {
+    Serial.println(F("Compacting in the background"));
+  }
+  
+  Serial.print(F("Realloc:        "));
+  Serial.print(reallocStats.grownInPlace);
+  Serial.print(F(" grown / "));
+  Serial.print(reallocStats.shrunkInPlace);
+  Serial.print(F(" shrunk in place, "));
+  Serial.print(reallocStats.moved);
+  Serial.print(F(" moved ("));
+  Serial.print(reallocStats.bytesCopied);
+  Serial.println(F(" bytes copied)"));
+  
+  Serial.print(F("Pressure:       "));
+  Serial.print(pressureStats.events[MEM_PRESSURE_LOW]);
+  Serial.print(F(" low / "));
+  Serial.print(pressureStats.events[MEM_PRESSURE_MIN]);
+  Serial.print(F(" min / "));
+  Serial.print(pressureStats.events[MEM_PRESSURE_OOM]);
+  Serial.print(F(" out of memory, "));
+  Serial.print(pressureStats.messages);
+  Serial.print(F(" messages, "));
+  Serial.print(pressureStats.rescued);
+  Serial.print(F(" allocs rescued, "));
+  Serial.print(pressureStats.bytesReclaimed);
+  Serial.println(F(" bytes reclaimed"));
+  for (int i = 0; i < MAX_MEM_SHRINKERS; i++) {
+    MemShrinker* s = &memShrinkers[i];
+    if (!s->inUse) continue;
+    Serial.print(F("Shrinker "));
+    Serial.print(s->name ? s->name : "?");
+    Serial.print(F(": "));
+    Serial.print(s->calls);
+    Serial.print(F(" calls, "));
+    Serial.print(s->bytesReclaimed);
+    Serial.println(F(" bytes reclaimed"));
   }
   Serial.println();
 }
+
+// CPU usage per task. Each row is copied under the lock and printed after
+// it is released, so the (slow) serial output never holds up the tasks being
+// measured and the stack cost doesn't grow with MAX_TASKS.
+void Kernel::printTop() {
+  uint32_t irq = portEnterCritical();
+  uint16_t load = systemLoad;
+  portExitCritical(irq);
+  
+  Serial.print(F("\nLoad: "));
+  Serial.print(load / 10);
+  Serial.print('.');
+  Serial.print(load % 10);
+  Serial.print(F("%   Uptime: "));
+  Serial.print(uptime() / 1000);
+  Serial.println(F("s"));
+  Serial.println(F("Name            State     CPU%   Run (k" KERNEL_CYCLE_UNIT ")  Slices    Max slice"));
+  
+  for (int i = 1; i < taskSlots; i++) {
+    irq = portEnterCritical();
+    Task* task = &tasks[i];
+    TaskState state = (TaskState)taskHot.state[task->id];
+    const char* name = task->name;
+    uint16_t taskLoad = task->load;
+    uint64_t runCycles = task->runCycles;
+    uint32_t dispatches = task->dispatches;
+    uint32_t sliceMax = task->sliceMaxCycles;
+    portExitCritical(irq);
+    if (state == TASK_EMPTY) continue;
+    
+    Serial.print(name);
+    for (int j = strlen(name); j < 16; j++) {
+      Serial.print(' ');
+    }
+    switch (state) {
+      case TASK_READY: Serial.print(F("READY     ")); break;
+      case TASK_RUNNING: Serial.print(F("RUNNING   ")); break;
+      case TASK_SLEEPING: Serial.print(F("SLEEPING  ")); break;
+      case TASK_BLOCKED: Serial.print(F("BLOCKED   ")); break;
+      default: Serial.print(F("ZOMBIE    ")); break;
+    }
+    Serial.print(taskLoad / 10);
+    Serial.print('.');
+    Serial.print(taskLoad % 10);
+    Serial.print(F("   "));
+    Serial.print((uint32_t)(runCycles / 1000));
+    Serial.print(F("   "));
+    Serial.print(dispatches);
+    Serial.print(F("   "));
+    Serial.println(sliceMax);
+  }
+}
+
+int Kernel::getSchedHistogram(int taskId, SchedHistogram* out) {
+#if KERNEL_SCHED_HIST
+  if (!out) return SYS_ERR_INVALID_PARAM;
+  Task* task = getTask(taskId);
+  if (!task || taskId == 0) return SYS_ERR_NOT_FOUND;
+  
+  uint32_t irq = portEnterCritical();
+  memcpy(out, &coldOf(task)->schedHist, sizeof(SchedHistogram));
+  portExitCritical(irq);
+  return SYS_OK;
+#else
+  (void)taskId; (void)out;
+  return SYS_ERR_INVALID_CALL;
+#endif
+}
+
+void Kernel::resetSchedHistograms() {
+#if KERNEL_SCHED_HIST
+  uint32_t irq = portEnterCritical();
+  for (int i = 0; i < taskSlots; i++) {
+    memset(&tasks.cold(i).schedHist, 0, sizeof(SchedHistogram));
+  }
+  portExitCritical(irq);
+#endif
+}
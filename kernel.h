@@ -3,7 +3,8 @@
   A functional kernel for Arduino Giga R1 WiFi
   
   Features:
-  - Cooperative multitasking with watchdog timer protection
+  - Preemptive multitasking (Cortex-M and host ports), cooperative elsewhere
+  - Watchdog timer protection
   - Memory management with proper compaction (pointer-safe via handles)
   - IPC (message queues, semaphores)
   - Device Driver Interface (DDI) for GPIO, I2C, SPI
@@ -18,6 +19,15 @@
 #include <SD.h>
 #include <Wire.h>
 #include <SPI.h>
+#include <limits.h>
+
+// C++20 coroutine tasks, where the toolchain has them
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+  #if __has_include(<coroutine>)
+    #include <coroutine>
+    #define KERNEL_COROUTINES 1
+  #endif
+#endif
 
 // ============================================================================
 // SYSTEM CALL DEFINITIONS
@@ -91,7 +101,35 @@ enum SyscallType {
   // System operations
   SYS_GET_TIME,
   SYS_PRINT,
-  SYS_DBG_PRINT
+  SYS_DBG_PRINT,
+  
+  // Added since: new calls go on the end so existing numbers never change
+  SYS_MUTEX_CREATE,
+  SYS_MUTEX_LOCK,
+  SYS_MUTEX_UNLOCK,
+  SYS_MUTEX_DESTROY,
+  SYS_SCHED_HIST,
+  SYS_MEM_HALLOC,
+  SYS_MEM_HFREE,
+  SYS_MEM_DEREF,
+  SYS_MEM_UNPIN,
+  SYS_POOL_CREATE,
+  SYS_POOL_ALLOC,
+  SYS_POOL_FREE,
+  SYS_POOL_DESTROY,
+  SYS_MEM_USAGE,
+  SYS_MEM_REGION,
+  SYS_MEM_REALLOC,
+  SYS_MEM_ALLOC_ALIGNED,
+  SYS_MEM_ALLOC_DMA,
+  SYS_DMA_CLEAN,
+  SYS_DMA_INVALIDATE,
+  SYS_MEM_TRACE_DUMP,
+  SYS_MEM_COMPACT_INFO,
+  SYS_MEM_SHRINKER_ADD,
+  SYS_MEM_SHRINKER_REMOVE,
+  SYS_MEM_PRESSURE_NOTIFY,
+  SYS_MEM_WATERMARKS
 };
 
 // System call result codes
@@ -104,17 +142,72 @@ enum SyscallResult {
   SYS_ERR_IO_ERROR = -5,
   SYS_ERR_INVALID_PARAM = -6,
   SYS_ERR_TIMEOUT = -7,
-  SYS_ERR_WOULD_BLOCK = -8
+  SYS_ERR_WOULD_BLOCK = -8,
+  SYS_ERR_UNSCHEDULABLE = -9, // Admission test rejected a periodic task
+  SYS_ERR_BUSY = -10          // Still in use (a pinned handle)
 };
 
 // Configuration
-#define MAX_TASKS 8
-#define MAX_FILE_HANDLES 16
-#define MAX_DIR_HANDLES 4
+// Task slots. Control blocks come from a pool that grows TASK_POOL_CHUNK at a
+// time from the kernel heap, so slots never used cost nothing but their
+// entries in the small per-slot tables (sleep heap, chunk pointers).
+#ifndef MAX_TASKS
+  #if defined(ARDUINO_GIGA)
+    #define MAX_TASKS 256
+  #elif defined(ARDUINO_ARCH_RP2040) || defined(ARDUINO_ARCH_ESP32) || defined(__linux__)
+    #define MAX_TASKS 64
+  #else
+    #define MAX_TASKS 8
+  #endif
+#endif
+#define TASK_POOL_CHUNK 8   // Control blocks per pool chunk (power of two)
+#define TASK_POOL_CHUNKS ((MAX_TASKS + TASK_POOL_CHUNK - 1) / TASK_POOL_CHUNK)
+
+// Task IDs handed out by the API carry the slot in the low bits and the
+// slot's generation above it, so an ID kept after its task exits never
+// reaches whichever task reuses the slot
+#define TASK_ID_INDEX_BITS 8
+#define TASK_ID_INDEX_MASK ((1 << TASK_ID_INDEX_BITS) - 1)
+#define TASK_ID_GEN_MASK (INT_MAX >> TASK_ID_INDEX_BITS)
+#if MAX_TASKS > (1 << TASK_ID_INDEX_BITS)
+  #error "MAX_TASKS doesn't fit in TASK_ID_INDEX_BITS"
+#endif
+#define MAX_FILE_HANDLES 16        // Per-task ownership is a 32-bit mask
+#define MAX_DIR_HANDLES 4          // Likewise, 8-bit
+#if MAX_FILE_HANDLES > 32 || MAX_DIR_HANDLES > 8
+  #error "Too many handles for TaskCold's ownership masks"
+#endif
 #define MAX_MESSAGE_QUEUE_SIZE 16
 #define MAX_SEMAPHORES 8
+#define MAX_MUTEXES 8
+#define MAX_MEM_HANDLES 16
+#define MAX_MEM_POOLS 8
+#define MAX_MEM_SHRINKERS 8
 #define MAX_STACK_TRACE_DEPTH 8
 
+// Task permission bits (TaskCold::permissions)
+#define TASK_PERM_SD          0x01
+#define TASK_PERM_DISPLAY     0x02
+#define TASK_PERM_CREATE_TASK 0x04
+#define TASK_PERM_GPIO        0x08
+#define TASK_PERM_I2C         0x10  // Off by default: needs explicit grant
+#define TASK_PERM_SPI         0x20  // Likewise
+#define TASK_PERM_DEFAULT (TASK_PERM_SD | TASK_PERM_DISPLAY | TASK_PERM_GPIO)
+
+// Scheduler configuration
+#define MAX_PRIORITIES 32          // One ready-bitmap bit per level (0 = idle)
+#define TASK_DEFAULT_PRIORITY 10
+#define TASK_RT_PRIORITY_BASE 16   // Periodic tasks are placed in 16..31
+#define TASK_RT_PRIORITY_MAX (MAX_PRIORITIES - 1)
+
+// Real-time policy for periodic tasks: rate-monotonic (shorter period gets
+// a higher fixed priority) or earliest-deadline-first within one level
+#define RT_POLICY_RM  0
+#define RT_POLICY_EDF 1
+#ifndef KERNEL_RT_POLICY
+  #define KERNEL_RT_POLICY RT_POLICY_RM
+#endif
+
 // Watchdog configuration
 #define WATCHDOG_TIMEOUT_MS 5000  // 5 seconds without yield = force reschedule
 
@@ -131,10 +224,141 @@ enum SyscallResult {
   #define KERNEL_HEAP_SIZE (256 * 1024)  // 256KB for ESP32 (320KB+ RAM)
 #elif defined(ARDUINO_ARCH_ESP8266)
   #define KERNEL_HEAP_SIZE (32 * 1024)   // 32KB for ESP8266 (80KB RAM)
+#elif defined(__linux__)
+  #define KERNEL_HEAP_SIZE (1024 * 1024) // 1MB for a Linux host build
 #else
   #define KERNEL_HEAP_SIZE (2 * 1024)    // 2KB conservative default (Uno-class)
 #endif
 
+// Further heap regions beside kernelHeap (internal RAM). The Giga adds its
+// 8MB external SDRAM; tightly coupled RAM is used where the board's linker
+// script leaves some free (define KERNEL_DTCM_HEAP_ADDR and _SIZE). A Linux
+// host emulates both with static arrays so placement can be tested.
+#if defined(ARDUINO_GIGA) && defined(__has_include)
+  #if __has_include(<SDRAM.h>)
+    #define KERNEL_SDRAM_HEAP_ADDR 0x60000000UL  // SDRAM_START_ADDRESS
+    #define KERNEL_SDRAM_HEAP_SIZE (8UL * 1024 * 1024)
+  #endif
+#elif defined(__linux__)
+  #define KERNEL_SDRAM_HEAP_SIZE (8UL * 1024 * 1024)
+  #define KERNEL_DTCM_HEAP_SIZE (64UL * 1024)
+#endif
+#ifndef KERNEL_SDRAM_HEAP_SIZE
+  #define KERNEL_SDRAM_HEAP_SIZE 0
+#endif
+#ifndef KERNEL_DTCM_HEAP_SIZE
+  #define KERNEL_DTCM_HEAP_SIZE 0
+#endif
+
+#define MEM_REGION_SRAM  0  // kernelHeap
+#define MEM_REGION_DTCM  1
+#define MEM_REGION_SDRAM 2
+#define MEM_REGION_COUNT 3
+
+// DMA buffers are aligned and padded to the Cortex-M7's 32-byte D-cache
+// line, so no other data shares a line that DMA writes behind the cache.
+// Boards without a cache get the same layout.
+#define DMA_ALIGN 32
+
+// spiTransfer() bounces buffers that aren't DMA-safe through one of the
+// kernel's, KERNEL_SPI_BOUNCE_SIZE at a time. Below KERNEL_SPI_DMA_MIN
+// bytes it sends a byte at a time instead of paying for cache upkeep.
+#ifndef KERNEL_SPI_BOUNCE_SIZE
+#define KERNEL_SPI_BOUNCE_SIZE 256
+#endif
+#ifndef KERNEL_SPI_DMA_MIN
+#define KERNEL_SPI_DMA_MIN 32
+#endif
+
+// Heap allocator (two-level segregated fit). Free blocks are binned by
+// power of two (first level) split into MEM_SL_COUNT linear steps (second
+// level); blocks must be smaller than 2^MEM_FL_INDEX_MAX, so bigger regions
+// are fenced into segments that never merge.
+#if KERNEL_HEAP_SIZE <= 4096
+  #define MEM_FL_INDEX_MAX 12
+  #define MEM_SL_LOG2 2
+#elif KERNEL_HEAP_SIZE <= 65536
+  #define MEM_FL_INDEX_MAX 16
+  #define MEM_SL_LOG2 3
+#elif KERNEL_HEAP_SIZE <= 1048576
+  #define MEM_FL_INDEX_MAX 20
+  #define MEM_SL_LOG2 4
+#else
+  #define MEM_FL_INDEX_MAX 24
+  #define MEM_SL_LOG2 4
+#endif
+#define MEM_ALIGN_LOG2 (sizeof(void*) > 4 ? 3 : 2)  // 8 bytes on 64-bit hosts, else 4
+#define MEM_ALIGN (1 << MEM_ALIGN_LOG2)
+#define MEM_SL_COUNT (1 << MEM_SL_LOG2)
+#define MEM_FL_SHIFT (MEM_SL_LOG2 + MEM_ALIGN_LOG2)
+#define MEM_FL_COUNT (MEM_FL_INDEX_MAX - MEM_FL_SHIFT + 1)
+#define MEM_SMALL_BLOCK (1 << MEM_FL_SHIFT)  // Below this, classes are linear
+
+// Block headers pack the payload size (in MEM_ALIGN units, so it covers any
+// block TLSF can bin) and a tag into one 32-bit word. The tag is the owner's
+// slot + 1, wide enough for MAX_TASKS, or a MemHandle index.
+#define MEM_SIZE_BITS (MEM_FL_INDEX_MAX - MEM_ALIGN_LOG2)
+#if MAX_TASKS < 16
+  #define MEM_TAG_BITS 4
+#elif MAX_TASKS < 128
+  #define MEM_TAG_BITS 7
+#else
+  #define MEM_TAG_BITS 9
+#endif
+#if MAX_MEM_HANDLES > (1 << MEM_TAG_BITS)
+  #error "MAX_MEM_HANDLES doesn't fit in MEM_TAG_BITS"
+#endif
+
+// Idle-time compaction starts once this share (percent) of the free space
+// lies outside the largest free block, and moves about
+// KERNEL_COMPACT_STEP_BYTES per idle slice
+#ifndef KERNEL_COMPACT_THRESHOLD
+  #define KERNEL_COMPACT_THRESHOLD 50
+#endif
+#ifndef KERNEL_COMPACT_STEP_BYTES
+  #if KERNEL_HEAP_SIZE >= 65536
+    #define KERNEL_COMPACT_STEP_BYTES 2048
+  #else
+    #define KERNEL_COMPACT_STEP_BYTES 256
+  #endif
+#endif
+
+// Memory pressure watermarks, in percent of a region's capacity left free.
+// Below the low one, tasks that asked for it get a MemPressureMsg; below
+// the min one the shrinkers are asked to get it back above the low one.
+// A failed allocation asks them too before compacting and retrying.
+// memSetWatermarks() changes both at run time.
+#ifndef KERNEL_MEM_LOW_WATERMARK
+  #define KERNEL_MEM_LOW_WATERMARK 20
+#endif
+#ifndef KERNEL_MEM_MIN_WATERMARK
+  #define KERNEL_MEM_MIN_WATERMARK 10
+#endif
+
+// Ring buffer of the last KERNEL_MEM_TRACE malloc/free/realloc calls,
+// which memTraceDump() writes to SD for tools/memreplay.cpp to replay on
+// a host. 0 (the default) compiles it out.
+#ifndef KERNEL_MEM_TRACE
+  #define KERNEL_MEM_TRACE 0
+#endif
+
+// A task's malloc()s are carved from arena chunks of this size (bigger
+// requests get a chunk of their own), which killTask frees wholesale
+#if KERNEL_HEAP_SIZE >= 262144
+  #define ARENA_CHUNK_SIZE 4096
+#elif KERNEL_HEAP_SIZE >= 32768
+  #define ARENA_CHUNK_SIZE 1024
+#else
+  #define ARENA_CHUNK_SIZE 256
+#endif
+
+// Mailboxes come from a kernel pool, this many per slab
+#if KERNEL_HEAP_SIZE >= 65536
+  #define MAILBOX_POOL_SLAB 4
+#else
+  #define MAILBOX_POOL_SLAB 1
+#endif
+
 // SD Card Configuration
 #ifdef ARDUINO_ARCH_RP2040
   #define SD_CS_PIN 17  // RP2040 Pico default
@@ -146,6 +370,91 @@ enum SyscallResult {
   #define SD_CS_PIN 10  // Generic Arduino default (Uno, etc.)
 #endif
 
+// Cycle counter: DWT on Cortex-M3/M4/M7, micros() everywhere else
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+  #define KERNEL_HAS_DWT 1
+  #define KERNEL_CYCLE_UNIT "cycles"
+#else
+  #define KERNEL_CYCLE_UNIT "us"
+#endif
+
+// Per-task log2 histograms of wake-to-run latency and run-slice length, in
+// KERNEL_CYCLE_UNIT. Bucket 0 counts zero, bucket N counts [2^(N-1), 2^N),
+// the last bucket everything longer. Off by default on AVR for the RAM.
+#ifndef KERNEL_SCHED_HIST
+  #ifdef __AVR__
+    #define KERNEL_SCHED_HIST 0
+  #else
+    #define KERNEL_SCHED_HIST 1
+  #endif
+#endif
+#ifdef KERNEL_HAS_DWT
+  #define SCHED_HIST_BUCKETS 28  // Up to ~2^26 cycles
+#else
+  #define SCHED_HIST_BUCKETS 20  // Up to ~2^18 us
+#endif
+
+// Context switch port. Stackful preemptive tasks need a port; boards without
+// one keep the cooperative model where schedule() calls entryPoint() directly.
+// mbed-based cores (Giga, Nano 33 BLE) run RTX, which already owns PendSV and
+// SysTick, so the Cortex-M port is only picked automatically on bare cores.
+// Define KERNEL_COOPERATIVE to force the old model on any board.
+#if !defined(KERNEL_PORT_CORTEXM) && !defined(KERNEL_PORT_HOST) && \
+    !defined(KERNEL_COOPERATIVE)
+  #if (defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__) || \
+       defined(__ARM_ARCH_6M__)) && !defined(ARDUINO_ARCH_MBED)
+    #define KERNEL_PORT_CORTEXM 1
+  #elif defined(__linux__)
+    #define KERNEL_PORT_HOST 1   // ucontext + SIGALRM
+  #endif
+#endif
+
+#if defined(KERNEL_PORT_CORTEXM) || defined(KERNEL_PORT_HOST)
+  #define KERNEL_STACKFUL_TASKS 1
+#endif
+
+// Cores sharing the kernel. The RP2040's second M0+ joins from setup1();
+// on a Linux host, -DKERNEL_MAX_CORES=N runs N cores as std::threads. The
+// Giga's M4 boots its own firmware image, so the Giga stays single-core.
+#ifndef KERNEL_MAX_CORES
+  #if defined(KERNEL_PORT_CORTEXM) && defined(ARDUINO_ARCH_RP2040)
+    #define KERNEL_MAX_CORES 2
+  #else
+    #define KERNEL_MAX_CORES 1
+  #endif
+#endif
+
+#if KERNEL_MAX_CORES > 1 && !defined(KERNEL_STACKFUL_TASKS)
+  #error "KERNEL_MAX_CORES > 1 needs a context switch port"
+#endif
+
+#define TASK_AFFINITY_ANY 0xFFFFFFFFUL
+
+#ifndef TASK_STACK_SIZE
+  #if defined(KERNEL_PORT_HOST)
+    #define TASK_STACK_SIZE (64 * 1024)  // libc printf wants real stack
+  #elif defined(ARDUINO_GIGA)
+    #define TASK_STACK_SIZE (8 * 1024)
+  #elif defined(ARDUINO_ARCH_RP2040)
+    #define TASK_STACK_SIZE (4 * 1024)
+  #else
+    #define TASK_STACK_SIZE (2 * 1024)
+  #endif
+#endif
+
+#define KERNEL_TICK_HZ 1000
+#ifndef KERNEL_TIME_SLICE_MS
+  #define KERNEL_TIME_SLICE_MS 10  // Round-robin quantum within a priority level
+#endif
+#define KERNEL_IDLE_MAX_MS 1000    // Longest single idle sleep with no sleepers
+#define KERNEL_LOAD_WINDOW_MS 1000 // CPU load is sampled this often
+
+// Define as 0 to keep stackful tasks cooperative: the tick then only wakes
+// sleepers and tasks switch when they yield, sleep or wait
+#ifndef KERNEL_TICK_PREEMPT
+#define KERNEL_TICK_PREEMPT 1
+#endif
+
 // ============================================================================
 // TASK MANAGEMENT
 // ============================================================================
@@ -159,51 +468,361 @@ enum TaskState {
   TASK_ZOMBIE
 };
 
+// What a task is waiting on. Semaphore and mutex waits block in the
+// object's wait queue; a coroutine waiting for a message blocks on its own
+// mailbox, which only it receives from.
+enum WaitKind {
+  WAIT_NONE = 0,
+  WAIT_SEM,
+  WAIT_MUTEX,
+  WAIT_MESSAGE
+};
+
+// Scheduler histograms for one task (counts saturate at 65535)
+struct SchedHistogram {
+  uint16_t wakeToRun[SCHED_HIST_BUCKETS];  // READY until it gets the CPU
+  uint16_t runSlice[SCHED_HIST_BUCKETS];   // CPU time per dispatch
+};
+
 // Stack trace entry
 struct StackFrame {
   void* returnAddress;
   const char* functionName;
 };
 
+struct MessageQueue;
+struct MemoryBlock;
+struct ArenaChunk;
+
 struct Task {
-  int id;
+  int id;                   // Slot index, fixed for the slot's life; see taskIdOf()
+  unsigned int generation;  // Bumped each time the slot is freed
   const char* name;
-  TaskState state;
   void (*entryPoint)();
+  void* coroutine;       // coroutine_handle address, nullptr for plain tasks
   
   // Scheduling
-  uint32_t sleepUntil;
+  int sleepIndex;        // Position in the sleep heap, -1 = not queued
   uint32_t lastRun;
-  uint32_t lastYield;  // NEW: For watchdog
-  int priority;
+  uint32_t sliceStart; // millis() when its current quantum began
+  int basePriority;    // Assigned priority, without mutex inheritance
+  int heldMutexes;     // First mutex it holds (chained by Mutex::nextHeld)
+  int readyNext;       // Run queue links (task IDs, -1 = none)
+  int readyPrev;
+  int core;            // Core whose run queue holds it / it last ran on
+  uint32_t affinity;   // Bit N set = may run on core N
+  volatile int onCore; // Core whose registers hold it right now, -1 = saved
+  
+  // Periodic real-time jobs (period 0 = ordinary task)
+  uint32_t period;
+  uint32_t relativeDeadline;
+  uint32_t wcet;              // Budget claimed at admission
+  uint64_t releaseTime;       // Current job's release on the 64-bit tick
+  uint64_t absDeadline;
+  bool jobStarted;
+  uint32_t jobCount;
+  uint32_t deadlineMisses;    // Late completions plus dropped releases
+  uint32_t lastStartMicros;
+  uint64_t lastStartRelease;
+  uint32_t jitterMax;         // Start-to-start deviation from the period (us)
+  uint64_t jitterTotal;
+  
+  // CPU accounting, in KERNEL_CYCLE_UNIT
+  uint64_t runCycles;         // Total CPU time
+  uint32_t dispatches;        // Slices run
+  uint32_t sliceMaxCycles;    // Longest single slice
+  uint32_t sliceStartCycles;  // Cycle count when its current slice began
+  uint64_t loadMarkCycles;    // runCycles as of the last load sample
+  uint16_t load;              // Moving average CPU share, per mille
+  
+#if KERNEL_SCHED_HIST
+  uint32_t readySince;        // Cycle count when it last became READY
+#endif
   
-  // Resource tracking
-  bool fileHandles[MAX_FILE_HANDLES];
-  bool dirHandles[MAX_DIR_HANDLES];
-  size_t memoryUsed;
+#ifdef KERNEL_STACKFUL_TASKS
+  // Execution context
+  void* stackBase;      // Pinned heap block holding the stack
+  void* context;        // Saved SP (Cortex-M) or ucontext_t* (host)
+#endif
   
-  // Stack trace (NEW)
-  StackFrame stackTrace[MAX_STACK_TRACE_DEPTH];
+  // Pending wait
+  uint8_t waitKind;
+  int waitObject;
+  int waitNext;           // Next task in the object's wait queue, -1 = last
+  uint32_t waitSince;     // micros() when it blocked
+  void* waitBuffer;
+  size_t waitLength;
+  int* waitFrom;
+  int waitResult;
+  
+  MessageQueue* mailbox;  // Allocated on the first message sent to it
+  
+  // Resource tracking
+  size_t memoryUsed;       // Heap it owns: malloc()s, stack, handles, pools
+  size_t memoryPeak;
+  ArenaChunk* arena;       // Chunks its malloc()s are carved from
+  MemoryBlock* arenaFree;  // Free blocks in those chunks
+  size_t arenaBytes;       // Heap held by the chunks
+};
+
+// Per-task data the scheduler never looks at, kept out of the Task so
+// scheduling code doesn't pull it through the cache. One per slot.
+struct TaskCold {
+  uint32_t fileHandles;   // Bit N set = owns fileHandles[N]
+  uint8_t dirHandles;     // Bit N set = owns dirHandles[N]
+  uint8_t permissions;    // TASK_PERM_* bits
+  bool memPressureMessages;  // Wants a MemPressureMsg when memory runs low
   int stackTraceDepth;
+  StackFrame stackTrace[MAX_STACK_TRACE_DEPTH];
+#if KERNEL_SCHED_HIST
+  SchedHistogram schedHist;
+#endif
+};
+
+// The fields every scheduling scan reads, as packed arrays indexed by slot,
+// so walking all tasks' state touches a few cache lines rather than one or
+// more per Task.
+struct TaskHotTable {
+  uint8_t state[MAX_TASKS];       // TaskState
+  uint8_t priority[MAX_TASKS];    // Effective: basePriority, or higher while inheriting
+  uint32_t lastYield[MAX_TASKS];  // millis() it last yielded, for the watchdog
+  uint64_t sleepUntil[MAX_TASKS]; // Wakeup time on the 64-bit tick (Kernel::ticks())
+};
+
+// Task control blocks by slot index. Slots live in fixed-size chunks that are
+// never freed, so a lookup is a shift and a mask and a Task* stays valid.
+struct TaskTable {
+  Task* chunks[TASK_POOL_CHUNKS];
   
-  // Permissions
-  bool canAccessSD;
-  bool canAccessDisplay;
-  bool canCreateTasks;
-  bool canAccessGPIO;     // NEW
-  bool canAccessI2C;      // NEW
-  bool canAccessSPI;      // NEW
+  TaskCold* coldChunks[TASK_POOL_CHUNKS];  // Allocated alongside each chunk
+  
+  Task& operator[](int index) {
+    return chunks[index / TASK_POOL_CHUNK][index % TASK_POOL_CHUNK];
+  }
+  TaskCold& cold(int index) {
+    return coldChunks[index / TASK_POOL_CHUNK][index % TASK_POOL_CHUNK];
+  }
+};
+
+// Ready queue: one FIFO list per priority level plus a bitmap of non-empty
+// levels, so picking the next task is a count-leading-zeros, not a table scan.
+struct RunQueue {
+  uint32_t readyBitmap;
+  int count;
+  int head[MAX_PRIORITIES];
+  int tail[MAX_PRIORITIES];
+};
+
+struct SchedulerStats {
+  uint32_t dispatchCount;
+  uint64_t dispatchCyclesTotal;
+  uint32_t dispatchCyclesMax;
+  uint32_t switchCount;        // Context switches (stackful builds)
+  uint64_t switchCyclesTotal;  // Decision to first instruction of new task
+  uint32_t switchCyclesMax;
+  uint32_t preemptions;        // Switches forced by the tick
+  uint32_t steals;             // Tasks pulled from another core's queue
+};
+
+struct IdleStats {
+  uint32_t sleeps;             // Times idle() put the CPU to sleep
+  uint64_t idleMicros;         // Total time spent asleep
+  uint32_t deadlineWakeups;    // Sleeps that ran to their deadline
+  uint64_t wakeLatencyTotal;   // Microseconds late, summed over those
+  uint32_t wakeLatencyMax;
 };
 
 // ============================================================================
 // MEMORY MANAGEMENT - Handle-based for safe compaction
 // ============================================================================
 
-struct MemoryBlock {
+// Header in front of every heap block: one word of bit fields (padded to
+// MEM_ALIGN on 64-bit hosts). Blocks tile the heap. A free block repeats its
+// size in a footer, its payload's last word, and the block above it has
+// prevFree set, so a free can merge with the block below without a pointer
+// to it in every header.
+struct alignas(MEM_ALIGN) MemoryBlock {
+  uint32_t units : MEM_SIZE_BITS;  // Payload bytes / MEM_ALIGN
+  uint32_t inUse : 1;
+  uint32_t prevFree : 1;           // Block just below is free (footer valid)
+  uint32_t kind : 2;               // BLOCK_*
+  uint32_t tag : MEM_TAG_BITS;     // Owner slot + 1 (0 = kernel), or handle index
+};
+
+static_assert(MEM_SIZE_BITS + 4 + MEM_TAG_BITS <= 32, "MemoryBlock doesn't fit in a word");
+
+// Free blocks keep their free-list links at the start of the payload and
+// their footer at the end
+struct FreeBlockLinks {
+  MemoryBlock* next;
+  MemoryBlock* prev;
+};
+
+#define MEM_MIN_PAYLOAD \
+  ((sizeof(FreeBlockLinks) + sizeof(uint32_t) + MEM_ALIGN - 1) & ~(size_t)(MEM_ALIGN - 1))
+
+// One per region
+struct HeapControl {
+  const char* name;
+  uint8_t* base;          // nullptr = region not present
   size_t size;
-  int ownerTaskId;
+  size_t capacity;        // Bytes available when nothing is allocated
+  uint32_t flBitmap;                  // Bit N = some slBitmap[N] bit set
+  uint32_t slBitmap[MEM_FL_COUNT];    // Bit N = freeHeads[fl][N] non-empty
+  MemoryBlock* freeHeads[MEM_FL_COUNT][MEM_SL_COUNT];
+  MemoryBlock* first;
+  MemoryBlock* sentinel;  // Zero-size in-use block closing the heap
+  size_t used;            // Bytes in allocated blocks, headers included
+  size_t peak;
+  uint32_t allocs;
+  uint32_t frees;
+  uint32_t failures;      // Requests it was first choice for that failed everywhere
+  uint32_t spills;        // Requests it was first choice for that went elsewhere
+  uint32_t freesAtSweep;  // frees when the last compaction sweep began
+  uint8_t pressure;       // MemPressureLevel last reported
+};
+
+enum MemPressureLevel {
+  MEM_PRESSURE_NONE = 0,
+  MEM_PRESSURE_LOW,   // Under the low watermark
+  MEM_PRESSURE_MIN,   // Under the min watermark
+  MEM_PRESSURE_OOM,   // An allocation found no room
+  MEM_PRESSURE_LEVELS
+};
+
+// What tasks that called memPressureNotify(true) receive, from
+// IPC_FROM_KERNEL
+#define IPC_FROM_KERNEL -1
+struct MemPressureMsg {
+  uint8_t level;      // MemPressureLevel
+  int8_t region;
+  size_t freeBytes;   // Left in the region
+  size_t wanted;      // Bytes the kernel is after
+};
+
+// A shrinker gives memory back when asked: caches, buffers it can
+// rebuild. It runs on whichever task is allocating, outside the critical
+// section, and mustn't block. What it frees is measured, not reported.
+struct MemShrinker {
   bool inUse;
-  int handleId;  // NEW: For tracking during compaction
+  int ownerTaskId;      // -1 = the kernel's own
+  const char* name;
+  void (*shrink)(size_t wanted);
+  uint32_t calls;
+  uint32_t bytesReclaimed;
+};
+
+struct MemPressureStats {
+  uint32_t events[MEM_PRESSURE_LEVELS];  // By level; [0] unused
+  uint32_t messages;
+  uint32_t rescued;      // Failed allocations that succeeded after shrinking
+  uint32_t bytesReclaimed;
+};
+
+// Placement hints for malloc(). Each names the regions to try, in order;
+// regions the board doesn't have are skipped.
+enum MemHint {
+  MEM_ANY = 0,  // Internal RAM, then SDRAM, then tightly coupled RAM
+  MEM_FAST,     // Tightly coupled RAM, then internal RAM
+  MEM_BULK,     // SDRAM, then internal RAM
+  MEM_DMA       // Internal RAM, then SDRAM; never DTCM, which DMA can't reach
+};
+
+// What memRegionInfo() reports for a region
+struct MemRegionInfo {
+  const char* name;
+  size_t size;          // 0 = not present
+  size_t used;          // Allocated blocks, headers included
+  size_t peak;
+  size_t largestFree;
+  int fragmentation;    // Percent of the free space outside largestFree
+  uint32_t allocs;
+  uint32_t failures;
+  uint32_t spills;
+};
+
+struct CompactStats {
+  uint32_t passes;           // Sweeps that reached the end of the heap
+  uint32_t steps;
+  uint32_t blocksMoved;
+  uint32_t bytesMoved;
+  uint32_t pauseMaxMicros;   // Longest a step held the lock
+  uint64_t pauseTotalMicros;
+};
+
+// One traced call. A realloc from nullptr is an alloc, one to size 0 a free.
+enum MemTraceOp : uint8_t {
+  MEM_TRACE_ALLOC = 'a',
+  MEM_TRACE_FREE = 'f',
+  MEM_TRACE_REALLOC = 'r'
+};
+
+struct MemTraceEntry {
+  uint32_t micros;
+  uint32_t size;      // Requested
+  uintptr_t ptr;      // Returned, or freed; 0 if the allocation failed
+  uintptr_t aux;      // Alignment asked for (alloc), old pointer (realloc)
+  uintptr_t site;     // Return address in the caller
+  int16_t taskId;
+  uint8_t op;         // MemTraceOp
+  uint8_t hint;       // MemHint
+};
+
+struct ReallocStats {
+  uint32_t grownInPlace;   // Took free space just above the block
+  uint32_t shrunkInPlace;
+  uint32_t moved;          // Had to allocate, copy and free
+  uint32_t bytesCopied;
+};
+
+// Tail of an arena chunk, just past its sentinel. The chunk is laid out like
+// a small heap: blocks with the usual headers, closed by an in-use sentinel.
+struct ArenaChunk {
+  ArenaChunk* next;
+  ArenaChunk* prev;
+  MemoryBlock* first;  // Start of the chunk (its heap payload)
+};
+
+// What memUsage() reports for a task
+struct MemUsage {
+  size_t used;        // Task::memoryUsed
+  size_t peak;
+  size_t arenaBytes;  // Heap held by its arena, overhead included
+  int arenaChunks;
+};
+
+// Fixed-size object pool. Objects are carved from slabs (pinned heap
+// blocks) and chained on a free list through their first word, so alloc
+// and free are a pop and a push with no per-object header.
+struct MemPool {
+  bool inUse;
+  int ownerTaskId;
+  const char* name;
+  size_t objSize;        // Rounded up to MEM_ALIGN
+  int perSlab;
+  void* freeList;
+  void* slabs;           // Chained through each slab's first word
+  int slabCount;
+  uint32_t objectsInUse;
+  uint32_t peakInUse;
+  uint32_t allocs;
+  uint32_t failures;     // Allocs that found no room for another slab
+};
+
+// MemoryBlock::kind
+#define BLOCK_RAW    0  // Raw pointer from malloc(): never moved
+#define BLOCK_PINNED 1  // Never moved by compaction (task stacks)
+#define BLOCK_ARENA  2  // Lives inside its owner's arena chunk
+#define BLOCK_HANDLE 3  // Relocatable; tag is its MemHandle index
+
+// Relocatable allocation. The owner keeps the handle, not a pointer, and
+// derefs it for as long as it needs the address; compaction only moves
+// blocks whose handle isn't pinned and then updates ptr.
+struct MemHandle {
+  void* ptr;          // nullptr = free slot
+  int ownerTaskId;
+  uint8_t lockCount;  // Outstanding derefs
+  bool freeOnUnpin;   // Owner died while it was pinned
 };
 
 // ============================================================================
@@ -236,6 +855,26 @@ struct Semaphore {
   bool inUse;
   int ownerTaskId;
   const char* name;
+  int waitHead;  // Blocked tasks, highest priority first (FIFO on ties)
+};
+
+// ============================================================================
+// IPC - Mutexes
+// ============================================================================
+
+// Owned, recursive lock. While tasks wait on it the holder runs at the
+// priority of the most urgent waiter (transitively, through chains of
+// holders that are themselves blocked on mutexes).
+struct Mutex {
+  bool inUse;
+  int ownerTaskId;   // Creator, may destroy it
+  const char* name;
+  int holderTaskId;  // -1 = unlocked
+  int lockCount;     // Recursive depth
+  int nextHeld;      // Next mutex held by the same task, -1 = last
+  int waitHead;      // Blocked tasks, highest priority first (FIFO on ties)
+  uint32_t contentions;     // Locks that had to block
+  uint32_t blockMaxMicros;  // Longest wait that ended in acquiring it
 };
 
 // ============================================================================
@@ -281,6 +920,60 @@ struct SPITransaction {
   uint32_t frequency;
 };
 
+// ============================================================================
+// COROUTINE TASKS
+// ============================================================================
+
+#ifdef KERNEL_COROUTINES
+/*
+ * Return type for coroutine task bodies. The frame is allocated from the
+ * kernel heap when the coroutine is called, and it does not start running
+ * until it is handed to Kernel::createTask() and picked by the scheduler:
+ *
+ *   CoroutineTask blink() {
+ *     while (true) {
+ *       OS::digitalWrite(LED_BUILTIN, HIGH);
+ *       co_await OS::sleep(500);
+ *       OS::digitalWrite(LED_BUILTIN, LOW);
+ *       co_await OS::sleep(500);
+ *     }
+ *   }
+ *   Kernel::createTask("blink", blink());
+ */
+struct CoroutineTask {
+  struct promise_type {
+    CoroutineTask get_return_object() {
+      return CoroutineTask(std::coroutine_handle<promise_type>::from_promise(*this).address());
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception();
+    
+    static void* operator new(size_t size) noexcept;
+    static void operator delete(void* frame);
+    static CoroutineTask get_return_object_on_allocation_failure() {
+      return CoroutineTask(nullptr);
+    }
+  };
+  
+  explicit CoroutineTask(void* frame) : frame(frame) {}
+  CoroutineTask(CoroutineTask&& other) : frame(other.frame) { other.frame = nullptr; }
+  CoroutineTask(const CoroutineTask&) = delete;
+  ~CoroutineTask() {
+    if (frame) std::coroutine_handle<>::from_address(frame).destroy();
+  }
+  
+  void* release() {
+    void* f = frame;
+    frame = nullptr;
+    return f;
+  }
+  
+  void* frame;
+};
+#endif
+
 // ============================================================================
 // KERNEL CLASS
 // ============================================================================
@@ -288,22 +981,56 @@ struct SPITransaction {
 class Kernel {
 private:
   // Task management
-  static Task tasks[MAX_TASKS];
-  static int currentTaskId;
-  static int nextTaskId;
+  static TaskTable tasks;
+  static Task firstTaskChunk[TASK_POOL_CHUNK];  // Idle and the first tasks
+  static TaskCold firstColdChunk[TASK_POOL_CHUNK];
+  static TaskHotTable taskHot;
+  static int taskSlots;      // Slots backed by a chunk so far
+  static int taskFreeHead;   // Free slots, linked through readyNext
+  static int currentTaskIds[KERNEL_MAX_CORES];
+  static RunQueue runQueues[KERNEL_MAX_CORES];
+  static Task coreIdle[KERNEL_MAX_CORES];  // Idle (loop()) context per core
+  static SchedulerStats schedStats;
+  
+  // Sleep queue: binary min-heap of task IDs ordered by sleepUntil
+  static int sleepHeap[MAX_TASKS];
+  static int sleepHeapSize;
+  static uint32_t tickLastMillis;
+  static uint32_t tickEpoch;
   
   // Memory management
   static uint8_t kernelHeap[KERNEL_HEAP_SIZE];
-  static size_t heapUsed;
+  static HeapControl heaps[MEM_REGION_COUNT];
+  static MemoryBlock* compactCursor;  // Where the current sweep resumes, nullptr = none
+  static int compactRegion;           // Region the current sweep is in
+  static CompactStats compactStats;
+  static ReallocStats reallocStats;
+#if KERNEL_MEM_TRACE
+  static MemTraceEntry memTrace[KERNEL_MEM_TRACE];
+  static uint32_t memTraceTotal;      // Ever recorded; the ring holds the last ones
+#endif
   
   // File system
   static FileHandle fileHandles[MAX_FILE_HANDLES];
   static DirHandle dirHandles[MAX_DIR_HANDLES];
   static bool sdInitialized;
+  static uint8_t* spiBounce;   // DMA-safe, KERNEL_SPI_BOUNCE_SIZE bytes
+  static bool spiBounceBusy;
   
   // IPC (NEW)
-  static MessageQueue messageQueues[MAX_TASKS];
   static Semaphore semaphores[MAX_SEMAPHORES];
+  static Mutex mutexes[MAX_MUTEXES];
+  
+  // Relocatable heap blocks
+  static MemHandle memHandles[MAX_MEM_HANDLES];
+  static MemPool memPools[MAX_MEM_POOLS];
+  static int mailboxPool;
+  static MemShrinker memShrinkers[MAX_MEM_SHRINKERS];
+  static MemPressureStats pressureStats;
+  static uint8_t lowWatermark;
+  static uint8_t minWatermark;
+  static bool shrinking;  // Someone is running the shrinkers
+  static bool pressureSending;  // Someone is sending pressure messages
   
   // Watchdog (NEW)
   static bool watchdogEnabled;
@@ -315,18 +1042,146 @@ private:
   
   // Private methods
   static Task* getCurrentTask();
+  static int runningTaskId();
   static Task* getTask(int taskId);
   static int allocateTaskId();
+  static void initTaskSlot(Task* task);
+  static TaskCold* coldOf(Task* task) { return &tasks.cold(task->id); }
+  static bool hasPermission(Task* task, uint8_t permission) {
+    return coldOf(task)->permissions & permission;
+  }
+  static bool growTaskPool();
+  static void releaseTaskSlot(Task* task);
+  static int taskIdOf(Task* task);
   static int allocateFileHandle();
   static int allocateDirHandle();
   static void freeFileHandle(int handle);
   static void freeDirHandle(int handle);
   
+  // Run queue internals
+  static void readyEnqueue(Task* task);
+  static void readyRemove(Task* task);
+  static int readyHighestPriority(int core);
+  static int readyPop(int core, int priority);
+  static int readyTargetCore(Task* task);
+  static int stealTask(int core);
+  static bool earlierDeadlineReady(Task* current);
+  static bool quantumExpired(Task* task);
+  static void initCycleCounter();
+  static void histRecord(uint16_t* hist, uint32_t value);
+  static void noteWakeToRun(Task* task, uint32_t now);
+  static void noteRunSlice(Task* task, uint32_t start, uint32_t now);
+  
+  // Sleep queue internals
+  static void sleepQueueInsert(Task* task);
+  static void sleepQueueRemove(Task* task);
+  static void sleepHeapSwap(int a, int b);
+  static void sleepHeapSiftUp(int index);
+  static void sleepHeapSiftDown(int index);
+  static void wakeExpiredSleepers(uint64_t now);
+  static uint64_t nextWakeupTick();
+  
+  // Dispatch
+  static int pickNextTask();
+  static void switchTo(int taskId);
+  static void dispatch();
+  static uint32_t switchStartCycles;
+  static int zombieCount;
+  static IdleStats idleStats;
+  
+  // CPU load sampling
+  static uint32_t loadSampleMillis;
+  static uint32_t loadSampleCycles;
+  static uint16_t systemLoad;  // Per mille of all cores, moving average
+  static void updateLoad();
+  
+  // Port layer: critical sections and context switching
+  static void portInit();
+  static void portCoreInit();
+  static void portKickCore(int core);
+  static uint32_t portEnterCritical();
+  static void portExitCritical(uint32_t state);
+  static void portIdleWait(uint32_t ms);
+#ifdef KERNEL_STACKFUL_TASKS
+  static bool portInitStack(Task* task);
+  static void portSwitch(Task* from, Task* to);
+  static void taskTrampoline();
+  static void noteSwitchComplete();
+  static void reapZombies();
+#endif
+  
+  // Periodic real-time tasks
+  static bool admitPeriodicTask(uint32_t period, uint32_t deadline, uint32_t wcet);
+  static int realtimePriority(Task* task);
+  static void realtimeReprioritize();
+  static void periodicJobStart(Task* task);
+  static void periodicJobDone(Task* task);
+  
+  // Task setup and coroutine execution
+  static int setupTask(const char* name, void (*entryPoint)(), void* coroutine,
+                       uint32_t period = 0, uint32_t deadline = 0, uint32_t wcet = 0);
+  static Task* contextOf(Task* task);
+  static bool canBlock(Task* task);
+  static void blockCurrentTask(uint8_t kind, int object, int* queueHead, uint32_t timeoutMs);
+  static int blockedResult(Task* task);
+  static void waitQueueInsert(int* queueHead, Task* task);
+  static void waitQueueRemove(int* queueHead, Task* task);
+  static int* waitQueueOf(Task* task);
+  static void wakeWaiter(Task* task, int result);
+#ifdef KERNEL_COROUTINES
+  static void runCoroutine(Task* task);
+#endif
+  static uint32_t readCycleCounter();
+  
   // Memory management internals
-  static void* allocateMemoryInternal(size_t size, int taskId);
+  static void* allocateMemoryInternal(size_t size, int taskId, MemHint hint = MEM_ANY,
+                                      size_t align = MEM_ALIGN);
   static void freeMemoryInternal(void* ptr);
-  static void compactMemory();
+  static void compactMemory(int region);
   static MemoryBlock* getBlockHeader(void* ptr);
+  static MemoryBlock* nextBlock(MemoryBlock* block);
+  static int blockOwner(MemoryBlock* block);
+  static void heapInit();
+  static void heapInitRegion(int region, const char* name, uint8_t* base, size_t size);
+  static int regionOf(void* ptr);
+  static bool isDmaSafe(const void* ptr, size_t size);
+  static void* taskAlloc(size_t size, MemHint hint, size_t align);
+#if KERNEL_MEM_TRACE
+  static void memTraceRecord(uint8_t op, void* ptr, size_t size, uintptr_t aux,
+                             uint8_t hint, void* site);
+#endif
+  static void heapInsertFree(HeapControl* h, MemoryBlock* block);
+  static void heapRemoveFree(HeapControl* h, MemoryBlock* block);
+  static MemoryBlock* heapTakeFree(HeapControl* h, size_t size);
+  static void heapSplit(HeapControl* h, MemoryBlock* block, size_t size);
+  static MemoryBlock* heapMergeFree(HeapControl* h, MemoryBlock* block);
+  static bool heapResize(HeapControl* h, MemoryBlock* block, size_t size);
+  static size_t heapLargestFree(HeapControl* h);
+  static int heapFragmentation(int region);
+  static bool compactStep(size_t budget);
+  static bool compactDue();
+  static int poolCreateInternal(size_t objSize, int perSlab, int ownerTaskId, const char* name);
+  static bool poolGrow(MemPool* pool);
+  static void poolRelease(int poolId);
+  static bool poolOwns(MemPool* pool, void* ptr);
+  static int poolFreeInternal(int poolId, void* ptr);
+  static size_t poolTrim(MemPool* pool);
+  static void poolShrinker(size_t wanted);
+  static int shrinkerAddInternal(const char* name, void (*shrink)(size_t), int ownerTaskId);
+  static int regionPressure(HeapControl* h);
+  static void pressureMessage(int level, int region, size_t wanted);
+  static size_t memShrink(int region, size_t wanted);
+  static int ipcDeliver(int toTaskId, int fromTaskId, const void* data, size_t length);
+  static int mailboxTake(Task* task, void* buffer, size_t maxLength, int* fromTaskId);
+  static int mailboxCreate(Task* task, int taskId);
+  static void arenaInsertFree(Task* task, MemoryBlock* block);
+  static void arenaRemoveFree(Task* task, MemoryBlock* block);
+  static MemoryBlock* arenaGrow(Task* task, size_t size, MemHint hint);
+  static void arenaSplit(Task* task, MemoryBlock* block, size_t size);
+  static bool arenaResize(MemoryBlock* block, size_t size);
+  static void* arenaAlloc(Task* task, size_t size, MemHint hint, size_t align = MEM_ALIGN);
+  static void arenaFreeBlock(MemoryBlock* block);
+  static void arenaRelease(Task* task);
   
   // Watchdog (NEW)
   static void checkWatchdog();
@@ -337,6 +1192,13 @@ private:
   
   // IPC internals (NEW)
   static int allocateSemaphore();
+  static int semTryTake(int semId);
+  static int ipcTryReceive(void* buffer, size_t maxLength, int* fromTaskId);
+  static int allocateMutex();
+  static int mutexTryLock(int mutexId, Task* task);
+  static void mutexRelease(int mutexId);
+  static void mutexInherit(int mutexId);
+  static void refreshPriority(Task* task);
   
 public:
   // Initialization
@@ -345,11 +1207,40 @@ public:
   
   // Task scheduling
   static int createTask(const char* name, void (*entryPoint)());
+#ifdef KERNEL_COROUTINES
+  static int createTask(const char* name, CoroutineTask task);
+#endif
+  // Runs job() once per release, every periodMs; each job should finish
+  // within deadlineMs of its release and takes at most wcetMs of CPU
+  static int createPeriodicTask(const char* name, void (*job)(), uint32_t periodMs,
+                                uint32_t deadlineMs, uint32_t wcetMs);
   static void killTask(int taskId);
+  static int setTaskAffinity(int taskId, uint32_t coreMask);
+  static int nextTask(int taskId);  // Iterate live tasks: -1 starts, -1 ends
   static void schedule();
+  static void idle();   // Sleep the CPU until the next wakeup or interrupt
   static void yield();
+  static bool yieldIfNeeded();  // Yield only if someone should run instead
   static void sleep(uint32_t ms);
   
+  // Coroutine support (used by CoroutineTask and OS::Wait)
+  static void* coroutineFrameAlloc(size_t size);
+  static void coroutineFrameFree(void* frame);
+  static bool mustSuspend();
+  static int waitResult(int result);
+  
+  // Multi-core: secondary cores call coreInit() once, then loop on
+  // schedule()/idle() exactly like loop() does on core 0
+  static void coreInit();
+  static int currentCore();
+  
+  // Port hooks, called from timer/PendSV interrupt handlers
+  static void tick();
+  static void tickPreempt(int core);
+#ifdef KERNEL_PORT_CORTEXM
+  static void* portSwitchStack(void* sp);
+#endif
+  
   // Watchdog (NEW)
   static void enableWatchdog(bool enable);
   static void feedWatchdog();
@@ -376,10 +1267,39 @@ public:
   static void dirRewind(int handle);
   
   // Memory operations
-  static void* memAlloc(size_t size);
+  static void* memAlloc(size_t size, MemHint hint = MEM_ANY);
   static void memFree(void* ptr);
+  static void* memRealloc(void* ptr, size_t size);
+  static void* memAllocAligned(size_t size, size_t align, MemHint hint = MEM_ANY);
+  static void* memAllocDma(size_t size);
+  static void dmaClean(const void* ptr, size_t size);
+  static void dmaInvalidate(void* ptr, size_t size);
   static size_t memAvailable();
   static void memCompact();
+  static bool memCompactIdle();  // One idle slice's compaction step, if due
+  static int memCompactInfo(CompactStats* out);
+  static int memTraceDump(const char* path);
+  
+  // Relocatable blocks: memDeref pins the block and returns its address
+  // until the matching memUnpin; unpinned blocks may move on compaction
+  static int memHandleAlloc(size_t size);
+  static int memHandleFree(int handle);
+  static void* memDeref(int handle);
+  static int memUnpin(int handle);
+  static int memUsage(int taskId, MemUsage* out);
+  static int memRegionInfo(int region, MemRegionInfo* out);
+  
+  // Fixed-size object pools
+  static int poolCreate(size_t objSize, int count, const char* name = nullptr);
+  static void* poolAlloc(int poolId);
+  static int poolFree(int poolId, void* ptr);
+  static int poolDestroy(int poolId);
+  
+  // Memory pressure
+  static int memShrinkerAdd(const char* name, void (*shrink)(size_t wanted));
+  static int memShrinkerRemove(int shrinkerId);
+  static int memPressureNotify(bool enable);
+  static int memSetWatermarks(int lowPercent, int minPercent);
   
   // IPC operations (NEW)
   static int ipcSend(int toTaskId, const void* data, size_t length);
@@ -392,6 +1312,12 @@ public:
   static int semPost(int semId);
   static int semDestroy(int semId);
   
+  // Mutex operations (priority inheritance, recursive)
+  static int mutexCreate(const char* name = nullptr);
+  static int mutexLock(int mutexId, uint32_t timeoutMs = 0);
+  static int mutexUnlock(int mutexId);
+  static int mutexDestroy(int mutexId);
+  
   // GPIO operations (NEW)
   static int gpioSetMode(int pin, int mode);
   static int gpioWrite(int pin, int value);
@@ -414,16 +1340,50 @@ public:
   static void print(const char* message);
   static void debug(const char* message);
   static uint32_t uptime();
+  static uint64_t ticks();  // Monotonic milliseconds, does not wrap
   static int getCurrentTaskId();
   static void printTaskList();
   static void printMemoryInfo();
+  static void printTop();
+  
+  // Scheduler histograms (SYS_SCHED_HIST)
+  static int getSchedHistogram(int taskId, SchedHistogram* out);
+  static void resetSchedHistograms();
 };
 
 // ============================================================================
 // GLOBAL SYSCALL INTERFACE (for applications)
 // ============================================================================
 
+#ifdef KERNEL_COROUTINES
+inline void CoroutineTask::promise_type::unhandled_exception() {
+  Kernel::panic("Unhandled exception in coroutine task");
+}
+
+inline void* CoroutineTask::promise_type::operator new(size_t size) noexcept {
+  return Kernel::coroutineFrameAlloc(size);
+}
+
+inline void CoroutineTask::promise_type::operator delete(void* frame) {
+  Kernel::coroutineFrameFree(frame);
+}
+#endif
+
 namespace OS {
+  /*
+   * Result of a call that may have to wait. Plain tasks have already waited
+   * by the time it comes back and just use it as an int; coroutine tasks
+   * co_await it, which suspends them until the kernel can complete the call.
+   */
+  struct Wait {
+    int result;
+    
+    operator int() const { return result; }
+    bool await_ready() const { return !Kernel::mustSuspend(); }
+    template <typename Handle> bool await_suspend(Handle) const { return true; }
+    int await_resume() const { return Kernel::waitResult(result); }
+  };
+  
   // File operations (backward compatible)
   inline int open(const char* path, bool write = false) {
     return Kernel::fileOpen(path, write);
@@ -479,25 +1439,135 @@ namespace OS {
   }
   
   // Memory operations (backward compatible)
-  inline void* malloc(size_t size) {
-    return Kernel::memAlloc(size);
+  inline void* malloc(size_t size, MemHint hint = MEM_ANY) {
+    return Kernel::memAlloc(size, hint);
   }
   
   inline void free(void* ptr) {
     Kernel::memFree(ptr);
   }
   
+  // Grows or shrinks in place when it can, otherwise moves the data to a
+  // new block in the same region. nullptr = out of memory, ptr untouched.
+  inline void* realloc(void* ptr, size_t size) {
+    return Kernel::memRealloc(ptr, size);
+  }
+  
+  // align is a power of two; the size is padded to a multiple of it.
+  // realloc() keeps the data but not the alignment if the block moves.
+  inline void* mallocAligned(size_t size, size_t align) {
+    return Kernel::memAllocAligned(size, align);
+  }
+  
+  // Whole D-cache lines in memory DMA can reach. Clean before DMA reads
+  // the buffer, invalidate before the CPU reads what DMA wrote.
+  inline void* mallocDma(size_t size) {
+    return Kernel::memAllocDma(size);
+  }
+  
+  inline void dmaClean(const void* ptr, size_t size) {
+    Kernel::dmaClean(ptr, size);
+  }
+  
+  inline void dmaInvalidate(void* ptr, size_t size) {
+    Kernel::dmaInvalidate(ptr, size);
+  }
+  
   inline void compact() {
     Kernel::memCompact();
   }
   
+  inline int compactInfo(CompactStats* out) {
+    return Kernel::memCompactInfo(out);
+  }
+  
+  // Write the malloc trace as CSV; entries written, or an error code
+  // (SYS_ERR_INVALID_CALL when built without KERNEL_MEM_TRACE)
+  inline int memTraceDump(const char* path) {
+    return Kernel::memTraceDump(path);
+  }
+  
+  // Relocatable memory: hold the handle, deref() it to get a pointer that
+  // stays put until the matching unpin()
+  inline int halloc(size_t size) {
+    return Kernel::memHandleAlloc(size);
+  }
+  
+  // SYS_ERR_BUSY while a deref hasn't been unpinned
+  inline int hfree(int handle) {
+    return Kernel::memHandleFree(handle);
+  }
+  
+  inline void* deref(int handle) {
+    return Kernel::memDeref(handle);
+  }
+  
+  inline int unpin(int handle) {
+    return Kernel::memUnpin(handle);
+  }
+  
+  inline int memUsage(int taskId, MemUsage* out) {
+    return Kernel::memUsage(taskId, out);
+  }
+  
+  inline int memRegionInfo(int region, MemRegionInfo* out) {
+    return Kernel::memRegionInfo(region, out);
+  }
+  
+  // Pools of fixed-size objects: count objects up front, more on demand
+  inline int poolCreate(size_t objSize, int count, const char* name = nullptr) {
+    return Kernel::poolCreate(objSize, count, name);
+  }
+  
+  inline void* poolAlloc(int poolId) {
+    return Kernel::poolAlloc(poolId);
+  }
+  
+  // SYS_ERR_INVALID_PARAM if ptr isn't an object from this pool
+  inline int poolFree(int poolId, void* ptr) {
+    return Kernel::poolFree(poolId, ptr);
+  }
+  
+  inline int poolDestroy(int poolId) {
+    return Kernel::poolDestroy(poolId);
+  }
+  
+  // Called with the bytes wanted when memory runs short; free what you can
+  inline int addShrinker(const char* name, void (*shrink)(size_t wanted)) {
+    return Kernel::memShrinkerAdd(name, shrink);
+  }
+  
+  inline int removeShrinker(int shrinkerId) {
+    return Kernel::memShrinkerRemove(shrinkerId);
+  }
+  
+  // Get a MemPressureMsg (from IPC_FROM_KERNEL) each time a region's free
+  // space falls to a lower watermark. Signing up takes the mailbox they
+  // arrive in; they're dropped while it's full
+  inline int memPressureNotify(bool enable) {
+    return Kernel::memPressureNotify(enable);
+  }
+  
+  inline int setWatermarks(int lowPercent, int minPercent) {
+    return Kernel::memSetWatermarks(lowPercent, minPercent);
+  }
+  
   // Task operations (backward compatible)
-  inline void yield() {
+  inline Wait yield() {
     Kernel::yield();
+    return Wait{SYS_OK};
   }
   
-  inline void sleep(uint32_t ms) {
+  // For long loops in plain tasks: yields when a more important task is
+  // ready, or when the quantum is used up and a peer is waiting. Returns
+  // whether it yielded. Coroutines should co_await OS::yield() instead.
+  inline bool yieldIfNeeded() {
+    return Kernel::yieldIfNeeded();
+  }
+  
+  inline Wait sleep(uint32_t ms) {
     Kernel::sleep(ms);
+    return Wait{SYS_OK};
   }
   
   inline int getpid() {
@@ -509,8 +1579,10 @@ namespace OS {
     return Kernel::ipcSend(toTaskId, data, length);
   }
   
-  inline int receive(void* buffer, size_t maxLength, int* fromTaskId = nullptr) {
-    return Kernel::ipcReceive(buffer, maxLength, fromTaskId);
+  // Plain tasks get SYS_ERR_WOULD_BLOCK on an empty queue; coroutine tasks
+  // that co_await this wait for a message instead
+  inline Wait receive(void* buffer, size_t maxLength, int* fromTaskId = nullptr) {
+    return Wait{Kernel::ipcReceive(buffer, maxLength, fromTaskId)};
   }
   
   inline int poll() {
@@ -522,8 +1594,8 @@ namespace OS {
     return Kernel::semCreate(initialValue, maxValue, name);
   }
   
-  inline int semWait(int semId, uint32_t timeoutMs = 0) {
-    return Kernel::semWait(semId, timeoutMs);
+  inline Wait semWait(int semId, uint32_t timeoutMs = 0) {
+    return Wait{Kernel::semWait(semId, timeoutMs)};
   }
   
   inline int semPost(int semId) {
@@ -534,6 +1606,23 @@ namespace OS {
     return Kernel::semDestroy(semId);
   }
   
+  // Mutex operations
+  inline int mutexCreate(const char* name = nullptr) {
+    return Kernel::mutexCreate(name);
+  }
+  
+  inline Wait mutexLock(int mutexId, uint32_t timeoutMs = 0) {
+    return Wait{Kernel::mutexLock(mutexId, timeoutMs)};
+  }
+  
+  inline int mutexUnlock(int mutexId) {
+    return Kernel::mutexUnlock(mutexId);
+  }
+  
+  inline int mutexDestroy(int mutexId) {
+    return Kernel::mutexDestroy(mutexId);
+  }
+  
   // GPIO operations (NEW)
   inline int pinMode(int pin, int mode) {
     return Kernel::gpioSetMode(pin, mode);
@@ -597,6 +1686,14 @@ namespace OS {
   inline uint32_t uptime() {
     return Kernel::uptime();
   }
+  
+  inline int nextTask(int taskId) {
+    return Kernel::nextTask(taskId);
+  }
+  
+  inline int schedHistogram(int taskId, SchedHistogram* out) {
+    return Kernel::getSchedHistogram(taskId, out);
+  }
 }
 
 #endif // KERNEL_H
@@ -54,7 +54,7 @@ void shellTask() {
       }
     }
     
-    OS::yield(); // Give other tasks a chance
+    OS::sleep(10); // Poll input at 100 Hz so the CPU can idle in between
   }
   
   // Never reached, but good practice
@@ -163,8 +163,14 @@ void processCommand(const char* cmdLine, char* currentDir) {
     Kernel::printMemoryInfo();
   } else if (strcmp(cmd, "compact") == 0) {
     cmdCompact();
+  } else if (strcmp(cmd, "memtrace") == 0) {
+    cmdMemtrace(args, currentDir);
   } else if (strcmp(cmd, "uptime") == 0) {
     cmdUptime();
+  } else if (strcmp(cmd, "top") == 0) {
+    cmdTop();
+  } else if (strcmp(cmd, "sched") == 0) {
+    cmdSched(args);
   } else if (strcmp(cmd, "clear") == 0) {
   cmdClear();
   } else if (strcmp(cmd, "edit") == 0) {
@@ -200,7 +206,10 @@ void cmdHelp() {
   Serial.println(F("  meminfo             - Memory info"));
   Serial.println(F("  hwinfo              - Hardware Info"));
   Serial.println(F("  compact             - Compact memory"));
+  Serial.println(F("  memtrace [file]     - Save the malloc trace"));
   Serial.println(F("  uptime              - System uptime"));
+  Serial.println(F("  top                 - Live CPU usage (any key stops)"));
+  Serial.println(F("  sched [reset]       - Scheduler latency histograms"));
   Serial.println(F("  clear               - Clear screen"));
   Serial.println(F("  help                - Show this help\n"));
 }
@@ -424,6 +433,22 @@ void cmdCompact() {
   Serial.println(F("Done"));
 }
 
+void cmdMemtrace(const char* args, const char* currentDir) {
+  char filepath[128];
+  resolvePath(args[0] ? args : "memtrace.csv", currentDir, filepath, sizeof(filepath));
+  
+  int written = OS::memTraceDump(filepath);
+  if (written == SYS_ERR_INVALID_CALL) {
+    Serial.println(F("Error: Built without KERNEL_MEM_TRACE"));
+  } else if (written < 0) {
+    Serial.println(F("Error: Cannot write trace"));
+  } else {
+    Serial.print(written);
+    Serial.print(F(" entries written to "));
+    Serial.println(filepath);
+  }
+}
+
 void cmdUptime() {
   uint32_t up = OS::uptime();
   uint32_t seconds = up / 1000;
@@ -439,6 +464,68 @@ void cmdUptime() {
   Serial.println(F("s"));
 }
 
+// Redraw CPU usage once a second until a key is pressed. Between refreshes
+// the shell sleeps, so it barely shows up in its own numbers.
+void cmdTop() {
+#ifndef KERNEL_STACKFUL_TASKS
+  // Cooperative builds never leave this task for schedule(), so sleep()
+  // returns at once and the load figures would never update
+  Serial.println(F("top needs a preemptive build (Cortex-M or host port)"));
+#else
+  while (true) {
+    Kernel::printTop();
+    Serial.println(F("(press any key to stop)"));
+    
+    for (int i = 0; i < 10; i++) {
+      OS::sleep(100);
+      if (Serial.available() > 0) {
+        while (Serial.available() > 0) {
+          Serial.read();
+        }
+        return;
+      }
+    }
+  }
+#endif
+}
+
+// One histogram as "<bound:count" pairs, skipping empty buckets
+void printHistogram(const char* label, const uint16_t* hist) {
+  Serial.print(label);
+  for (int i = 0; i < SCHED_HIST_BUCKETS; i++) {
+    if (hist[i] == 0) continue;
+    Serial.print(i == SCHED_HIST_BUCKETS - 1 ? F(" >=") : F(" <"));
+    Serial.print(1UL << (i == SCHED_HIST_BUCKETS - 1 ? i - 1 : i));
+    Serial.print(F(":"));
+    Serial.print(hist[i]);
+  }
+  Serial.println();
+}
+
+void cmdSched(const char* args) {
+  if (strcmp(args, "reset") == 0) {
+    Kernel::resetSchedHistograms();
+    Serial.println(F("Histograms cleared"));
+    return;
+  }
+  
+  Serial.println(F("\nTask latency histograms (" KERNEL_CYCLE_UNIT ", bucket upper bound:count)"));
+  SchedHistogram hist;
+  bool any = false;
+  for (int id = OS::nextTask(-1); id >= 0; id = OS::nextTask(id)) {
+    if (OS::schedHistogram(id, &hist) != SYS_OK) continue;
+    any = true;
+    Serial.print(F("Task "));
+    Serial.println(id);
+    printHistogram("  wake-to-run:", hist.wakeToRun);
+    printHistogram("  run slice:  ", hist.runSlice);
+  }
+  if (!any) {
+    Serial.println(F("No histograms (disabled, or no tasks)"));
+  }
+  Serial.println();
+}
+
 void cmdClear() {
   for (int i = 0; i < 50; i++) {
     Serial.println();
@@ -543,6 +630,24 @@ void cmdGrep(const char* fullCmd, const char* currentDir) {
   OS::close(fd);
 }
 
+// Copy what's left of one open file into another. The buffer is a whole
+// SD sector of DMA-safe memory, so the card driver can transfer straight
+// into it; a small stack buffer does if there's no memory for that.
+void copyFileData(int fdSrc, int fdDst) {
+  char stackBuffer[128];
+  char* buffer = (char*)OS::mallocDma(512);
+  int size = buffer ? 512 : sizeof(stackBuffer);
+  if (!buffer) buffer = stackBuffer;
+  
+  int bytesRead;
+  while ((bytesRead = OS::read(fdSrc, buffer, size)) > 0) {
+    OS::write(fdDst, buffer, bytesRead);
+    OS::yieldIfNeeded(); // Only when another task is owed the CPU
+  }
+  
+  if (buffer != stackBuffer) OS::free(buffer);
+}
+
 void cmdMv(const char* args, const char* currentDir) {
   // Parse: mv <src> <dst>
   char src[64] = {0};
@@ -606,13 +711,7 @@ void cmdMv(const char* args, const char* currentDir) {
     return;
   }
   
-  // Copy data
-  char buffer[128];
-  int bytesRead;
-  while ((bytesRead = OS::read(fdSrc, buffer, sizeof(buffer))) > 0) {
-    OS::write(fdDst, buffer, bytesRead);
-    OS::yield(); // Yield during long operation
-  }
+  copyFileData(fdSrc, fdDst);
   
   OS::close(fdSrc);
   OS::close(fdDst);
@@ -689,13 +788,7 @@ void cmdCp(const char* args, const char* currentDir) {
     return;
   }
   
-  // Copy data
-  char buffer[128];
-  int bytesRead;
-  while ((bytesRead = OS::read(fdSrc, buffer, sizeof(buffer))) > 0) {
-    OS::write(fdDst, buffer, bytesRead);
-    OS::yield(); // Yield during long operation
-  }
+  copyFileData(fdSrc, fdDst);
   
   OS::close(fdSrc);
   OS::close(fdDst);
@@ -713,15 +806,34 @@ void cmdCp(const char* args, const char* currentDir) {
   Add this function with the other cmd* functions in your shell
 */
 
+#define MAX_LINES 200
+#define EDIT_GROW_LINES 16
+
+// Make room for count lines in an editor buffer, growing it a step at a
+// time with OS::realloc (in place while the space above it is free)
+bool editReserve(char (**buf)[128], int* capacity, int count) {
+  if (count <= *capacity) return true;
+  if (count > MAX_LINES) return false;
+  int grown = *capacity + EDIT_GROW_LINES;
+  if (grown < count) grown = count;
+  if (grown > MAX_LINES) grown = MAX_LINES;
+  void* p = OS::realloc(*buf, grown * 128);
+  if (!p) return false;
+  *buf = (char (*)[128])p;
+  *capacity = grown;
+  return true;
+}
+
 void cmdEdit(const char* filename, const char* currentDir) {
   if (filename[0] == '\0') {
     Serial.println(F("Usage: edit <filename>"));
     return;
   }
   
-  // Allocate editor buffer on heap instead of stack
-  #define MAX_LINES 200
-  char (*lines)[128] = (char (*)[128])OS::malloc(MAX_LINES * 128);
+  // Allocate editor buffer on heap instead of stack, in bulk memory where
+  // the board has some. It starts small and grows with the file.
+  int capacity = EDIT_GROW_LINES;
+  char (*lines)[128] = (char (*)[128])OS::malloc(capacity * 128, MEM_BULK);
   if (!lines) {
     Serial.println(F("Error: Out of memory"));
     return;
@@ -746,7 +858,7 @@ void cmdEdit(const char* filename, const char* currentDir) {
         char c = buffer[i];
         if (c == '\n' || c == '\r') {
           if (linePos > 0 || c == '\n') {
-            if (lineCount >= MAX_LINES) {
+            if (!editReserve(&lines, &capacity, lineCount + 1)) {
               Serial.println(F("Warning: File too large, truncated"));
               break;
             }
@@ -761,7 +873,7 @@ void cmdEdit(const char* filename, const char* currentDir) {
       OS::yield();
     }
     
-    if (linePos > 0 && lineCount < MAX_LINES) {
+    if (linePos > 0 && editReserve(&lines, &capacity, lineCount + 1)) {
       currentLine[linePos] = '\0';
       strcpy(lines[lineCount++], currentLine);
     }
@@ -899,7 +1011,7 @@ process_command:
         }
 append_line:
         if (strcmp(line, ".") == 0) break;
-        if (lineCount >= MAX_LINES) {
+        if (!editReserve(&lines, &capacity, lineCount + 1)) {
           Serial.println(F("Error: Editor buffer full"));
           break;
         }
@@ -916,7 +1028,8 @@ append_line:
         Serial.println(F("Insert mode (type '.' alone to end):"));
         
         // Allocate temp buffer for new lines
-        char (*newLines)[128] = (char (*)[128])OS::malloc(MAX_LINES * 128);
+        int newCapacity = EDIT_GROW_LINES;
+        char (*newLines)[128] = (char (*)[128])OS::malloc(newCapacity * 128, MEM_BULK);
         if (!newLines) {
           Serial.println(F("Error: Out of memory"));
         } else {
@@ -951,14 +1064,14 @@ append_line:
             }
 insert_line:
             if (strcmp(line, ".") == 0) break;
-            if (newCount >= MAX_LINES) {
+            if (!editReserve(&newLines, &newCapacity, newCount + 1)) {
               Serial.println(F("Error: Too many lines"));
               break;
             }
             strcpy(newLines[newCount++], line);
           }
           
-          if (newCount > 0 && lineCount + newCount <= MAX_LINES) {
+          if (newCount > 0 && editReserve(&lines, &capacity, lineCount + newCount)) {
             for (int i = lineCount - 1; i >= beforeLine - 1; i--) {
               strcpy(lines[i + newCount], lines[i]);
             }
@@ -1119,13 +1232,30 @@ void setup() {
     Kernel::panic("Failed to create shell task");
   }
   
+#if KERNEL_MAX_CORES > 1
+  // SD and Serial drivers aren't shared between cores; keep the shell on core 0
+  Kernel::setTaskAffinity(shellTaskId, 1UL << 0);
+#endif
+  
   Serial.println(F("Shell ready. Type 'help' for commands.\n"));
 }
 
 void loop() {
   Kernel::schedule();
-  delay(1);
+  Kernel::idle();
+}
+
+#if KERNEL_MAX_CORES > 1 && defined(ARDUINO_ARCH_RP2040)
+// Core 1 joins the scheduler as soon as core 0 has finished Kernel::init()
+void setup1() {
+  Kernel::coreInit();
+}
+
+void loop1() {
+  Kernel::schedule();
+  Kernel::idle();
 }
+#endif
 
 // ============================================================================
 // EXAMPLE USAGE
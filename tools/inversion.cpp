@@ -0,0 +1,112 @@
+/*
+  inversion - The classic priority-inversion setup on a Linux host: checks
+  that priority inheritance keeps a high-priority task's wait for a mutex
+  down to the low-priority holder's critical section
+
+  Build against the kernel's host port like memreplay, with the Arduino
+  API stand-ins on the include path:
+
+    g++ -std=c++17 -O2 -I<stand-ins> -I.. inversion.cpp ../kernel.cpp <stand-ins>.cpp
+    ./a.out [seconds]
+
+  low is a plain task that holds the mutex for LOW_HOLD_MS at a time.
+  high and medium are periodic, so rate-monotonic ranks put them above
+  low and high above medium. high takes the mutex on every release;
+  medium just burns MEDIUM_BURN_MS of CPU. Without inheritance, medium
+  preempting low while high waits would stretch high's wait by up to
+  MEDIUM_BURN_MS. With it, low runs at high's priority until it unlocks.
+  Exits 0 if every lock succeeded and high never waited longer than
+  LOW_HOLD_MS plus a couple of ticks.
+
+  Lock results are checked too: a waiter told SYS_ERR_WOULD_BLOCK after
+  mutexRelease() handed it the mutex would never unlock it. That's what
+  Cortex-M did when the result was read before PendSV had switched away;
+  there, blockedResult() now panics if it ever happens again.
+*/
+
+#include "kernel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOW_HOLD_MS     10
+#define MEDIUM_BURN_MS  40
+#define HIGH_PERIOD_MS  23  // Not a multiple of the others, so phases drift
+#define MEDIUM_PERIOD_MS 100
+#define SLACK_MS        2   // Tick granularity on both ends of the wait
+
+static int mutex;
+static uint32_t highWaits = 0;
+static uint32_t highContended = 0;
+static uint32_t highWorstUs = 0;
+static uint32_t mediumBursts = 0;
+static uint32_t lowSections = 0;
+static uint32_t lockFailures = 0;
+
+// Busy for ms of CPU. The host tick only marks a preemption as due, so the
+// loop calls into the kernel to let it happen.
+static void spin(uint32_t ms) {
+  uint32_t start = millis();
+  while (millis() - start < ms) OS::yieldIfNeeded();
+}
+
+static void low() {
+  for (;;) {
+    if (OS::mutexLock(mutex) != SYS_OK) {
+      lockFailures++;  // Not ours; unlocking would fail too
+      OS::sleep(3);
+      continue;
+    }
+    lowSections++;
+    spin(LOW_HOLD_MS);
+    OS::mutexUnlock(mutex);
+    OS::sleep(3);
+  }
+}
+
+static void medium() {
+  mediumBursts++;
+  spin(MEDIUM_BURN_MS);
+}
+
+static void high() {
+  uint32_t start = micros();
+  int locked = OS::mutexLock(mutex);
+  uint32_t waited = micros() - start;
+  if (locked != SYS_OK) {
+    lockFailures++;
+    return;
+  }
+  OS::mutexUnlock(mutex);
+
+  highWaits++;
+  if (waited > 100) highContended++;
+  if (waited > highWorstUs) highWorstUs = waited;
+}
+
+int main(int argc, char** argv) {
+  uint32_t seconds = (argc > 1) ? (uint32_t)atoi(argv[1]) : 3;
+
+  Kernel::init();
+  mutex = OS::mutexCreate("shared");
+  Kernel::createTask("low", low);
+  if (Kernel::createPeriodicTask("medium", medium, MEDIUM_PERIOD_MS, MEDIUM_PERIOD_MS,
+                                 MEDIUM_BURN_MS + 5) < 0 ||
+      Kernel::createPeriodicTask("high", high, HIGH_PERIOD_MS, HIGH_PERIOD_MS, 1) < 0) {
+    printf("periodic tasks not admitted\n");
+    return 1;
+  }
+
+  uint32_t start = millis();
+  while (millis() - start < seconds * 1000) OS::sleep(10);
+
+  uint32_t boundUs = (LOW_HOLD_MS + SLACK_MS) * 1000;
+  bool ok = lockFailures == 0 && highContended > 0 && highWorstUs <= boundUs;
+  printf("low held the mutex %u times for %d ms; medium burned %d ms %u times\n",
+         lowSections, LOW_HOLD_MS, MEDIUM_BURN_MS, mediumBursts);
+  printf("high took it %u times, %u after waiting; worst wait %u us (bound %u us)\n",
+         highWaits, highContended, highWorstUs, boundUs);
+  if (lockFailures) printf("%u locks failed\n", lockFailures);
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
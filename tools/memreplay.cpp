@@ -0,0 +1,376 @@
+/*
+  memreplay - Replays a malloc trace against the kernel allocator on a
+  Linux host and reports what it cost
+
+  Record the trace on the board with KERNEL_MEM_TRACE set to the number of
+  entries to keep, save it with the shell's memtrace command, and copy the
+  file off the SD card. Build against the kernel's host port, with the
+  same Arduino API stand-ins (Arduino.h, SD.h, Wire.h, SPI.h) that port is
+  built with on the include path:
+
+    g++ -std=c++17 -O2 -I<stand-ins> -I.. memreplay.cpp ../kernel.cpp <stand-ins>.cpp
+    ./a.out memtrace.csv [samples]
+
+  Everything replays from loop(), so task arenas are left out and the
+  figures are for the shared heap regions. A free of a pointer the trace
+  never saw allocated (from before the ring's window) is skipped and
+  counted. Where the trace shows the board idle for a millisecond or more,
+  background compaction gets a step per millisecond, as idle() would.
+
+  The same trace then runs against a model of the heap the TLSF allocator
+  replaced (bump allocation, free only marks, compaction when the end is
+  reached) in a KERNEL_HEAP_SIZE buffer, as it had, and the two are
+  compared. The model is called directly, so its times leave out the
+  syscall and the kernel lock that the TLSF times include; what the lock
+  costs on its own is printed alongside.
+*/
+
+#include "kernel.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+struct OpCost {
+  const char* name;
+  uint32_t count;
+  uint64_t totalNs;
+  uint64_t maxNs;
+};
+
+static uint64_t clockOverheadNs = 0;
+
+static uint64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void charge(OpCost* cost, uint64_t start) {
+  uint64_t ns = nowNs() - start;
+  ns = (ns > clockOverheadNs) ? ns - clockOverheadNs : 0;
+  cost->count++;
+  cost->totalNs += ns;
+  if (ns > cost->maxNs) cost->maxNs = ns;
+}
+
+/*
+ * The heap before TLSF: each block gets a 16-byte header (its layout on a
+ * 32-bit board) and is cut from the end of the used area; free() only
+ * marks it. When the end is reached, compaction drops the free blocks off
+ * the end and retries. Raw pointers never move, so a gap behind a live
+ * block stays lost until everything after it is freed too.
+ */
+struct BaselineBlock {
+  uint32_t size;
+  int32_t ownerTaskId;
+  uint32_t inUse;
+  int32_t handleId;
+};
+
+struct BaselineHeap {
+  std::vector<uint8_t> heap;
+  size_t used = 0;
+  size_t peak = 0;
+  uint32_t compactions = 0;
+  uint32_t failures = 0;
+
+  explicit BaselineHeap(size_t capacity) : heap(capacity) {}
+
+  void compact() {
+    compactions++;
+    size_t pos = 0;
+    size_t end = 0;
+    while (pos < used) {
+      BaselineBlock* block = (BaselineBlock*)&heap[pos];
+      pos += sizeof(BaselineBlock) + block->size;
+      if (block->inUse) end = pos;
+    }
+    used = end;
+  }
+
+  void* alloc(size_t size) {
+    if (size == 0) return nullptr;
+    size = (size + 3) & ~(size_t)3;
+    size_t total = sizeof(BaselineBlock) + size;
+    if (used + total > heap.size()) {
+      compact();
+      if (used + total > heap.size()) {
+        failures++;
+        return nullptr;
+      }
+    }
+    BaselineBlock* block = (BaselineBlock*)&heap[used];
+    block->size = (uint32_t)size;
+    block->ownerTaskId = 0;
+    block->inUse = 1;
+    block->handleId = -1;
+    used += total;
+    if (used > peak) peak = used;
+    return block + 1;
+  }
+
+  void free(void* ptr) {
+    ((BaselineBlock*)ptr - 1)->inUse = 0;
+  }
+
+  // It had no realloc: a new block, a copy, and the old one freed
+  void* realloc(void* ptr, size_t size) {
+    void* fresh = alloc(size);
+    if (!fresh) return nullptr;
+    size_t old = ((BaselineBlock*)ptr - 1)->size;
+    memcpy(fresh, ptr, old < size ? old : size);
+    free(ptr);
+    return fresh;
+  }
+};
+
+struct ReplayResult {
+  OpCost costs[3];
+  uint32_t failedHere;
+};
+
+static ReplayResult replayBaseline(const std::vector<MemTraceEntry>& trace, BaselineHeap* heap) {
+  ReplayResult r = {{{"alloc", 0, 0, 0}, {"free", 0, 0, 0}, {"realloc", 0, 0, 0}}, 0};
+  std::unordered_map<uintptr_t, void*> live;
+  for (const MemTraceEntry& e : trace) {
+    bool isAlloc = e.op == MEM_TRACE_ALLOC || (e.op == MEM_TRACE_REALLOC && !e.aux);
+    bool isFree = e.op == MEM_TRACE_FREE || (e.op == MEM_TRACE_REALLOC && !e.size);
+    if (isAlloc) {
+      if (!e.ptr) continue;
+      // Aligned requests ask for the padding the kernel would have used
+      size_t size = (e.op == MEM_TRACE_ALLOC && e.aux) ? e.size + e.aux : e.size;
+      uint64_t start = nowNs();
+      void* p = heap->alloc(size);
+      charge(&r.costs[0], start);
+      if (!p) {
+        r.failedHere++;
+      } else {
+        live[e.ptr] = p;
+      }
+    } else if (isFree) {
+      auto it = live.find((e.op == MEM_TRACE_FREE) ? e.ptr : e.aux);
+      if (it == live.end()) continue;
+      uint64_t start = nowNs();
+      heap->free(it->second);
+      charge(&r.costs[1], start);
+      live.erase(it);
+    } else if (e.op == MEM_TRACE_REALLOC) {
+      auto it = live.find(e.aux);
+      if (it == live.end() || !e.ptr) continue;
+      uint64_t start = nowNs();
+      void* p = heap->realloc(it->second, e.size);
+      charge(&r.costs[2], start);
+      if (!p) {
+        r.failedHere++;
+        continue;
+      }
+      live.erase(it);
+      live[e.ptr] = p;
+    }
+  }
+  return r;
+}
+
+static size_t heapUsed() {
+  size_t used = 0;
+  MemRegionInfo info;
+  for (int r = 0; r < MEM_REGION_COUNT; r++) {
+    if (OS::memRegionInfo(r, &info) == SYS_OK) used += info.used;
+  }
+  return used;
+}
+
+static void printSample(size_t op, uint32_t traceMicros) {
+  printf("%8zu %10.1f %10zu", op, traceMicros / 1000.0, heapUsed());
+  MemRegionInfo info;
+  for (int r = 0; r < MEM_REGION_COUNT; r++) {
+    if (OS::memRegionInfo(r, &info) == SYS_OK && info.size) {
+      printf("  %s %3d%%", info.name, info.fragmentation);
+    }
+  }
+  printf("\n");
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <memtrace.csv> [samples]\n", argv[0]);
+    return 2;
+  }
+  FILE* in = fopen(argv[1], "r");
+  if (!in) {
+    perror(argv[1]);
+    return 1;
+  }
+  int samples = (argc > 2) ? atoi(argv[2]) : 20;
+  if (samples < 1) samples = 1;
+  
+  std::vector<MemTraceEntry> trace;
+  char line[160];
+  while (fgets(line, sizeof(line), in)) {
+    unsigned long micros, size, ptr, aux, site;
+    unsigned hint;
+    int task;
+    char op;
+    if (sscanf(line, "%lu,%c,%d,%lu,%u,%lx,%lx,%lx", &micros, &op, &task, &size, &hint,
+               &ptr, &aux, &site) != 8) {
+      continue;  // The header, or a line cut short
+    }
+    MemTraceEntry e;
+    e.micros = (uint32_t)micros;
+    e.size = (uint32_t)size;
+    e.ptr = ptr;
+    e.aux = aux;
+    e.site = site;
+    e.taskId = (int16_t)task;
+    e.op = (uint8_t)op;
+    e.hint = (uint8_t)hint;
+    trace.push_back(e);
+  }
+  fclose(in);
+  if (trace.empty()) {
+    fprintf(stderr, "%s: no trace entries\n", argv[1]);
+    return 1;
+  }
+  
+  uint64_t least = UINT64_MAX;
+  for (int i = 0; i < 1000; i++) {
+    uint64_t start = nowNs();
+    uint64_t ns = nowNs() - start;
+    if (ns < least) least = ns;
+  }
+  clockOverheadNs = least;
+  
+  Kernel::init();
+  size_t baseline = heapUsed();
+  
+  OpCost costs[] = {{"alloc", 0, 0, 0}, {"free", 0, 0, 0}, {"realloc", 0, 0, 0}};
+  OpCost* allocCost = &costs[0];
+  OpCost* freeCost = &costs[1];
+  OpCost* reallocCost = &costs[2];
+  std::unordered_map<uintptr_t, void*> live;  // Traced pointer -> replayed one
+  uint32_t unmatched = 0;
+  uint32_t failedOnBoard = 0;
+  uint32_t failedHere = 0;
+  size_t peak = baseline;
+  size_t step = (trace.size() + samples - 1) / samples;
+  
+  printf("%8s %10s %10s  fragmentation\n", "op", "trace ms", "heap used");
+  for (size_t i = 0; i < trace.size(); i++) {
+    const MemTraceEntry& e = trace[i];
+    if (i > 0 && e.micros - trace[i - 1].micros >= 1000) {
+      for (uint32_t ms = (e.micros - trace[i - 1].micros) / 1000; ms > 0; ms--) {
+        if (!Kernel::memCompactIdle()) break;
+      }
+    }
+    if (i % step == 0) printSample(i, e.micros - trace[0].micros);
+    
+    bool isAlloc = e.op == MEM_TRACE_ALLOC || (e.op == MEM_TRACE_REALLOC && !e.aux);
+    bool isFree = e.op == MEM_TRACE_FREE || (e.op == MEM_TRACE_REALLOC && !e.size);
+    if (isAlloc) {
+      if (!e.ptr) {
+        failedOnBoard++;
+        continue;
+      }
+      uint64_t start = nowNs();
+      void* p = (e.op == MEM_TRACE_ALLOC && e.aux) ?
+          Kernel::memAllocAligned(e.size, e.aux, (MemHint)e.hint) : OS::malloc(e.size, (MemHint)e.hint);
+      charge(allocCost, start);
+      if (!p) {
+        failedHere++;
+      } else {
+        live[e.ptr] = p;
+      }
+    } else if (isFree) {
+      uintptr_t traced = (e.op == MEM_TRACE_FREE) ? e.ptr : e.aux;
+      if (!traced) continue;
+      auto it = live.find(traced);
+      if (it == live.end()) {
+        unmatched++;
+        continue;
+      }
+      uint64_t start = nowNs();
+      OS::free(it->second);
+      charge(freeCost, start);
+      live.erase(it);
+    } else if (e.op == MEM_TRACE_REALLOC) {
+      auto it = live.find(e.aux);
+      if (it == live.end()) {
+        unmatched++;
+        continue;
+      }
+      if (!e.ptr) {
+        failedOnBoard++;  // The old block stayed where it was
+        continue;
+      }
+      uint64_t start = nowNs();
+      void* p = OS::realloc(it->second, e.size);
+      charge(reallocCost, start);
+      if (!p) {
+        failedHere++;
+        continue;
+      }
+      live.erase(it);
+      live[e.ptr] = p;
+    }
+    size_t used = heapUsed();
+    if (used > peak) peak = used;
+  }
+  printSample(trace.size(), trace.back().micros - trace[0].micros);
+  
+  printf("\n%zu entries over %.1f ms of trace\n", trace.size(),
+         (trace.back().micros - trace[0].micros) / 1000.0);
+  for (const OpCost& c : costs) {
+    if (!c.count) continue;
+    printf("%-8s %8u ops  %7.1f ns/op avg  %7llu ns max\n", c.name, c.count,
+           (double)c.totalNs / c.count, (unsigned long long)c.maxNs);
+  }
+  
+  MemRegionInfo info;
+  for (int r = 0; r < MEM_REGION_COUNT; r++) {
+    if (OS::memRegionInfo(r, &info) != SYS_OK || !info.size) continue;
+    printf("%-6s peak %zu of %zu bytes, %u spilled elsewhere, %u failed\n", info.name, info.peak,
+           info.size, info.spills, info.failures);
+  }
+  printf("Peak heap use %zu bytes (%zu of it the kernel's own)\n", peak, baseline);
+  
+  CompactStats compact;
+  OS::compactInfo(&compact);
+  printf("Compaction: %u sweeps, %u steps, %u blocks / %u bytes moved\n", compact.passes,
+         compact.steps, compact.blocksMoved, compact.bytesMoved);
+  printf("Skipped: %u frees of unseen pointers, %u failed on the board; %u failed here\n",
+         unmatched, failedOnBoard, failedHere);
+  
+  // Kernel::ticks() is one trip through the kernel lock and a clock read
+  uint64_t lockNs = UINT64_MAX;
+  for (int i = 0; i < 1000; i++) {
+    uint64_t start = nowNs();
+    Kernel::ticks();
+    uint64_t ns = nowNs() - start;
+    if (ns < lockNs) lockNs = ns;
+  }
+  lockNs = (lockNs > clockOverheadNs) ? lockNs - clockOverheadNs : 0;
+  
+  BaselineHeap bump(KERNEL_HEAP_SIZE);
+  bump.alloc(baseline);  // The kernel's own blocks, as a stand-in
+  ReplayResult was = replayBaseline(trace, &bump);
+  
+  printf("\nBump-pointer heap of %u bytes (the kernel lock alone costs %llu ns here):\n",
+         (unsigned)KERNEL_HEAP_SIZE, (unsigned long long)lockNs);
+  printf("%-8s %15s %15s\n", "ns/op", "TLSF", "bump");
+  for (int i = 0; i < 3; i++) {
+    const OpCost& now = costs[i];
+    const OpCost& then = was.costs[i];
+    if (!now.count && !then.count) continue;
+    printf("%-8s %7.1f avg %3s %7.1f avg\n", now.name,
+           now.count ? (double)now.totalNs / now.count : 0.0, "",
+           then.count ? (double)then.totalNs / then.count : 0.0);
+    printf("%-8s %7llu max %3s %7llu max\n", "", (unsigned long long)now.maxNs, "",
+           (unsigned long long)then.maxNs);
+  }
+  printf("%-8s %11zu %15zu\n", "peak", peak, bump.peak);
+  printf("%-8s %11u %15u\n", "failed", failedHere, was.failedHere);
+  printf("Bump heap compacted %u times\n", bump.compactions);
+  return 0;
+}
@@ -0,0 +1,107 @@
+/*
+  pressurecheck - Runs the kernel out of memory on a Linux host with tasks
+  listening for pressure messages, and checks it fails cleanly
+
+  Build against the kernel's host port like memreplay, with the Arduino
+  API stand-ins on the include path:
+
+    g++ -std=c++17 -O2 -I<stand-ins> -I.. pressurecheck.cpp ../kernel.cpp <stand-ins>.cpp
+    ./a.out
+
+  With the watermarks at 0 only OOM is reported. The listeners sign up
+  with the heap all but full, before any message has come their way, then
+  it's filled to the last block and a 32K allocation has to fail: they get
+  their messages in the mailboxes they took when they signed up, and
+  sending them mustn't allocate (or recurse back into the allocator).
+  Exits 0 if it all holds.
+*/
+
+#include "kernel.h"
+
+#include <stdio.h>
+#include <vector>
+
+#define LISTENERS 6
+
+static int signedUp[LISTENERS];
+static int oomMessages[LISTENERS];
+static int slot = 0;
+static bool signUp = false;
+
+static void listener() {
+  int me = slot++;
+  while (!signUp) OS::sleep(1);
+  signedUp[me] = OS::memPressureNotify(true);
+  for (;;) {
+    MemPressureMsg msg;
+    int from;
+    while (OS::receive(&msg, sizeof(msg), &from) > 0) {
+      if (from == IPC_FROM_KERNEL && msg.level == MEM_PRESSURE_OOM) oomMessages[me]++;
+    }
+    OS::sleep(1);
+  }
+}
+
+// Let the listeners run and drain their mailboxes
+static void settle() {
+  uint32_t start = millis();
+  while (millis() - start < 20) OS::sleep(1);
+}
+
+// Big blocks first, then whatever crumbs are left
+static void fill(std::vector<void*>* blocks) {
+  size_t sizes[] = { 32768, 4096, 256, 16 };
+  for (size_t size : sizes) {
+    void* p;
+    while ((p = OS::malloc(size))) blocks->push_back(p);
+  }
+}
+
+int main() {
+  Kernel::init();
+  OS::setWatermarks(0, 0);
+
+  for (int i = 0; i < LISTENERS; i++) {
+    Kernel::createTask("listener", listener);
+  }
+  settle();
+
+  // Fill the heap, then make just enough room for the listeners to sign up
+  std::vector<void*> blocks;
+  void* room = OS::malloc(32768);
+  fill(&blocks);
+  OS::free(room);
+  signUp = true;
+  settle();
+
+  bool ok = true;
+  for (int i = 0; i < LISTENERS; i++) {
+    if (signedUp[i] != SYS_OK) {
+      printf("listener %d: memPressureNotify returned %d\n", i, signedUp[i]);
+      ok = false;
+    }
+  }
+
+  fill(&blocks);
+  settle();
+  int before[LISTENERS];
+  for (int i = 0; i < LISTENERS; i++) before[i] = oomMessages[i];
+
+  void* big = OS::malloc(32768);
+  settle();
+  printf("heap full after %zu blocks, malloc(32768) = %p\n", blocks.size(), big);
+  if (big) ok = false;
+  for (int i = 0; i < LISTENERS; i++) {
+    printf("listener %d: %d OOM messages, %d for the last malloc\n",
+           i, oomMessages[i], oomMessages[i] - before[i]);
+    if (oomMessages[i] - before[i] != 1) ok = false;
+  }
+
+  for (void* p : blocks) OS::free(p);
+  void* again = OS::malloc(32768);
+  if (!again) ok = false;
+  OS::free(again);
+
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
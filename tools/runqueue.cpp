@@ -0,0 +1,194 @@
+/*
+  runqueue - Times picking the next task with the kernel's priority-bitmap
+  run queue against the linear scan over the task table it replaced, for
+  8, 32 and 128 tasks, on a Linux host
+
+  Needs nothing from the kernel build:
+
+    g++ -std=c++17 -O2 runqueue.cpp
+    ./a.out [switches]
+
+  Both sides model one yield: the running task goes back to READY and the
+  next one is picked. The scan is schedule() as it was: every slot of the
+  table is visited (the old Task, file handle flags and stack trace
+  included, so the cache sees the same stride), sleepers are checked
+  against the clock on the way, and the highest priority wins, the first
+  found after the current task on a tie. The bitmap side mirrors
+  readyEnqueue(), readyHighestPriority() and readyPop() in kernel.cpp; a
+  sleeping task isn't on it, so only the earliest sleeper (the top of the
+  sleep heap) is looked at.
+
+  Each run has a quarter of the tasks ready, spread over four priorities,
+  and the rest asleep. Both sides should end on the same task; exits 1 if
+  they don't.
+*/
+
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define MAX_PRIORITIES 32
+
+enum TaskState { TASK_EMPTY = 0, TASK_READY, TASK_RUNNING, TASK_SLEEPING };
+
+// The task table entry schedule() walked before the run queue
+struct StackFrame {
+  void* returnAddress;
+  const char* functionName;
+};
+
+struct OldTask {
+  int id;
+  const char* name;
+  TaskState state;
+  void (*entryPoint)();
+  uint32_t sleepUntil;
+  uint32_t lastRun;
+  uint32_t lastYield;
+  int priority;
+  bool fileHandles[16];
+  bool dirHandles[4];
+  size_t memoryUsed;
+  StackFrame stackTrace[8];
+  int stackTraceDepth;
+  bool permissions[6];
+};
+
+static uint32_t clockNow = 0;  // Stands in for millis(); nobody wakes
+
+static int linearPick(std::vector<OldTask>& tasks, int current) {
+  int n = (int)tasks.size();
+  if (tasks[current].state == TASK_RUNNING) tasks[current].state = TASK_READY;
+  int best = 0;
+  int bestPriority = -1;
+  for (int k = 1; k <= n; k++) {
+    int i = (current + k) % n;
+    OldTask* task = &tasks[i];
+    if (task->state == TASK_EMPTY) continue;
+    if (task->state == TASK_SLEEPING) {
+      if (clockNow >= task->sleepUntil) {
+        task->state = TASK_READY;
+      } else {
+        continue;
+      }
+    }
+    if (task->state == TASK_READY && task->priority > bestPriority) {
+      best = i;
+      bestPriority = task->priority;
+    }
+  }
+  tasks[best].state = TASK_RUNNING;
+  tasks[best].lastRun = clockNow;
+  return best;
+}
+
+struct QueuedTask {
+  int priority;
+  int readyNext;
+  int readyPrev;
+  uint64_t sleepUntil;
+};
+
+struct RunQueue {
+  uint32_t readyBitmap;
+  int count;
+  int head[MAX_PRIORITIES];
+  int tail[MAX_PRIORITIES];
+};
+
+static void readyEnqueue(RunQueue* queue, std::vector<QueuedTask>& tasks, int id) {
+  QueuedTask* task = &tasks[id];
+  int prio = task->priority;
+  int after = queue->tail[prio];
+  task->readyPrev = after;
+  task->readyNext = -1;
+  if (after >= 0) {
+    tasks[after].readyNext = id;
+  } else {
+    queue->head[prio] = id;
+  }
+  queue->tail[prio] = id;
+  queue->readyBitmap |= (1UL << prio);
+  queue->count++;
+}
+
+static int readyPop(RunQueue* queue, std::vector<QueuedTask>& tasks, int prio) {
+  int id = queue->head[prio];
+  queue->head[prio] = tasks[id].readyNext;
+  if (queue->head[prio] >= 0) {
+    tasks[queue->head[prio]].readyPrev = -1;
+  } else {
+    queue->tail[prio] = -1;
+    queue->readyBitmap &= ~(1UL << prio);
+  }
+  queue->count--;
+  return id;
+}
+
+static int readyHighestPriority(const RunQueue* queue) {
+  if (queue->readyBitmap == 0) return -1;
+  return (int)(sizeof(unsigned long) * 8 - 1) - __builtin_clzl((unsigned long)queue->readyBitmap);
+}
+
+static int bitmapPick(RunQueue* queue, std::vector<QueuedTask>& tasks, int current,
+                      uint64_t earliestSleeper) {
+  if (earliestSleeper <= clockNow) return current;  // Would wake it; never happens here
+  readyEnqueue(queue, tasks, current);
+  return readyPop(queue, tasks, readyHighestPriority(queue));
+}
+
+static uint64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char** argv) {
+  long switches = (argc > 1) ? atol(argv[1]) : 2000000;
+  int sizes[] = { 8, 32, 128 };
+
+  printf("%6s %14s %14s %8s\n", "tasks", "scan ns/pick", "bitmap ns/pick", "ratio");
+  for (int n : sizes) {
+    // Every fourth task is ready, at priority 10..13; the rest sleep
+    std::vector<OldTask> old(n);
+    std::vector<QueuedTask> queued(n);
+    RunQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    for (int p = 0; p < MAX_PRIORITIES; p++) queue.head[p] = queue.tail[p] = -1;
+    for (int i = 0; i < n; i++) {
+      memset(&old[i], 0, sizeof(OldTask));
+      old[i].id = i;
+      old[i].priority = 10 + (i / 4) % 4;
+      old[i].state = (i % 4 == 0) ? TASK_READY : TASK_SLEEPING;
+      old[i].sleepUntil = 1000000;
+      queued[i].priority = old[i].priority;
+      queued[i].sleepUntil = 1000000;
+    }
+    old[0].state = TASK_RUNNING;
+    for (int i = 4; i < n; i += 4) readyEnqueue(&queue, queued, i);
+
+    int current = 0;
+    uint64_t start = nowNs();
+    for (long s = 0; s < switches; s++) {
+      current = linearPick(old, current);
+    }
+    double scanNs = (double)(nowNs() - start) / switches;
+    int scanPicked = current;
+
+    current = 0;
+    start = nowNs();
+    for (long s = 0; s < switches; s++) {
+      current = bitmapPick(&queue, queued, current, queued[1].sleepUntil);
+    }
+    double bitmapNs = (double)(nowNs() - start) / switches;
+
+    printf("%6d %14.1f %14.1f %7.1fx\n", n, scanNs, bitmapNs, scanNs / bitmapNs);
+    if (current != scanPicked) {
+      printf("scan ended on task %d, bitmap on %d\n", scanPicked, current);
+      return 1;
+    }
+  }
+  return 0;
+}